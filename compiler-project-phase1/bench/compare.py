@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""Compiles one program with several sets of gsm options and compares them.
+
+For every set it prints the best wall time of a few runs, and the AST nodes,
+IR instructions emitted before optimization, heap growth of each phase and
+peak RSS that -compile-stats-json reports. With --same-output it also checks
+that every set writes the same output as the first one, which is how
+-flat-ast is compared with the pointer-based tree:
+
+    bench/gen-large.py 200000 > big.gsm
+    bench/compare.py --same-output ./gsm big.gsm "" "-flat-ast"
+
+Options in a set are separated by spaces; "" is the default pipeline.
+"""
+
+import argparse
+import json
+import subprocess
+import os
+import sys
+import tempfile
+import time
+
+
+def run(gsm, program, options, output):
+    cmd = [gsm] + options + ["-input-file=" + program, "-o", output]
+    start = time.perf_counter()
+    proc = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    elapsed = time.perf_counter() - start
+    if proc.returncode:
+        sys.exit("%s failed:\n%s" % (" ".join(cmd), proc.stderr))
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-n", "--runs", type=int, default=3, help="timed runs of each set")
+    parser.add_argument("--same-output", action="store_true",
+                        help="fail unless every set writes the same output")
+    parser.add_argument("gsm")
+    parser.add_argument("program")
+    parser.add_argument("sets", nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+
+    outputs = tempfile.TemporaryDirectory()
+    first = None
+    print("%-24s %9s %10s %10s %12s %12s %12s" % ("options", "time (s)", "nodes", "IR", "parse (MB)",
+                                                  "irgen (MB)", "peak RSS (MB)"))
+    for i, opts in enumerate(args.sets):
+        options = opts.split()
+        output = os.path.join(outputs.name, "%d.out" % i)
+        best = min(run(args.gsm, args.program, options, output) for _ in range(args.runs))
+
+        proc = subprocess.run([args.gsm] + options + ["-compile-stats-json", "-input-file=" + args.program,
+                              "-o", "/dev/null"], stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE, text=True)
+        stats = json.loads(proc.stderr)
+        heap = stats["bytes_allocated"]
+        instructions = sum(visit["instructions"] for visit in stats["ir_by_visit"].values())
+        print("%-24s %9.3f %10d %10d %12.1f %12.1f %12.1f" % (opts or "(default)", best, stats["ast_nodes"],
+                                                              instructions, heap["parse"] / 2**20,
+                                                              heap["irgen"] / 2**20,
+                                                              stats["peak_rss_bytes"] / 2**20))
+
+        if args.same_output:
+            with open(output, "rb") as f:
+                data = f.read()
+            if first is None:
+                first = data
+            elif data != first:
+                sys.exit("%s writes a different output than %s" % (opts, args.sets[0] or "(default)"))
+
+
+if __name__ == "__main__":
+    main()
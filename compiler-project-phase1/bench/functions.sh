@@ -0,0 +1,56 @@
+#!/bin/sh
+# Times functions at -O0 and -O2: fib(40) called naively and as a
+# `memo def`, and a 200M-iteration loop that calls a small function against
+# the same loop with the expression written out by hand, which -O2 should
+# make equal by inlining the call. Each program is compiled with `gsm -c`,
+# linked with the runtime and timed as the best wall time of three runs.
+#
+# Usage: bench/functions.sh <gsm>
+#   CC picks the C compiler (default cc).
+
+GSM=$1
+CC=${CC:-cc}
+DIR=${TMPDIR:-/tmp}/gsm-functions-bench.$$
+RUNTIME=$(dirname "$0")/../rtGSM.c
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+
+now() { date +%s.%N; }
+elapsed() { echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'; }
+
+# best <command>: the best wall time of three runs of the command
+best() {
+    B=999999
+    for RUN in 1 2 3; do
+        START=$(now)
+        "$@" >/dev/null || exit 1
+        T=$(elapsed "$START")
+        B=$(echo "$B $T" | awk '{ print $2 < $1 ? $2 : $1 }')
+    done
+    echo "$B"
+}
+
+FIB='def fib(n): begin if n < 2: begin return n; end return fib(n - 1) + fib(n - 2); end
+int r;
+r = fib(40);'
+# Every assignment at the top level prints, so the loops run in a function.
+STEP='def step(x, i): begin return (x * 31 + i) % 1000003; end
+def run(n): begin int i, x; loopc i < n: begin x = step(x, i); i = i + 1; end return x; end
+int r;
+r = run(200000000);'
+INLINE='def run(n): begin int i, x; loopc i < n: begin x = (x * 31 + i) % 1000003; i = i + 1; end return x; end
+int r;
+r = run(200000000);'
+
+echo "$FIB" >"$DIR/naive.gsm"
+echo "memo $FIB" >"$DIR/memo.gsm"
+echo "$STEP" >"$DIR/call.gsm"
+echo "$INLINE" >"$DIR/inline.gsm"
+
+for NAME in naive memo call inline; do
+    for LEVEL in 0 2; do
+        "$GSM" -O$LEVEL -c -o "$DIR/$NAME.o" -input-file="$DIR/$NAME.gsm" || exit 1
+        "$CC" -O2 -o "$DIR/$NAME" "$DIR/$NAME.o" "$RUNTIME" || exit 1
+        printf '%-7s -O%s %8s s\n' "$NAME" $LEVEL "$(best "$DIR/$NAME")"
+    done
+done
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+"""Writes a GSM program with one deeply nested expression.
+
+The program reads a and then assigns it an expression of the given shape,
+nested depth times:
+
+    parens   a = ((...(a)...));
+    right    a = a + (a + (... + a));
+    left     a = a + a + ... + a;
+    guard    if a and a and ... and a: begin a = 2; end
+    value    a = a or (a or (... or a));
+
+Such expressions used to overflow the native stack of the parser and of the
+passes that recursed on operands. Used to time them and, by the tests, to
+check that they compile, e.g.
+
+    bench/gen-deep.py right 1000000 > deep.gsm
+    time ./gsm -input-file=deep.gsm -o /dev/null
+"""
+
+import sys
+
+
+def nested(op, depth):
+    # Right-nested: the closing parentheses all come at the end.
+    return ("a %s (" % op) * depth + "a" + ")" * depth
+
+
+def main():
+    shapes = {
+        "parens": lambda n: "a = %sa%s;" % ("(" * n, ")" * n),
+        "right": lambda n: "a = %s;" % nested("+", n),
+        "left": lambda n: "a = a%s;" % (" + a" * n),
+        "guard": lambda n: "if a%s: begin a = 2; end" % (" and a" * n),
+        "value": lambda n: "a = %s;" % nested("or", n),
+    }
+    if len(sys.argv) < 2 or sys.argv[1] not in shapes:
+        sys.exit("usage: gen-deep.py {%s} [depth=1000000]" % ",".join(shapes))
+    depth = int(sys.argv[2]) if len(sys.argv) > 2 else 1000000
+
+    print("int a;")
+    print("read a;")
+    print(shapes[sys.argv[1]](depth))
+
+
+if __name__ == "__main__":
+    main()
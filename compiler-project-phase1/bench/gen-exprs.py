@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+"""Writes a GSM program of assignments of random expression trees.
+
+Each statement assigns a variable an expression of up to depth levels of
++, - and * over a few variables and the literals 3, 7 and 11, so the same
+subexpressions come back again and again. With a modulus, every right side
+is taken modulo it, which keeps the values small enough for -checked-arith
+when depth is at most 2. Used to show what -hash-cons shares, e.g.
+
+    bench/gen-exprs.py 200000 > exprs.gsm
+    bench/compare.py ./gsm exprs.gsm "" "-hash-cons"
+
+Usage: gen-exprs.py [statements=200000] [depth=4] [variables=26] [modulus]
+"""
+
+import random
+import sys
+
+
+def main():
+    statements = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+    depth = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+    num_vars = int(sys.argv[3]) if len(sys.argv) > 3 else 26
+    modulus = int(sys.argv[4]) if len(sys.argv) > 4 else None
+    rng = random.Random(1)
+
+    names = ["x" + chr(ord("a") + i) for i in range(num_vars)]
+    leaves = names + ["3", "7", "11"]
+
+    def expr(d):
+        if d == 0 or rng.random() < 0.3:
+            return rng.choice(leaves)
+        return "(%s %s %s)" % (expr(d - 1), rng.choice("+-*"), expr(d - 1))
+
+    print("int " + ", ".join(names) + ";")
+    for _ in range(statements):
+        value = expr(depth)
+        if modulus:
+            value = "%s %% %d" % (value, modulus)
+        print("%s = %s;" % (rng.choice(names), value))
+
+
+if __name__ == "__main__":
+    main()
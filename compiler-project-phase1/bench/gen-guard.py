@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+"""Writes a GSM program whose loop guard ends in a long ^ chain.
+
+A function counts the i < n for which
+
+    i % 16 == 0 and i ^ 3 ^ 3 ^ ... ^ 3 != 1      (order "short")
+    i ^ 3 ^ 3 ^ ... ^ 3 != 1 and i % 16 == 0      (order "long")
+
+holds, with powers ^ 3 in the chain. Both orders count the same numbers, but
+with short-circuit evaluation the chain only runs for one i in 16 in the
+first one. Used to show the effect of short-circuiting, e.g.
+
+    bench/gen-guard.py 40 short > short.gsm
+    bench/gen-guard.py 40 long > long.gsm
+    time ./gsm -run -O2 -input-file=short.gsm -- 50000000
+    time ./gsm -run -O2 -input-file=long.gsm -- 50000000
+"""
+
+import sys
+
+
+def main():
+    powers = int(sys.argv[1]) if len(sys.argv) > 1 else 40
+    order = sys.argv[2] if len(sys.argv) > 2 else "short"
+    if order not in ("short", "long"):
+        sys.exit("usage: gen-guard.py [powers=40] [short|long]")
+
+    cheap = "i % 16 == 0"
+    chain = "i" + " ^ 3" * powers + " != 1"
+    guard = cheap + " and " + chain if order == "short" else chain + " and " + cheap
+
+    print("def count(n): begin")
+    print("  int i, s;")
+    print("  loopc i < n: begin")
+    print("    if %s: begin s = s + 1; end" % guard)
+    print("    i = i + 1;")
+    print("  end")
+    print("  return s;")
+    print("end")
+    print("int n, r;")
+    print("read n;")
+    print("r = count(n);")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Writes a long GSM program whose values depend on its input.
+
+The program reads its variables first, so the optimizer cannot fold it to
+constants the way it folds a program made of literals. Its statements are
+assignments, conditions and bounded loops over those variables, in the
+proportions of a hand-written program. Used to time -chunk-size and
+-threads, e.g.
+
+    bench/gen-large.py 20000 > large.gsm
+    time ./gsm -O2 -c -o /dev/null -input-file=large.gsm
+    time ./gsm -O2 -c -o /dev/null -input-file=large.gsm -chunk-size=500
+"""
+
+import random
+import sys
+
+
+def name(i):
+    # Identifiers are letters only; a leading v keeps them off the keywords.
+    s = "v"
+    while True:
+        s += chr(ord("a") + i % 26)
+        i //= 26
+        if not i:
+            return s
+
+
+def main():
+    statements = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    num_vars = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+    rng = random.Random(int(sys.argv[3]) if len(sys.argv) > 3 else 1)
+
+    names = [name(i) for i in range(num_vars)]
+    out = ["int " + ", ".join(names) + ";", "read " + ", ".join(names) + ";"]
+
+    def operand():
+        return rng.choice(names) if rng.random() < 0.7 else str(rng.randint(1, 99))
+
+    def expr():
+        op = rng.choice(["+", "-", "*", "%"])
+        rhs = str(rng.randint(2, 99)) if op == "%" else operand()
+        return "%s %s %s" % (operand(), op, rhs)
+
+    for _ in range(statements):
+        kind = rng.random()
+        var = rng.choice(names)
+        if kind < 0.75:
+            out.append("%s = %s;" % (var, expr()))
+        elif kind < 0.9:
+            out.append("if %s > %s: begin %s = %s; end else: begin %s = %s; end"
+                       % (var, operand(), var, expr(), var, expr()))
+        else:
+            # The counter starts below 50 and grows, so the loop ends.
+            out.append("%s = %s %% 50; loopc %s < 100: begin %s = %s + %d; end"
+                       % (var, var, var, var, var, rng.randint(1, 9)))
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+"""Writes a GSM program made mostly of number literals.
+
+Each statement assigns a variable a sum and difference of six random 31-bit
+literals, so lexing and decoding numbers dominates the front end. Used to
+time literal decoding; -emit-ast stops after the checks, e.g.
+
+    bench/gen-literals.py 200000 > literals.gsm
+    time ./gsm -emit-ast=/dev/null -input-file=literals.gsm
+
+Usage: gen-literals.py [statements=200000]
+"""
+
+import random
+import sys
+
+
+def main():
+    statements = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+    rng = random.Random(1)
+
+    names = ["v" + chr(ord("a") + i) for i in range(26)]
+    print("int " + ", ".join(names) + ";")
+    for _ in range(statements):
+        terms = [str(rng.randint(0, 2**31 - 1)) for _ in range(6)]
+        value = terms[0]
+        for term in terms[1:]:
+            value += " %s %s" % (rng.choice("+-"), term)
+        print("%s = %s;" % (rng.choice(names), value))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""Drives `gsm -lsp` with edits to a program from gen-large.py.
+
+check  makes random edits: pieces of GSM such as begin, end, a declaration
+       or a semicolon typed in, random deletions, and undos of earlier
+       edits. After each one the diagnostics published for the edited
+       document must equal those of a second document opened with the same
+       text, which is parsed from scratch. Exits with 1 on the first
+       difference.
+time   opens the program and prints the median round trip from didChange
+       to publishDiagnostics for a few kinds of edits.
+
+    bench/lsp-edits.py check ./gsm 300 300
+    bench/lsp-edits.py time ./gsm 200000
+
+Usage: lsp-edits.py {check,time} gsm [edits=300] [statements]
+       statements defaults to 300 for check and 200000 for time.
+"""
+
+import json
+import os
+import random
+import statistics
+import subprocess
+import sys
+import time
+
+
+class Server:
+    def __init__(self, gsm):
+        self.proc = subprocess.Popen([gsm, "-lsp"], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.next_id = 0
+        self.request("initialize", {"capabilities": {}})
+
+    def send(self, message):
+        message["jsonrpc"] = "2.0"
+        body = json.dumps(message).encode()
+        self.proc.stdin.write(b"Content-Length: %d\r\n\r\n" % len(body) + body)
+        self.proc.stdin.flush()
+
+    def receive(self):
+        length = None
+        while True:
+            line = self.proc.stdout.readline()
+            if not line:
+                sys.exit("gsm -lsp exited with %s" % self.proc.wait())
+            line = line.strip()
+            if not line and length is not None:
+                return json.loads(self.proc.stdout.read(length))
+            if line.lower().startswith(b"content-length:"):
+                length = int(line.split(b":")[1])
+
+    def request(self, method, params):
+        self.next_id += 1
+        self.send({"id": self.next_id, "method": method, "params": params})
+        while True:
+            message = self.receive()
+            if message.get("id") == self.next_id:
+                return message.get("result")
+
+    def diagnostics(self, uri):
+        # The notification published for uri after the last change.
+        while True:
+            message = self.receive()
+            if message.get("method") == "textDocument/publishDiagnostics" and message["params"]["uri"] == uri:
+                return sorted((d["range"]["start"]["line"], d["range"]["start"]["character"],
+                               d["range"]["end"]["line"], d["range"]["end"]["character"], d["message"])
+                              for d in message["params"]["diagnostics"])
+
+    def open(self, uri, text):
+        self.send({"method": "textDocument/didOpen",
+                   "params": {"textDocument": {"uri": uri, "languageId": "gsm", "version": 0, "text": text}}})
+        return self.diagnostics(uri)
+
+    def change(self, uri, start, end, text):
+        self.send({"method": "textDocument/didChange",
+                   "params": {"textDocument": {"uri": uri},
+                              "contentChanges": [{"range": {"start": start, "end": end}, "text": text}]}})
+        return self.diagnostics(uri)
+
+    def close(self, uri):
+        self.send({"method": "textDocument/didClose", "params": {"textDocument": {"uri": uri}}})
+        self.diagnostics(uri)
+
+    def exit(self):
+        self.request("shutdown", None)
+        self.send({"method": "exit"})
+        return self.proc.wait()
+
+
+def position(text, offset):
+    line = text.count("\n", 0, offset)
+    return {"line": line, "character": offset - (text.rfind("\n", 0, offset) + 1)}
+
+
+def generate(statements):
+    gen = os.path.join(os.path.dirname(os.path.abspath(__file__)), "gen-large.py")
+    return subprocess.run([sys.executable, gen, str(statements)], stdout=subprocess.PIPE,
+                          text=True, check=True).stdout
+
+
+# What the random edits type: pieces that open and close blocks, move
+# declarations and uses of variables and functions, and break statements.
+PIECES = ["begin ", " end", ";", "\n", "int va;", "int zz;", "zz = 1;", " va", " zz", "+ 1", "/ 0",
+          "if va: ", "loopc va < 3: ", "read va;", "def f(a): begin return a; end", "f(1)", "f(1, 2)",
+          "int f;", "else: ", "=", "(", ")"]
+
+
+def check(server, edits, statements):
+    rng = random.Random(1)
+    text = generate(statements)
+    server.open("file:///edited.gsm", text)
+    undo = []  # (offset, inserted length, replaced text) of the edits made
+    diagnosed = 0
+    for n in range(edits):
+        # Three edits in five take back the last one, so the text often
+        # returns to the generated program, which has no errors.
+        if undo and rng.random() < 0.6:
+            start, length, insert = undo.pop()
+            end = start + length
+        else:
+            start = rng.randrange(len(text) + 1)
+            end = min(len(text), start + rng.choice([0, 0, 1, 3, 10, 40]))
+            insert = rng.choice(PIECES) if rng.random() < 0.7 else ""
+            undo.append((start, len(insert), text[start:end]))
+        replaced = text[start:end]
+        got = server.change("file:///edited.gsm", position(text, start), position(text, end), insert)
+        text = text[:start] + insert + text[end:]
+        expected = server.open("file:///fresh.gsm", text)
+        server.close("file:///fresh.gsm")
+        if got != expected:
+            sys.exit("edit %d: replacing %r at offset %d with %r gave\n  %s\nbut parsing from scratch gives\n  %s"
+                     % (n, replaced, start, insert, got[:5], expected[:5]))
+        diagnosed += bool(got)
+    print("%d edits, %d with diagnostics, all match" % (edits, diagnosed))
+
+
+def time_edits(server, edits, statements):
+    text = generate(statements)
+    start = time.perf_counter()
+    server.open("file:///program.gsm", text)
+    print("%d bytes, %d statements: open %.3f s" % (len(text), statements, time.perf_counter() - start))
+
+    # Each kind of edit is made and undone, so the text stays the same.
+    middle = text.index("\n", len(text) // 2) + 1
+    statement = text[middle:text.index("\n", middle) + 1]
+    kinds = [
+        ("type a character in a statement", middle + 1, 0, " "),
+        ("insert a statement line", middle, 0, statement),
+        ("add a declaration", middle, 0, "int zz;\n"),
+    ]
+    for name, offset, length, insert in kinds:
+        edited = text[:offset] + insert + text[offset + length:]
+        start, end = position(text, offset), position(text, offset + length)
+        undo_end = position(edited, offset + len(insert))
+        times = []
+        for _ in range(edits):
+            begin = time.perf_counter()
+            server.change("file:///program.gsm", start, end, insert)
+            times.append(time.perf_counter() - begin)
+            server.change("file:///program.gsm", start, undo_end, text[offset:offset + length])
+        print("%-34s %8.2f ms" % (name + ":", statistics.median(times) * 1000))
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in ("check", "time"):
+        sys.exit("usage: lsp-edits.py {check,time} gsm [edits=300] [statements]")
+    edits = int(sys.argv[3]) if len(sys.argv) > 3 else 300
+    default_statements = 300 if sys.argv[1] == "check" else 200000
+    statements = int(sys.argv[4]) if len(sys.argv) > 4 else default_statements
+
+    server = Server(sys.argv[2])
+    if sys.argv[1] == "check":
+        check(server, edits, statements)
+    else:
+        time_edits(server, edits, statements)
+    if server.exit():
+        sys.exit("gsm -lsp did not exit cleanly")
+
+
+if __name__ == "__main__":
+    main()
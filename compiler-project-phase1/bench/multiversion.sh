@@ -0,0 +1,42 @@
+#!/bin/sh
+# Compares a program compiled with and without -multiversion: the time of
+# `gsm -O2 -c`, the size of .text and the best wall time of three runs of
+# the linked program, each with the arguments given after the program.
+#
+# Usage: bench/multiversion.sh <gsm> <program.gsm> [arguments...]
+#   CC picks the C compiler (default cc).
+
+GSM=$1
+PROGRAM=$2
+shift 2
+CC=${CC:-cc}
+DIR=${TMPDIR:-/tmp}/gsm-multiversion-bench.$$
+RUNTIME=$(dirname "$0")/../rtGSM.c
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+
+now() { date +%s.%N; }
+elapsed() { echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'; }
+
+# best <command>: the best wall time of three runs of the command
+best() {
+    B=999999
+    for RUN in 1 2 3; do
+        START=$(now)
+        "$@" >/dev/null || exit 1
+        T=$(elapsed "$START")
+        B=$(echo "$B $T" | awk '{ print $2 < $1 ? $2 : $1 }')
+    done
+    echo "$B"
+}
+
+for NAME in plain multiversion; do
+    OPTIONS=
+    [ $NAME = multiversion ] && OPTIONS=-multiversion
+    START=$(now)
+    "$GSM" -O2 -c $OPTIONS -o "$DIR/$NAME.o" -input-file="$PROGRAM" || exit 1
+    COMPILE=$(elapsed "$START")
+    "$CC" -O2 -o "$DIR/$NAME" "$DIR/$NAME.o" "$RUNTIME" || exit 1
+    TEXT=$(size -A "$DIR/$NAME.o" | awk '$1 == ".text" { print $2 }')
+    echo "$NAME: compile $COMPILE s, .text $TEXT bytes, run $(best "$DIR/$NAME" "$@") s"
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Times the read statement on millions of values. A program that reads until
+# it gets a 0 is compiled with gsm and linked with rtGSM.c; it is then fed
+# count random values, and a 0, from a file given with -f (mapped), from
+# stdin redirected from that file (also mapped) and from a pipe (read in one
+# go). Each way prints the best wall time of three runs, in seconds.
+#
+# Usage: bench/read.sh <gsm> [count=5000000]
+#   CC picks the C compiler (default cc).
+
+GSM=$1
+COUNT=${2:-5000000}
+CC=${CC:-cc}
+DIR=${TMPDIR:-/tmp}/gsm-read-bench.$$
+RUNTIME=$(dirname "$0")/../rtGSM.c
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+
+"$GSM" -O2 -c -o "$DIR/read.o" "int a = 1; loopc a != 0: begin read a; end" || exit 1
+"$CC" -O2 -o "$DIR/read" "$DIR/read.o" "$RUNTIME" || exit 1
+awk -v n="$COUNT" 'BEGIN { srand(1); for (i = 0; i < n; ++i) printf "%d%s", int(rand() * 4294967295) - 2147483647, i % 8 == 7 ? "\n" : ", "; print 0 }' >"$DIR/input"
+
+now() { date +%s.%N; }
+
+# best <command>: the best wall time of three runs of the command
+best() {
+    B=999999
+    for RUN in 1 2 3; do
+        START=$(now)
+        sh -c "$1" >/dev/null || exit 1
+        T=$(echo "$START $(now)" | awk '{ printf "%.3f", $2 - $1 }')
+        B=$(echo "$B $T" | awk '{ print $2 < $1 ? $2 : $1 }')
+    done
+    echo "$B"
+}
+
+echo "$COUNT values, $(wc -c <"$DIR/input") bytes"
+echo "-f file:           $(best "'$DIR/read' -f '$DIR/input'") s"
+echo "stdin from a file: $(best "'$DIR/read' <'$DIR/input'") s"
+echo "stdin from a pipe: $(best "cat '$DIR/input' | '$DIR/read'") s"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Times the semantic walk of one or more gsm binaries, e.g. before and after
+# a change to the visitors. A program from gen-large.py is compiled twice:
+# ending in a syntax error, gsm stops after parsing it; ending in a use of an
+# undeclared variable, it stops after parsing and checking it. The difference
+# of the best of five runs of each is the walk.
+#
+# Usage: bench/sema-walk.sh [-s statements] <gsm>...
+#   statements defaults to 2000000, which is about 60 MB of program.
+
+STATEMENTS=2000000
+if [ "$1" = "-s" ]; then
+    STATEMENTS=$2
+    shift 2
+fi
+DIR=${TMPDIR:-/tmp}/gsm-sema-walk.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+
+python3 "$(dirname "$0")/gen-large.py" "$STATEMENTS" >"$DIR/program.gsm" || exit 1
+cp "$DIR/program.gsm" "$DIR/syntax.gsm"
+echo "int ;" >>"$DIR/syntax.gsm"
+cp "$DIR/program.gsm" "$DIR/sema.gsm"
+echo "undeclared = 1;" >>"$DIR/sema.gsm"
+
+now() { date +%s.%N; }
+
+# best <gsm> <file>: the best wall time of five runs that fail on file
+best() {
+    B=999999
+    for RUN in 1 2 3 4 5; do
+        START=$(now)
+        if "$1" -input-file="$2" -o /dev/null 2>/dev/null; then
+            echo "$1 compiled $2" >&2
+            exit 1
+        fi
+        T=$(echo "$START $(now)" | awk '{ printf "%.3f", $2 - $1 }')
+        B=$(echo "$B $T" | awk '{ print $2 < $1 ? $2 : $1 }')
+    done
+    echo "$B"
+}
+
+echo "$(wc -c <"$DIR/program.gsm") bytes of program"
+for GSM in "$@"; do
+    PARSE=$(best "$GSM" "$DIR/syntax.gsm") || exit 1
+    CHECK=$(best "$GSM" "$DIR/sema.gsm") || exit 1
+    echo "$GSM: parse $PARSE s, parse and check $CHECK s, walk $(echo "$PARSE $CHECK" | awk '{ printf "%.3f", $2 - $1 }') s"
+done
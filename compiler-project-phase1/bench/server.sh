@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compares the latency of compiling a small program with `gsm -O2 -c`,
+# started anew for every request, with that of sending the same request to
+# a compile server through gsm-client. Prints the mean time of a request,
+# the best of three runs of the given number of requests each way.
+#
+# Usage: bench/server.sh <gsm> <gsm-client> [requests=50]
+
+GSM=$1
+CLIENT=$2
+REQUESTS=${3:-50}
+DIR=${TMPDIR:-/tmp}/gsm-server-bench.$$
+SERVER=
+trap '[ -n "$SERVER" ] && kill $SERVER; rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+
+now() { date +%s.%N; }
+elapsed() { echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'; }
+
+# best <command>: the best wall time of three runs of the command
+best() {
+    B=999999
+    for RUN in 1 2 3; do
+        START=$(now)
+        "$@" >/dev/null || exit 1
+        T=$(elapsed "$START")
+        B=$(echo "$B $T" | awk '{ print $2 < $1 ? $2 : $1 }')
+    done
+    echo "$B"
+}
+
+# requests <command>: runs the compile request with the command REQUESTS times
+requests() {
+    N=0
+    while [ $N -lt "$REQUESTS" ]; do
+        "$@" -O2 -c -o "$DIR/prog.o" -input-file="$DIR/prog.gsm" || return 1
+        N=$((N + 1))
+    done
+}
+
+printf 'int a, b;\nread a, b;\nloopc a < b: begin a = a * 2 + 1; end\nb = a;\n' >"$DIR/prog.gsm"
+
+GSM_SOCKET=$DIR/gsm.sock
+export GSM_SOCKET
+"$GSM" -serve -workers=1 2>/dev/null &
+SERVER=$!
+while [ ! -S "$GSM_SOCKET" ]; do
+    kill -0 $SERVER 2>/dev/null || exit 1
+    sleep 0.1
+done
+
+for WAY in cold server; do
+    if [ $WAY = cold ]; then
+        T=$(best requests "$GSM")
+    else
+        T=$(best requests "$CLIENT")
+    fi
+    echo "$T $REQUESTS $WAY" | awk '{ printf "%-6s %8.2f ms per request\n", $3 ":", $1 * 1000 / $2 }'
+done
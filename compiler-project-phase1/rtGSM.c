@@ -1,21 +1,285 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 void gsm_write(int v)
 {
     printf("The result is: %d\n", v);
 }
 
+// Writes n values like n calls of gsm_write, formatting them into a buffer
+// that is handed to stdio in large pieces.
+void gsm_write_all(const int *v, int n)
+{
+    static const char prefix[] = "The result is: ";
+    char buf[1 << 16];
+    size_t len = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (len > sizeof(buf) - 32)
+        {
+            fwrite(buf, 1, len, stdout);
+            len = 0;
+        }
+        memcpy(buf + len, prefix, sizeof(prefix) - 1);
+        len += sizeof(prefix) - 1;
+        unsigned u = v[i] < 0 ? 0u - (unsigned)v[i] : (unsigned)v[i];
+        if (v[i] < 0)
+            buf[len++] = '-';
+        char digits[10];
+        int d = 0;
+        do
+            digits[d++] = '0' + u % 10;
+        while (u /= 10);
+        while (d)
+            buf[len++] = digits[--d];
+        buf[len++] = '\n';
+    }
+    fwrite(buf, 1, len, stdout);
+}
+
+// Instruction set level of the CPU, which selects the variant of a program
+// compiled with -multiversion: 2 for x86-64-v4 (AVX-512), 1 for x86-64-v3
+// (AVX2), else 0. The AVX registers must also be enabled by the OS.
+int gsm_cpu_level(void)
+{
+#if defined(__x86_64__)
+    unsigned a, b, c, d, leaf1, leaf7, ext;
+    if (!__get_cpuid(1, &a, &b, &leaf1, &d) || !__get_cpuid_count(7, 0, &a, &leaf7, &c, &d) ||
+        !__get_cpuid(0x80000001, &a, &b, &ext, &d))
+        return 0;
+    unsigned v3 = bit_AVX | bit_OSXSAVE | bit_FMA | bit_MOVBE | bit_F16C;
+    if ((leaf1 & v3) != v3)
+        return 0;
+    unsigned xcr0, xcr0hi;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0hi) : "c"(0));
+    v3 = bit_AVX2 | bit_BMI | bit_BMI2;
+    if ((xcr0 & 0x6) != 0x6 || (leaf7 & v3) != v3 || !(ext & bit_LZCNT))
+        return 0;
+    unsigned v4 = bit_AVX512F | bit_AVX512DQ | bit_AVX512CD | bit_AVX512BW | bit_AVX512VL;
+    return (xcr0 & 0xe6) == 0xe6 && (leaf7 & v4) == v4 ? 2 : 1;
+#else
+    return 0;
+#endif
+}
+
+// Results of a memo function: an open-addressing hash table keyed by the
+// argument list, which doubles when it is half full. An entry holds the
+// arguments, the result and whether it is used. A compiled program keeps one
+// table per memo function, created by the first store.
+struct memo_table
+{
+    size_t mask;  // capacity - 1, a power of two
+    size_t count; // entries in use
+    int stride;   // ints per entry, nargs + 2
+    int entries[];
+};
+
+static size_t memo_hash(int nargs, const int *args)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < nargs; ++i)
+        h = (h ^ (uint32_t)args[i]) * 0x100000001b3ull;
+    return (size_t)(h ^ h >> 29);
+}
+
+// The entry of args, or the free entry where it belongs.
+static int *memo_find(struct memo_table *t, int nargs, const int *args)
+{
+    for (size_t i = memo_hash(nargs, args) & t->mask;; i = (i + 1) & t->mask)
+    {
+        int *e = t->entries + i * t->stride;
+        if (!e[nargs + 1] || memcmp(e, args, nargs * sizeof(int)) == 0)
+            return e;
+    }
+}
+
+static struct memo_table *memo_alloc(size_t capacity, int nargs)
+{
+    struct memo_table *t = calloc(1, sizeof(*t) + capacity * (nargs + 2) * sizeof(int));
+    if (!t)
+    {
+        fprintf(stderr, "Out of memory for memo results\n");
+        exit(1);
+    }
+    t->mask = capacity - 1;
+    t->stride = nargs + 2;
+    return t;
+}
+
+// Returns 1 and sets *result if the memo function with the table *cache has
+// a result for args, else 0.
+int gsm_memo_lookup(void **cache, int nargs, const int *args, int *result)
+{
+    struct memo_table *t = *cache;
+    if (!t)
+        return 0;
+    int *e = memo_find(t, nargs, args);
+    if (!e[nargs + 1])
+        return 0;
+    *result = e[nargs];
+    return 1;
+}
+
+void gsm_memo_store(void **cache, int nargs, const int *args, int result)
+{
+    struct memo_table *t = *cache;
+    if (!t)
+        t = *cache = memo_alloc(64, nargs);
+    else if (2 * (t->count + 1) > t->mask + 1)
+    {
+        struct memo_table *n = memo_alloc(2 * (t->mask + 1), nargs);
+        for (size_t i = 0; i <= t->mask; ++i)
+        {
+            int *e = t->entries + i * t->stride;
+            if (e[nargs + 1])
+                memcpy(memo_find(n, nargs, e), e, t->stride * sizeof(int));
+        }
+        n->count = t->count;
+        free(t);
+        t = *cache = n;
+    }
+    int *e = memo_find(t, nargs, args);
+    if (!e[nargs + 1])
+    {
+        memcpy(e, args, nargs * sizeof(int));
+        e[nargs + 1] = 1;
+        ++t->count;
+    }
+    e[nargs] = result;
+}
+
+// Input of the read statement. Values are taken from the program arguments
+// (`./gsmbin 1 2 3`), from a memory-mapped file (`./gsmbin -f input.txt`) or,
+// without arguments, from stdin. They are separated by whitespace or commas.
+static const char *InPtr, *InEnd; // unread part of the current input buffer
+static char **NextArg;            // remaining arguments, when reading from argv
+static int InputReady;
+
+static int is_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ',';
+}
+
+static void map_input(int fd, const char *path)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                fprintf(stderr, "Cannot map input %s\n", path);
+                exit(1);
+            }
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            InPtr = p;
+            InEnd = InPtr + st.st_size;
+        }
+        return;
+    }
+
+    // Pipes and terminals cannot be mapped, so they are read in one go.
+    size_t size = 0, cap = 1 << 16;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while (buf && (n = read(fd, buf + size, cap - size)) > 0)
+    {
+        size += n;
+        if (size == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    if (!buf)
+    {
+        fprintf(stderr, "Out of memory while reading %s\n", path);
+        exit(1);
+    }
+    InPtr = buf;
+    InEnd = buf + size;
+}
+
+void gsm_init(int argc, char **argv)
+{
+    InputReady = 1;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0)
+    {
+        int fd = open(argv[2], O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot open input %s\n", argv[2]);
+            exit(1);
+        }
+        map_input(fd, argv[2]);
+        close(fd);
+    }
+    else if (argc > 1)
+        NextArg = argv + 1;
+    else
+        map_input(0, "<stdin>");
+}
+
 int gsm_read(char *s)
 {
-    char buf[64];
-    int val;
-    printf("Enter a value for %s: ", s);
-    fgets(buf, sizeof(buf), stdin);
-    if (EOF == sscanf(buf, "%d", &val))
+    if (!InputReady)
+        gsm_init(1, NULL);
+
+    const char *p = InPtr, *e = InEnd;
+    for (;;)
+    {
+        while (p != e && is_separator(*p))
+            ++p;
+        if (p != e)
+            break;
+        if (!NextArg || !*NextArg)
+        {
+            fprintf(stderr, "No input left for %s\n", s);
+            exit(1);
+        }
+        p = *NextArg++;
+        e = p + strlen(p);
+    }
+
+    int neg = *p == '-';
+    if (neg || *p == '+')
+        ++p;
+    if (p == e || *p < '0' || *p > '9')
+    {
+        fprintf(stderr, "Value for %s is invalid\n", s);
+        exit(1);
+    }
+    // Accumulate as a negative number, so INT_MIN is representable.
+    long long val = 0;
+    while (p != e && *p >= '0' && *p <= '9')
+    {
+        val = val * 10 - (*p++ - '0');
+        if (val < INT_MIN)
+        {
+            fprintf(stderr, "Value for %s is out of range\n", s);
+            exit(1);
+        }
+    }
+    if (p != e && !is_separator(*p))
     {
-        printf("Value %s is invalid\n", buf);
+        fprintf(stderr, "Value for %s is invalid\n", s);
         exit(1);
     }
-    return val;
-}
\ No newline at end of file
+    if (!neg && val == INT_MIN)
+    {
+        fprintf(stderr, "Value for %s is out of range\n", s);
+        exit(1);
+    }
+    InPtr = p;
+    InEnd = e;
+    return neg ? (int)val : (int)-val;
+}
@@ -1,8 +1,10 @@
 #ifndef AST_H
 #define AST_H
 
-#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/SMLoc.h"
 
 // Forward declarations of classes used in the AST
 class AST;
@@ -15,8 +17,14 @@ class Loop;
 class BE;
 class Condition;
 class BinaryOp;
-
-// ASTVisitor class defines a visitor pattern to traverse the AST
+class Read;
+class FunctionDef;
+class Call;
+class Return;
+
+// ASTVisitor class defines a visitor pattern to traverse the AST. Passes that
+// visit every node, Sema and CodeGen, use the statically dispatched
+// RecursiveASTVisitor in RecursiveASTVisitor.h instead.
 class ASTVisitor
 {
 public:
@@ -31,6 +39,10 @@ public:
     virtual void visit(BE &) = 0;          // Visit the BE node
     virtual void visit(Condition &) = 0;   // Visit the Condition node
     virtual void visit(BinaryOp &) = 0;    // Visit the binary operation node
+    virtual void visit(Read &) = 0;        // Visit the read statement node
+    virtual void visit(FunctionDef &) = 0; // Visit the function definition node
+    virtual void visit(Call &) = 0;        // Visit the function call node
+    virtual void visit(Return &) = 0;      // Visit the return statement node
 };
 
 // AST class serves as the base class for all AST nodes
@@ -45,25 +57,53 @@ public:
 class Expr : public AST
 {
 public:
-    Expr() {}
+    // Discriminator for LLVM-style isa/dyn_cast on AST nodes
+    enum ExprKind
+    {
+        EK_Goal,
+        EK_Factor,
+        EK_BinaryOp,
+        EK_Assignment,
+        EK_Declaration,
+        EK_BE,
+        EK_Loop,
+        EK_Condition,
+        EK_Read,
+        EK_FunctionDef,
+        EK_Call,
+        EK_Return
+    };
+
+private:
+    const ExprKind Kind; // Stores the concrete kind of the node
+    llvm::SMLoc Loc;     // Location of the token that starts the node
+
+public:
+    Expr(ExprKind Kind, llvm::SMLoc Loc) : Kind(Kind), Loc(Loc) {}
+
+    ExprKind getExprKind() const { return Kind; }
+
+    llvm::SMLoc getLocation() { return Loc; }
 };
 
 // Goal class represents a group of expressions in the AST
 class Goal : public Expr
 {
-    using ExprVector = llvm::SmallVector<Expr *>;
+    using ExprList = llvm::ArrayRef<Expr *>;
 
 private:
-    ExprVector exprs; // Stores the list of expressions
+    ExprList exprs; // Stores the list of expressions (owned by the AST arena)
 
 public:
-    Goal(llvm::SmallVector<Expr *> exprs) : exprs(exprs) {}
+    Goal(llvm::SMLoc Loc, ExprList exprs) : Expr(EK_Goal, Loc), exprs(exprs) {}
+
+    ExprList getExprs() { return exprs; }
 
-    llvm::SmallVector<Expr *> getExprs() { return exprs; }
+    ExprList::iterator begin() { return exprs.begin(); }
 
-    ExprVector::const_iterator begin() { return exprs.begin(); }
+    ExprList::iterator end() { return exprs.end(); }
 
-    ExprVector::const_iterator end() { return exprs.end(); }
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Goal; }
 
     virtual void accept(ASTVisitor &V) override
     {
@@ -83,15 +123,24 @@ public:
 
 private:
     ValueKind Kind;      // Stores the kind of factor (identifier or number)
-    llvm::StringRef Val; // Stores the value of the factor
+    int32_t Num = 0;     // Stores the value of a number, decoded by the lexer
+    llvm::StringRef Val; // Stores the name of an identifier, the handle every symbol table uses
 
 public:
-    Factor(ValueKind Kind, llvm::StringRef Val) : Kind(Kind), Val(Val) {}
+    // An identifier
+    Factor(llvm::SMLoc Loc, llvm::StringRef Name) : Expr(EK_Factor, Loc), Kind(Ident), Val(Name) {}
+
+    // A number literal
+    Factor(llvm::SMLoc Loc, int32_t Num) : Expr(EK_Factor, Loc), Kind(Number), Num(Num) {}
 
     ValueKind getKind() { return Kind; }
 
     llvm::StringRef getVal() { return Val; }
 
+    int32_t getNumber() { return Num; }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Factor; }
+
     virtual void accept(ASTVisitor &V) override
     {
         V.visit(*this);
@@ -126,7 +175,7 @@ private:
     Operator Op; // Operator of the binary operation
 
 public:
-    BinaryOp(Operator Op, Expr *L, Expr *R) : Op(Op), Left(L), Right(R) {}
+    BinaryOp(llvm::SMLoc Loc, Operator Op, Expr *L, Expr *R) : Expr(EK_BinaryOp, Loc), Left(L), Right(R), Op(Op) {}
 
     Expr *getLeft() { return Left; }
 
@@ -134,6 +183,8 @@ public:
 
     Operator getOperator() { return Op; }
 
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_BinaryOp; }
+
     virtual void accept(ASTVisitor &V) override
     {
         V.visit(*this);
@@ -148,12 +199,14 @@ private:
     Expr *Right;  // Right-hand side expression
 
 public:
-    Assignment(Factor *L, Expr *R) : Left(L), Right(R) {}
+    Assignment(llvm::SMLoc Loc, Factor *L, Expr *R) : Expr(EK_Assignment, Loc), Left(L), Right(R) {}
 
     Factor *getLeft() { return Left; }
 
     Expr *getRight() { return Right; }
 
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Assignment; }
+
     virtual void accept(ASTVisitor &V) override
     {
         V.visit(*this);
@@ -163,23 +216,24 @@ public:
 // Declaration class represents a variable declaration with an initializer in the AST
 class Declaration : public Expr
 {
-    using VarVector = llvm::SmallVector<llvm::StringRef, 8>;
-    using ExprVector = llvm::SmallVector<Expr *>;
+    using VarList = llvm::ArrayRef<llvm::StringRef>;
+    using ExprList = llvm::ArrayRef<Expr *>;
 
-    VarVector Vars;     // Stores the list of variables
-    ExprVector Numbers; // Stores the list of numbers
-                        // Expression serving as the initializer
+    VarList Vars;     // Stores the list of variables (owned by the AST arena)
+    ExprList Numbers; // Stores the list of initializers (owned by the AST arena)
 
 public:
-    Declaration(llvm::SmallVector<llvm::StringRef, 8> Vars, llvm::SmallVector<Expr *> Numbers) : Vars(Vars), Numbers(Numbers) {}
+    Declaration(llvm::SMLoc Loc, VarList Vars, ExprList Numbers) : Expr(EK_Declaration, Loc), Vars(Vars), Numbers(Numbers) {}
 
-    VarVector::const_iterator begin() { return Vars.begin(); }
+    VarList::iterator begin() { return Vars.begin(); }
 
-    VarVector::const_iterator end() { return Vars.end(); }
+    VarList::iterator end() { return Vars.end(); }
 
-    ExprVector::const_iterator begin_values() { return Numbers.begin(); }
+    ExprList::iterator begin_values() { return Numbers.begin(); }
 
-    ExprVector::const_iterator end_values() { return Numbers.end(); }
+    ExprList::iterator end_values() { return Numbers.end(); }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Declaration; }
 
     virtual void accept(ASTVisitor &V) override
     {
@@ -187,24 +241,31 @@ public:
     }
 };
 
-// BE class represents a variable Begin End with an initializer in the AST
+// BE class represents a begin/end block in the AST. It holds any statement, so
+// loops and conditions nest; variables declared in a block are local to it.
 class BE : public Expr
 {
 
-    using ExprVector = llvm::SmallVector<Assignment *>;
+    using StmtList = llvm::ArrayRef<Expr *>;
 
 private:
-    ExprVector assigns; // Stores the list of expressions
+    StmtList stmts; // Stores the list of statements (owned by the AST arena)
 
 public:
-    BE(llvm::SmallVector<Assignment *> assigns) : assigns(assigns) {}
+    // The parser and the visitors recurse into nested blocks, so their
+    // nesting depth is limited.
+    static const unsigned MaxDepth = 256;
+
+    BE(llvm::SMLoc Loc, StmtList stmts) : Expr(EK_BE, Loc), stmts(stmts) {}
+
+    StmtList::iterator begin() { return stmts.begin(); }
 
-    ExprVector::const_iterator begin() { return assigns.begin(); }
+    StmtList::iterator end() { return stmts.end(); }
 
-    ExprVector::const_iterator end() { return assigns.end(); }
+    StmtList getStmts() { return stmts; }
 
-    llvm::SmallVector<Assignment *> getAssigns() { return assigns; }
 
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_BE; }
 
     virtual void accept(ASTVisitor &V) override
     {
@@ -217,12 +278,14 @@ class Loop : public Expr
     BE *B;   // Begin end  serving as the initializer
 
 public:
-    Loop(Expr *E, BE *B) : E(E), B(B) {}
+    Loop(llvm::SMLoc Loc, Expr *E, BE *B) : Expr(EK_Loop, Loc), E(E), B(B) {}
 
     Expr *getExpr() { return E; }
 
     BE *getBE() { return B; }
 
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Loop; }
+
     virtual void accept(ASTVisitor &V) override
     {
         V.visit(*this);
@@ -231,20 +294,124 @@ public:
 class Condition : public Expr
 {
 
-    using ExprVector = llvm::SmallVector<Expr *>;
-    using BEVector = llvm::SmallVector<BE *>;
+    using ExprList = llvm::ArrayRef<Expr *>;
+    using BEList = llvm::ArrayRef<BE *>;
 
 
 private:
-    ExprVector exprs; // Stores the list of expressions
-    BEVector bes;   // Stores the list of bes
+    ExprList exprs; // Stores the list of guards (owned by the AST arena)
+    BEList bes;     // Stores the list of bes (owned by the AST arena)
+
+public:
+    Condition(llvm::SMLoc Loc, ExprList exprs, BEList bes) : Expr(EK_Condition, Loc), exprs(exprs), bes(bes) {}
+
+    BEList getAllBes() { return bes; }
+
+    ExprList getAllExpresions() { return exprs; }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Condition; }
+
+    virtual void accept(ASTVisitor &V) override
+    {
+        V.visit(*this);
+    }
+};
+
+// Read class represents a statement that reads the values of variables from the program input
+class Read : public Expr
+{
+    using VarList = llvm::ArrayRef<llvm::StringRef>;
+
+    VarList Vars; // Stores the list of variables (owned by the AST arena)
+
+public:
+    Read(llvm::SMLoc Loc, VarList Vars) : Expr(EK_Read, Loc), Vars(Vars) {}
+
+    VarList::iterator begin() { return Vars.begin(); }
+
+    VarList::iterator end() { return Vars.end(); }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Read; }
+
+    virtual void accept(ASTVisitor &V) override
+    {
+        V.visit(*this);
+    }
+};
+
+// FunctionDef class represents the definition of a function at the top level.
+// A function only sees its parameters, its own variables and the functions
+// defined before it, itself included; it neither reads input nor writes
+// output, so its result only depends on its arguments. A memo function keeps
+// the results it computed and returns them when it is called again with the
+// same arguments.
+class FunctionDef : public Expr
+{
+    using ParamList = llvm::ArrayRef<llvm::StringRef>;
+
+    llvm::StringRef Name;
+    ParamList Params; // Stores the names of the parameters (owned by the AST arena)
+    BE *Body;
+    bool Memo;
+
+public:
+    FunctionDef(llvm::SMLoc Loc, llvm::StringRef Name, ParamList Params, BE *Body, bool Memo)
+        : Expr(EK_FunctionDef, Loc), Name(Name), Params(Params), Body(Body), Memo(Memo) {}
+
+    llvm::StringRef getName() { return Name; }
+
+    ParamList getParams() { return Params; }
+
+    BE *getBody() { return Body; }
+
+    bool isMemo() { return Memo; }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_FunctionDef; }
+
+    virtual void accept(ASTVisitor &V) override
+    {
+        V.visit(*this);
+    }
+};
+
+// Call class represents a call of a function in an expression
+class Call : public Expr
+{
+    using ExprList = llvm::ArrayRef<Expr *>;
+
+    llvm::StringRef Name;
+    ExprList Args; // Stores the arguments (owned by the AST arena)
+
+public:
+    // The parser and the visitors recurse into the arguments, so calls in
+    // arguments are nested no deeper than this.
+    static const unsigned MaxDepth = 256;
+
+    Call(llvm::SMLoc Loc, llvm::StringRef Name, ExprList Args) : Expr(EK_Call, Loc), Name(Name), Args(Args) {}
+
+    llvm::StringRef getName() { return Name; }
+
+    ExprList getArgs() { return Args; }
+
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Call; }
+
+    virtual void accept(ASTVisitor &V) override
+    {
+        V.visit(*this);
+    }
+};
+
+// Return class represents a statement that returns a value from a function
+class Return : public Expr
+{
+    Expr *Value;
 
 public:
-    Condition(llvm::SmallVector<Expr *> exprs, llvm::SmallVector<BE *> bes) : exprs(exprs), bes(bes) {}
+    Return(llvm::SMLoc Loc, Expr *Value) : Expr(EK_Return, Loc), Value(Value) {}
 
-    llvm::SmallVector<BE *> getAllBes() { return bes; }
+    Expr *getValue() { return Value; }
 
-    llvm::SmallVector<Expr *> getAllExpresions() { return exprs; }
+    static bool classof(const Expr *E) { return E->getExprKind() == EK_Return; }
 
     virtual void accept(ASTVisitor &V) override
     {
@@ -0,0 +1,581 @@
+#include "ASTFile.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstring>
+#include <vector>
+
+using namespace llvm;
+
+namespace
+{
+  const char Magic[8] = {'G', 'S', 'M', 'A', 'S', 'T', '\r', '\n'};
+  const uint32_t Version = 4;
+  const uint32_t NoLoc = ~0u;
+
+  struct FileHeader
+  {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NumNodes, NumRefs, NumStrings, CharsSize, SourceSize;
+    uint32_t Name; // string holding the name of the source buffer
+    uint32_t Reserved;
+  };
+
+  // A node. The operands depend on the kind; lists are a first index into
+  // the refs and a count:
+  //   Goal         A, B: statements
+  //   Factor       Sub: Factor::ValueKind, A: name (string) or value
+  //   BinaryOp     Sub: BinaryOp::Operator, A: left, B: right
+  //   Assignment   A: target Factor, B: value
+  //   Declaration  A, B: variables (strings), C, D: initializers
+  //   BE           A, B: statements
+  //   Loop         A: guard, B: body BE
+  //   Condition    A, B: guards, C, D: bodies (BEs)
+  //   Read         A, B: variables (strings)
+  //   FunctionDef  Sub: memo, A: name (string), B, C: parameters (strings),
+  //                D: body BE
+  //   Call         A: name (string), B, C: arguments
+  //   Return       A: value
+  struct NodeRecord
+  {
+    uint8_t Kind; // Expr::ExprKind
+    uint8_t Sub;
+    uint16_t Reserved;
+    uint32_t Loc; // offset into the source, or NoLoc
+    uint32_t A, B, C, D;
+  };
+
+  struct StringRecord
+  {
+    uint32_t Offset, Size; // range in the characters of the string table
+  };
+
+  // Converts a tree into records. Like the FlatAST builder, children are
+  // written before their parents, and operands are walked from an explicit
+  // stack so deep expressions cannot exhaust the native one.
+  class ASTWriter : public ASTVisitor
+  {
+    StringRef Source;
+    StringMap<uint32_t> StringIds;
+
+  public:
+    std::vector<NodeRecord> Nodes;
+    std::vector<uint32_t> Refs;
+    std::vector<StringRecord> Strings;
+    std::string Chars;
+    uint32_t Last = 0; // record of the most recently visited node
+
+    ASTWriter(StringRef Source) : Source(Source) {}
+
+    uint32_t getString(StringRef S)
+    {
+      auto Res = StringIds.try_emplace(S, Strings.size());
+      if (Res.second)
+      {
+        Strings.push_back({static_cast<uint32_t>(Chars.size()), static_cast<uint32_t>(S.size())});
+        Chars += S;
+      }
+      return Res.first->second;
+    }
+
+  private:
+    uint32_t getLoc(Expr &Node)
+    {
+      const char *P = Node.getLocation().getPointer();
+      if (!P || P < Source.begin() || P > Source.end())
+        return NoLoc;
+      return P - Source.begin();
+    }
+
+    void add(Expr &Node, unsigned Sub, uint32_t A = 0, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0)
+    {
+      Last = Nodes.size();
+      Nodes.push_back({static_cast<uint8_t>(Node.getExprKind()), static_cast<uint8_t>(Sub), 0,
+                       getLoc(Node), A, B, C, D});
+    }
+
+    // Appends a child list to the refs and returns its first index.
+    uint32_t addRefs(ArrayRef<uint32_t> List)
+    {
+      uint32_t First = Refs.size();
+      Refs.insert(Refs.end(), List.begin(), List.end());
+      return First;
+    }
+
+    template <typename Range> SmallVector<uint32_t, 8> addChildren(Range Children)
+    {
+      SmallVector<uint32_t, 8> Ids;
+      for (Expr *Child : Children)
+      {
+        Child->accept(*this);
+        Ids.push_back(Last);
+      }
+      return Ids;
+    }
+
+  public:
+    virtual void visit(Goal &Node) override
+    {
+      SmallVector<uint32_t, 8> Stmts = addChildren(Node.getExprs());
+      add(Node, 0, addRefs(Stmts), Stmts.size());
+    };
+
+    virtual void visit(Factor &Node) override
+    {
+      if (Node.getKind() == Factor::Ident)
+        add(Node, Factor::Ident, getString(Node.getVal()));
+      else
+        add(Node, Factor::Number, static_cast<uint32_t>(Node.getNumber()));
+    };
+
+    virtual void visit(BinaryOp &Node) override
+    {
+      SmallVector<std::pair<Expr *, bool>, 32> Stack; // node, operands done
+      SmallVector<uint32_t, 32> Operands;
+      Stack.push_back({&Node, false});
+      while (!Stack.empty())
+      {
+        std::pair<Expr *, bool> Item = Stack.pop_back_val();
+        auto *Op = dyn_cast<BinaryOp>(Item.first);
+        if (!Op)
+          Item.first->accept(*this);
+        else if (!Item.second)
+        {
+          Stack.push_back({Op, true});
+          Stack.push_back({Op->getRight(), false});
+          Stack.push_back({Op->getLeft(), false});
+          continue;
+        }
+        else
+        {
+          uint32_t Right = Operands.pop_back_val();
+          uint32_t Left = Operands.pop_back_val();
+          add(*Op, Op->getOperator(), Left, Right);
+        }
+        Operands.push_back(Last);
+      }
+    };
+
+    virtual void visit(Assignment &Node) override
+    {
+      Node.getLeft()->accept(*this);
+      uint32_t Target = Last;
+      Node.getRight()->accept(*this);
+      add(Node, 0, Target, Last);
+    };
+
+    virtual void visit(Declaration &Node) override
+    {
+      SmallVector<uint32_t, 8> Vars;
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Vars.push_back(getString(*I));
+      SmallVector<uint32_t, 8> Inits = addChildren(make_range(Node.begin_values(), Node.end_values()));
+      add(Node, 0, addRefs(Vars), Vars.size(), addRefs(Inits), Inits.size());
+    };
+
+    virtual void visit(BE &Node) override
+    {
+      SmallVector<uint32_t, 8> Stmts = addChildren(Node.getStmts());
+      add(Node, 0, addRefs(Stmts), Stmts.size());
+    };
+
+    virtual void visit(Loop &Node) override
+    {
+      Node.getExpr()->accept(*this);
+      uint32_t Guard = Last;
+      Node.getBE()->accept(*this);
+      add(Node, 0, Guard, Last);
+    };
+
+    virtual void visit(Condition &Node) override
+    {
+      SmallVector<uint32_t, 8> Guards = addChildren(Node.getAllExpresions());
+      SmallVector<uint32_t, 8> Bodies = addChildren(Node.getAllBes());
+      add(Node, 0, addRefs(Guards), Guards.size(), addRefs(Bodies), Bodies.size());
+    };
+
+    virtual void visit(Read &Node) override
+    {
+      SmallVector<uint32_t, 8> Vars;
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Vars.push_back(getString(*I));
+      add(Node, 0, addRefs(Vars), Vars.size());
+    };
+
+    virtual void visit(FunctionDef &Node) override
+    {
+      SmallVector<uint32_t, 8> Params;
+      for (StringRef Param : Node.getParams())
+        Params.push_back(getString(Param));
+      Node.getBody()->accept(*this);
+      add(Node, Node.isMemo(), getString(Node.getName()), addRefs(Params), Params.size(), Last);
+    };
+
+    virtual void visit(Call &Node) override
+    {
+      SmallVector<uint32_t, 8> Args = addChildren(Node.getArgs());
+      add(Node, 0, getString(Node.getName()), addRefs(Args), Args.size());
+    };
+
+    virtual void visit(Return &Node) override
+    {
+      Node.getValue()->accept(*this);
+      add(Node, 0, Last);
+    };
+  };
+
+  // Hands out the nodes of one kind from a single allocation.
+  template <typename T> class NodeArray
+  {
+    T *Next = nullptr;
+
+  public:
+    void allocate(BumpPtrAllocator &Arena, size_t Count) { Next = Arena.Allocate<T>(Count); }
+
+    template <typename... Args> T *create(Args &&...args)
+    {
+      return new (Next++) T(std::forward<Args>(args)...);
+    }
+  };
+
+  template <typename T> void writeArray(raw_ostream &OS, const std::vector<T> &Vec)
+  {
+    OS.write(reinterpret_cast<const char *>(Vec.data()), Vec.size() * sizeof(T));
+  }
+}
+
+bool ASTFile::write(AST *Tree, const SourceMgr &SrcMgr, StringRef Path)
+{
+  const MemoryBuffer *Buffer = SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID());
+  StringRef Source = Buffer->getBuffer();
+  if (Source.size() >= NoLoc)
+  {
+    errs() << "The program is too large for an AST file\n";
+    return true;
+  }
+
+  ASTWriter Writer(Source);
+  FileHeader Header = {};
+  memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = Version;
+  Header.Name = Writer.getString(Buffer->getBufferIdentifier());
+  Tree->accept(Writer);
+  Header.NumNodes = Writer.Nodes.size();
+  Header.NumRefs = Writer.Refs.size();
+  Header.NumStrings = Writer.Strings.size();
+  Header.CharsSize = Writer.Chars.size();
+  Header.SourceSize = Source.size();
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC)
+  {
+    errs() << "Cannot open " << Path << ": " << EC.message() << "\n";
+    return true;
+  }
+  OS.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+  writeArray(OS, Writer.Nodes);
+  writeArray(OS, Writer.Refs);
+  writeArray(OS, Writer.Strings);
+  OS << Writer.Chars << Source;
+  OS.write('\0'); // the source is used as a buffer of the SourceMgr in place
+  OS.close();
+  if (OS.has_error())
+  {
+    errs() << "Cannot write " << Path << ": " << OS.error().message() << "\n";
+    OS.clear_error();
+    return true;
+  }
+  return false;
+}
+
+AST *ASTFile::load(StringRef Path, SourceMgr &SrcMgr, BumpPtrAllocator &Arena)
+{
+  auto FileOrErr = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = FileOrErr.getError())
+  {
+    errs() << "Cannot open " << Path << ": " << EC.message() << "\n";
+    return nullptr;
+  }
+  File = std::move(*FileOrErr);
+  auto Invalid = [&Path]()
+  {
+    errs() << Path << " is not a valid gsm AST file\n";
+    return nullptr;
+  };
+
+  // The header, the sizes of the sections and the string table.
+  StringRef Data = File->getBuffer();
+  FileHeader Header;
+  if (Data.size() < sizeof(Header))
+    return Invalid();
+  memcpy(&Header, Data.data(), sizeof(Header));
+  if (memcmp(Header.Magic, Magic, sizeof(Magic)) != 0)
+    return Invalid();
+  if (Header.Version != Version)
+  {
+    errs() << Path << " was written by a different version of gsm\n";
+    return nullptr;
+  }
+  uint64_t Size = sizeof(Header) + uint64_t(Header.NumNodes) * sizeof(NodeRecord) +
+                  uint64_t(Header.NumRefs) * sizeof(uint32_t) +
+                  uint64_t(Header.NumStrings) * sizeof(StringRecord) + Header.CharsSize +
+                  Header.SourceSize + 1;
+  if (Size != Data.size() || Header.NumNodes == 0 || Header.Name >= Header.NumStrings)
+    return Invalid();
+
+  // Every section is a multiple of 4 bytes up to the characters, and the
+  // mapping is page aligned, so the records are used in place.
+  const auto *Records = reinterpret_cast<const NodeRecord *>(Data.data() + sizeof(Header));
+  const auto *Refs = reinterpret_cast<const uint32_t *>(Records + Header.NumNodes);
+  const auto *StringRecords = reinterpret_cast<const StringRecord *>(Refs + Header.NumRefs);
+  const char *Chars = reinterpret_cast<const char *>(StringRecords + Header.NumStrings);
+  const char *Source = Chars + Header.CharsSize;
+  if (Source[Header.SourceSize] != '\0')
+    return Invalid();
+
+  StringRef *Strings = Arena.Allocate<StringRef>(Header.NumStrings);
+  for (uint32_t I = 0; I < Header.NumStrings; ++I)
+  {
+    const StringRecord &S = StringRecords[I];
+    if (uint64_t(S.Offset) + S.Size > Header.CharsSize)
+      return Invalid();
+    Strings[I] = StringRef(Chars + S.Offset, S.Size);
+  }
+
+  // Check every record before anything is built: children precede their
+  // parents and have the kind the parent expects, lists and strings are in
+  // range, blocks are not nested deeper than the parser allows. Count the
+  // nodes of each kind and the entries of each list type.
+  auto isKind = [&](uint32_t Node, uint32_t Parent, Expr::ExprKind Kind)
+  {
+    return Node < Parent && Records[Node].Kind == Kind;
+  };
+  auto isValue = [&](uint32_t Node, uint32_t Parent)
+  {
+    return isKind(Node, Parent, Expr::EK_Factor) || isKind(Node, Parent, Expr::EK_BinaryOp) ||
+           isKind(Node, Parent, Expr::EK_Call);
+  };
+  auto isStatement = [&](uint32_t Node, uint32_t Parent)
+  {
+    return Node < Parent && Records[Node].Kind >= Expr::EK_Assignment && Records[Node].Kind != Expr::EK_BE &&
+           Records[Node].Kind != Expr::EK_FunctionDef && Records[Node].Kind != Expr::EK_Call;
+  };
+  auto isTopLevel = [&](uint32_t Node, uint32_t Parent)
+  {
+    return isStatement(Node, Parent) || isKind(Node, Parent, Expr::EK_FunctionDef);
+  };
+  auto isList = [&](uint32_t First, uint32_t Count, uint32_t Parent,
+                    function_ref<bool(uint32_t, uint32_t)> IsEntry)
+  {
+    if (uint64_t(First) + Count > Header.NumRefs)
+      return false;
+    for (uint32_t I = First; I != First + Count; ++I)
+      if (!IsEntry(Refs[I], Parent))
+        return false;
+    return true;
+  };
+  auto isString = [&](uint32_t Id, uint32_t) { return Id < Header.NumStrings; };
+  auto isBE = [&](uint32_t Node, uint32_t Parent) { return isKind(Node, Parent, Expr::EK_BE); };
+
+  size_t NumKind[Expr::EK_Return + 1] = {};
+  size_t NumExprRefs = 0, NumStringRefs = 0, NumBERefs = 0;
+  uint32_t Root = Header.NumNodes - 1;
+  // blocks nested in each statement, calls nested in each value
+  std::vector<uint16_t> Depth(Header.NumNodes);
+  auto maxDepth = [&](uint32_t First, uint32_t Count)
+  {
+    uint16_t Max = 0;
+    for (uint32_t I = First; I != First + Count; ++I)
+      Max = std::max(Max, Depth[Refs[I]]);
+    return Max;
+  };
+  for (uint32_t I = 0; I < Header.NumNodes; ++I)
+  {
+    const NodeRecord &R = Records[I];
+    if (R.Loc != NoLoc && R.Loc > Header.SourceSize)
+      return Invalid();
+    bool Valid;
+    switch (R.Kind)
+    {
+    case Expr::EK_Goal:
+      Valid = I == Root && isList(R.A, R.B, I, isTopLevel);
+      NumExprRefs += R.B;
+      break;
+    case Expr::EK_Factor:
+      Valid = R.Sub == Factor::Number || (R.Sub == Factor::Ident && isString(R.A, I));
+      break;
+    case Expr::EK_BinaryOp:
+      Valid = R.Sub <= BinaryOp::More && isValue(R.A, I) && isValue(R.B, I);
+      if (Valid)
+        Depth[I] = std::max(Depth[R.A], Depth[R.B]);
+      break;
+    case Expr::EK_Assignment:
+      Valid = isKind(R.A, I, Expr::EK_Factor) && isValue(R.B, I);
+      break;
+    case Expr::EK_Declaration:
+      Valid = isList(R.A, R.B, I, isString) && isList(R.C, R.D, I, isValue);
+      NumStringRefs += R.B;
+      NumExprRefs += R.D;
+      break;
+    case Expr::EK_BE:
+      Valid = isList(R.A, R.B, I, isStatement) && (Depth[I] = maxDepth(R.A, R.B) + 1) <= BE::MaxDepth;
+      NumExprRefs += R.B;
+      break;
+    case Expr::EK_Loop:
+      Valid = isValue(R.A, I) && isBE(R.B, I);
+      if (Valid)
+        Depth[I] = Depth[R.B];
+      break;
+    case Expr::EK_Condition:
+      // An if, its elifs and an optional else.
+      Valid = R.B > 0 && (R.D == R.B || R.D == R.B + 1) && isList(R.A, R.B, I, isValue) &&
+              isList(R.C, R.D, I, isBE);
+      if (Valid)
+        Depth[I] = maxDepth(R.C, R.D);
+      NumExprRefs += R.B;
+      NumBERefs += R.D;
+      break;
+    case Expr::EK_Read:
+      Valid = isList(R.A, R.B, I, isString);
+      NumStringRefs += R.B;
+      break;
+    case Expr::EK_FunctionDef:
+      Valid = R.Sub <= 1 && isString(R.A, I) && isList(R.B, R.C, I, isString) && isBE(R.D, I);
+      if (Valid)
+        Depth[I] = Depth[R.D];
+      NumStringRefs += R.C;
+      break;
+    case Expr::EK_Call:
+      Valid = isString(R.A, I) && isList(R.B, R.C, I, isValue) &&
+              (Depth[I] = maxDepth(R.B, R.C) + 1) <= Call::MaxDepth;
+      NumExprRefs += R.C;
+      break;
+    case Expr::EK_Return:
+      Valid = isValue(R.A, I);
+      break;
+    default:
+      Valid = false;
+    }
+    if (!Valid)
+      return Invalid();
+    ++NumKind[R.Kind];
+  }
+  if (Records[Root].Kind != Expr::EK_Goal)
+    return Invalid();
+
+  // One allocation per node kind and per list type.
+  Expr **Nodes = Arena.Allocate<Expr *>(Header.NumNodes);
+  NodeArray<Goal> Goals;
+  NodeArray<Factor> Factors;
+  NodeArray<BinaryOp> BinaryOps;
+  NodeArray<Assignment> Assignments;
+  NodeArray<Declaration> Declarations;
+  NodeArray<BE> BEs;
+  NodeArray<Loop> Loops;
+  NodeArray<Condition> Conditions;
+  NodeArray<Read> Reads;
+  NodeArray<FunctionDef> FunctionDefs;
+  NodeArray<Call> Calls;
+  NodeArray<Return> Returns;
+  Goals.allocate(Arena, NumKind[Expr::EK_Goal]);
+  Factors.allocate(Arena, NumKind[Expr::EK_Factor]);
+  BinaryOps.allocate(Arena, NumKind[Expr::EK_BinaryOp]);
+  Assignments.allocate(Arena, NumKind[Expr::EK_Assignment]);
+  Declarations.allocate(Arena, NumKind[Expr::EK_Declaration]);
+  BEs.allocate(Arena, NumKind[Expr::EK_BE]);
+  Loops.allocate(Arena, NumKind[Expr::EK_Loop]);
+  Conditions.allocate(Arena, NumKind[Expr::EK_Condition]);
+  Reads.allocate(Arena, NumKind[Expr::EK_Read]);
+  FunctionDefs.allocate(Arena, NumKind[Expr::EK_FunctionDef]);
+  Calls.allocate(Arena, NumKind[Expr::EK_Call]);
+  Returns.allocate(Arena, NumKind[Expr::EK_Return]);
+  Expr **ExprRefs = Arena.Allocate<Expr *>(NumExprRefs);
+  StringRef *StringRefs = Arena.Allocate<StringRef>(NumStringRefs);
+  BE **BERefs = Arena.Allocate<BE *>(NumBERefs);
+
+  // Fill the next Count entries of a list array from the refs.
+  auto exprList = [&](uint32_t First, uint32_t Count)
+  {
+    ArrayRef<Expr *> List(ExprRefs, Count);
+    for (uint32_t I = 0; I < Count; ++I)
+      *ExprRefs++ = Nodes[Refs[First + I]];
+    return List;
+  };
+  auto stringList = [&](uint32_t First, uint32_t Count)
+  {
+    ArrayRef<StringRef> List(StringRefs, Count);
+    for (uint32_t I = 0; I < Count; ++I)
+      *StringRefs++ = Strings[Refs[First + I]];
+    return List;
+  };
+  auto beList = [&](uint32_t First, uint32_t Count)
+  {
+    ArrayRef<BE *> List(BERefs, Count);
+    for (uint32_t I = 0; I < Count; ++I)
+      *BERefs++ = cast<BE>(Nodes[Refs[First + I]]);
+    return List;
+  };
+
+  for (uint32_t I = 0; I < Header.NumNodes; ++I)
+  {
+    const NodeRecord &R = Records[I];
+    SMLoc Loc = R.Loc == NoLoc ? SMLoc() : SMLoc::getFromPointer(Source + R.Loc);
+    switch (R.Kind)
+    {
+    case Expr::EK_Goal:
+      Nodes[I] = Goals.create(Loc, exprList(R.A, R.B));
+      break;
+    case Expr::EK_Factor:
+      if (R.Sub == Factor::Ident)
+        Nodes[I] = Factors.create(Loc, Strings[R.A]);
+      else
+        Nodes[I] = Factors.create(Loc, static_cast<int32_t>(R.A));
+      break;
+    case Expr::EK_BinaryOp:
+      Nodes[I] = BinaryOps.create(Loc, static_cast<BinaryOp::Operator>(R.Sub), Nodes[R.A], Nodes[R.B]);
+      break;
+    case Expr::EK_Assignment:
+      Nodes[I] = Assignments.create(Loc, cast<Factor>(Nodes[R.A]), Nodes[R.B]);
+      break;
+    case Expr::EK_Declaration:
+    {
+      ArrayRef<StringRef> Vars = stringList(R.A, R.B);
+      Nodes[I] = Declarations.create(Loc, Vars, exprList(R.C, R.D));
+      break;
+    }
+    case Expr::EK_BE:
+      Nodes[I] = BEs.create(Loc, exprList(R.A, R.B));
+      break;
+    case Expr::EK_Loop:
+      Nodes[I] = Loops.create(Loc, Nodes[R.A], cast<BE>(Nodes[R.B]));
+      break;
+    case Expr::EK_Condition:
+    {
+      ArrayRef<Expr *> Guards = exprList(R.A, R.B);
+      Nodes[I] = Conditions.create(Loc, Guards, beList(R.C, R.D));
+      break;
+    }
+    case Expr::EK_Read:
+      Nodes[I] = Reads.create(Loc, stringList(R.A, R.B));
+      break;
+    case Expr::EK_FunctionDef:
+      Nodes[I] = FunctionDefs.create(Loc, Strings[R.A], stringList(R.B, R.C), cast<BE>(Nodes[R.D]), R.Sub != 0);
+      break;
+    case Expr::EK_Call:
+      Nodes[I] = Calls.create(Loc, Strings[R.A], exprList(R.B, R.C));
+      break;
+    case Expr::EK_Return:
+      Nodes[I] = Returns.create(Loc, Nodes[R.A]);
+      break;
+    }
+  }
+
+  // The source is the main buffer, so locations resolve to its lines.
+  SrcMgr.AddNewSourceBuffer(MemoryBuffer::getMemBuffer(StringRef(Source, Header.SourceSize),
+                                                       Strings[Header.Name]),
+                            SMLoc());
+  return Nodes[Root];
+}
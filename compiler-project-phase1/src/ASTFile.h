@@ -0,0 +1,35 @@
+#ifndef ASTFILE_H
+#define ASTFILE_H
+
+#include "AST.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include <memory>
+
+// Binary cache of a checked AST, written by -emit-ast and read by -load-ast.
+// The file starts with a versioned header, followed by fixed-size node records
+// in post-order, a table of child lists, a single string table holding every
+// identifier and literal spelling, and the source text the AST came from, so
+// that diagnostics and debug information keep their locations. All integers
+// are in host byte order.
+//
+// Loading maps the file. Strings and locations point into the mapping, and the
+// nodes are created with one allocation per node kind, so the visitors (Sema,
+// CodeGen) take the loaded tree like a parsed one.
+class ASTFile
+{
+    std::unique_ptr<llvm::MemoryBuffer> File; // mapping the loaded tree points into
+
+public:
+    // Writes Tree, parsed from the main buffer of SrcMgr, to Path; returns
+    // true on error.
+    static bool write(AST *Tree, const llvm::SourceMgr &SrcMgr, llvm::StringRef Path);
+
+    // Maps Path and adds the source the tree was written from to SrcMgr as its
+    // main buffer. The tree lives in Arena and in the mapping, which this
+    // object keeps alive. Returns nullptr on error.
+    AST *load(llvm::StringRef Path, llvm::SourceMgr &SrcMgr, llvm::BumpPtrAllocator &Arena);
+};
+
+#endif
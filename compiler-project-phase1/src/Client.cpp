@@ -0,0 +1,58 @@
+#include "Server.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <sys/un.h>
+
+// gsm-client forwards its arguments to a running `gsm --serve` and prints what
+// the server sends back, so `gsm-client <args>` behaves like `gsm <args>`.
+int main(int argc, const char **argv)
+{
+    std::string SocketPath = gsmserver::getDefaultSocketPath();
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", SocketPath.c_str());
+        return 1;
+    }
+    memcpy(Addr.sun_path, SocketPath.c_str(), SocketPath.size() + 1);
+
+    int Conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Conn < 0 || connect(Conn, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0)
+    {
+        fprintf(stderr, "Cannot connect to the gsm server at %s: %s\n", SocketPath.c_str(),
+                strerror(errno));
+        return 1;
+    }
+    // Anyone can create the socket at a path in /tmp before the server does.
+    if (!gsmserver::isPeerSameUser(Conn))
+    {
+        fprintf(stderr, "The gsm server at %s runs as another user\n", SocketPath.c_str());
+        return 1;
+    }
+
+    // Relative paths in the arguments are resolved in the client's directory.
+    char Cwd[PATH_MAX];
+    if (!getcwd(Cwd, sizeof(Cwd)))
+    {
+        fprintf(stderr, "Cannot determine the working directory\n");
+        return 1;
+    }
+    std::vector<std::string> Request = {Cwd};
+    Request.insert(Request.end(), argv + 1, argv + argc);
+
+    int32_t ExitCode;
+    std::string Out, Err;
+    if (!gsmserver::writeStrings(Conn, Request) ||
+        !gsmserver::readAll(Conn, &ExitCode, sizeof(ExitCode)) ||
+        !gsmserver::readString(Conn, Out) || !gsmserver::readString(Conn, Err))
+    {
+        fprintf(stderr, "The gsm server closed the connection\n");
+        return 1;
+    }
+    fwrite(Out.data(), 1, Out.size(), stdout);
+    fwrite(Err.data(), 1, Err.size(), stderr);
+    return ExitCode;
+}
@@ -1,19 +1,97 @@
 #include "CodeGen.h"
+#include "FlatAST.h"
+#include "RangeAnalysis.h"
+#include "RecursiveASTVisitor.h"
+#include "Sema.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Scalar/LoopInterchange.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopUnrollAndJamPass.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The runtime in rtGSM.c is linked into gsm, so that -run can call it.
+extern "C"
+{
+  void gsm_write(int v);
+  void gsm_write_all(const int *v, int n);
+  void gsm_init(int argc, char **argv);
+  int gsm_read(char *s);
+  int gsm_cpu_level(void);
+  int gsm_memo_lookup(void **cache, int nargs, const int *args, int *result);
+  void gsm_memo_store(void **cache, int nargs, const int *args, int result);
+}
 
 using namespace llvm;
 
 // Define a visitor class for generating LLVM IR from the AST.
 namespace
 {
-  class ToIRVisitor : public ASTVisitor
+  // Inserter that attributes every instruction to the visit method that is
+  // running. Without -compile-stats it only adds a null check to the default inserter.
+  class CountingInserter : public IRBuilderDefaultInserter
+  {
+    CompileStats *Stats = nullptr;
+    const unsigned *CurVisit = nullptr;
+
+  public:
+    CountingInserter() = default;
+    CountingInserter(CompileStats *Stats, const unsigned *CurVisit) : Stats(Stats), CurVisit(CurVisit) {}
+
+    void InsertHelper(Instruction *I, const Twine &Name, BasicBlock *BB,
+                      BasicBlock::iterator InsertPt) const override
+    {
+      IRBuilderDefaultInserter::InsertHelper(I, Name, BB, InsertPt);
+      if (Stats)
+        ++Stats->InstsByVisit[*CurVisit];
+    }
+  };
+
+  using GSMIRBuilder = IRBuilder<ConstantFolder, CountingInserter>;
+
+  class ToIRVisitor : public RecursiveASTVisitor<ToIRVisitor>
   {
     Module *M;
-    IRBuilder<> Builder;
+    CompileStats *Stats;
+    unsigned CurVisit = CompileStats::Driver; // visit method the IR is attributed to
+    GSMIRBuilder Builder;
     Type *VoidTy;
+    Type *Int1Ty;
     Type *Int32Ty;
     Type *Int8PtrTy;
     Type *Int8PtrPtrTy;
@@ -22,343 +100,2069 @@ namespace
     FunctionType *MainFty;
     FunctionType *CalcWriteFnTy;
     Function *CalcWriteFn;
+    FunctionType *CalcReadFnTy;
+    Function *CalcReadFn = nullptr; // declared by the first read statement
+    StringMap<Constant *> VarNames; // names passed to gsm_read
+    Function *CurFn = nullptr; // function that statements are currently lowered into
 
     Value *V;
-    StringMap<AllocaInst *> nameMap;
+    StringMap<Value *> nameMap; // address of each variable in CurFn
+    ArrayRef<int32_t> Written;  // values written at compile time, before the statements run
 
-  public:
-    // Constructor for the visitor class.
-    ToIRVisitor(Module *M) : M(M), Builder(M->getContext())
+    // Variables declared by the enclosing begin/end blocks, innermost last,
+    // with the address each one hides; it is restored when the block ends.
+    SmallVector<SmallVector<std::pair<StringRef, Value *>, 4>, 4> BlockScopes;
+
+    // User functions, lowered to internal functions that only the inliner
+    // and the other passes see through. A function is registered before its
+    // body is lowered, so that it can call itself.
+    StringMap<Function *> Functions;
+    bool InFunction = false; // lowering the body of a user function
+    // With a memo function, its cache and the array holding its arguments,
+    // under which every return stores the result.
+    GlobalVariable *MemoCache = nullptr;
+    Value *MemoArgs = nullptr;
+    FunctionType *MemoLookupFnTy = nullptr, *MemoStoreFnTy = nullptr;
+    Function *MemoLookupFn = nullptr, *MemoStoreFn = nullptr; // declared by the first memo function
+
+    // With CheckSemantics, the checks of Sema run while the tree is lowered.
+    // Uses of undeclared variables are reported in either mode, since they
+    // cannot be lowered.
+    bool CheckSemantics;
+    bool HasError = false;
+
+    // With ReuseValues, the values of the expression nodes lowered into the
+    // current basic block. The parser hash-conses nodes so that a shared node
+    // has the same value wherever straight-line code evaluates it; the values
+    // are dropped when the insert block changes.
+    bool ReuseValues;
+    DenseMap<Expr *, Value *> BlockValues;
+    BasicBlock *BlockValuesBB = nullptr;
+
+    // Ranges of the expression nodes, if the tree was analyzed (see
+    // RangeAnalysis.h); without them every range is full. With CheckedArith,
+    // divisions that may trap and operations that may overflow branch to a
+    // trap block of CurFn, which the checks of a function share.
+    const RangeAnalysis *Ranges = nullptr;
+    bool CheckedArith;
+    BasicBlock *TrapBB = nullptr;
+
+    // The FlatAST that run(const FlatAST &) lowers, with -flat-ast. Its
+    // statements are walked by index and share the lowering below with the
+    // visit methods; it has no ranges, so every operation is checked.
+    const FlatAST *Flat = nullptr;
+
+    // Outlining of top-level statements into chunk functions. The variables
+    // then live in a state array that main allocates and passes to every chunk.
+    // A chunk copies the slots it uses into local allocas, which mem2reg can
+    // promote, and stores them back before it returns.
+    unsigned ChunkSize;
+    unsigned NumStmts = 0;
+    FunctionType *ChunkFty = nullptr;
+    Value *StateArg = nullptr;
+    StringMap<unsigned> StateSlots;
+    SmallVector<Function *, 16> ChunkFns;
+    SmallVector<std::pair<AllocaInst *, Value *>, 16> ChunkLocals; // local copy, state slot
+
+    // Debug information, only set up when it was requested.
+    const SourceMgr &SrcMgr;
+    std::unique_ptr<DIBuilder> DBuilder;
+    DIFile *DFile = nullptr;
+    DISubprogram *DSP = nullptr; // subprogram of CurFn
+    DIScope *DScope = nullptr;   // innermost scope in CurFn, a block that declares variables or DSP
+    DIBasicType *DInt32Ty = nullptr;
+
+    // Attributes the IR emitted during a visit method to the node kind.
+    class VisitScope
     {
-      // Initialize LLVM types and constants.
-      VoidTy = Type::getVoidTy(M->getContext());
-      Int32Ty = Type::getInt32Ty(M->getContext());
-      Int8PtrTy = Type::getInt8PtrTy(M->getContext());
-      Int8PtrPtrTy = Int8PtrTy->getPointerTo();
-      Int32Zero = ConstantInt::get(Int32Ty, 0, true);
+      unsigned &CurVisit;
+      unsigned Saved;
 
-      CalcWriteFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
-      CalcWriteFn = Function::Create(CalcWriteFnTy, GlobalValue::ExternalLinkage, "gsm_write", M);
+    public:
+      VisitScope(ToIRVisitor &V, unsigned Kind) : CurVisit(V.CurVisit), Saved(V.CurVisit)
+      {
+        CurVisit = Kind;
+      }
+      ~VisitScope() { CurVisit = Saved; }
+    };
+
+    // Create a block in CurFn, or in Fn, and count it for the running visit method.
+    BasicBlock *createBlock(const Twine &Name, Function *Fn = nullptr)
+    {
+      if (Stats)
+        ++Stats->BlocksByVisit[CurVisit];
+      return BasicBlock::Create(M->getContext(), Name, Fn ? Fn : CurFn);
     }
 
-    // Entry point for generating LLVM IR from the AST.
-    void run(AST *Tree)
+    // Attach the source location of the node to the instructions emitted next.
+    void emitLocation(Expr *Node)
     {
-      // Create the main function with the appropriate function type.
-      MainFty = FunctionType::get(Int32Ty, {Int32Ty, Int8PtrPtrTy}, false);
-      MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, "main", M);
+      emitLocation(Node->getLocation());
+    }
 
-      // Create a basic block for the entry point of the main function.
-      BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry", MainFn);
-      Builder.SetInsertPoint(BB);
+    void emitLocation(SMLoc Loc)
+    {
+      if (!DBuilder || !Loc.isValid())
+        return;
+      auto LineCol = SrcMgr.getLineAndColumn(Loc);
+      Builder.SetCurrentDebugLocation(
+          DILocation::get(M->getContext(), LineCol.first, LineCol.second, DScope));
+    }
 
-      // Visit the root node of the AST to generate IR.
-      Tree->accept(*this);
+    // The expressions of a FlatAST carry no locations; they are attributed
+    // to the location of their statement.
+    void emitLocation(FlatAST::Index) {}
 
-      // Create a return instruction at the end of the main function.
-      Builder.CreateRet(Int32Zero);
+    DISubprogram *createSubprogram(Function *Fn, DIType *RetTy, StringRef Name = StringRef(), unsigned Line = 1)
+    {
+      if (Name.empty())
+        Name = Fn->getName();
+      DISubroutineType *Ty = DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray({RetTy}));
+      DISubprogram *SP = DBuilder->createFunction(DFile, Name, Fn->getName(), DFile, Line, Ty, Line,
+                                                  DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+      Fn->setSubprogram(SP);
+      return SP;
     }
 
-    // Visit function for the GSM node in the AST.
-    virtual void visit(Goal &Node) override
+    // Continue lowering at the end of a fresh entry block of Fn.
+    void enterFunction(Function *Fn, Value *State)
     {
-      // Iterate over the children of the GSM node and visit each child.
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      CurFn = Fn;
+      StateArg = State;
+      nameMap.clear();
+      DSP = Fn->getSubprogram();
+      DScope = DSP;
+      Builder.SetCurrentDebugLocation(DebugLoc());
+      Builder.SetInsertPoint(createBlock("entry", Fn));
+    }
+
+    // Write the local copies back to the state and return from the chunk.
+    void closeChunk()
+    {
+      for (auto &Local : ChunkLocals)
+        Builder.CreateStore(Builder.CreateLoad(Int32Ty, Local.first), Local.second);
+      ChunkLocals.clear();
+      Builder.CreateRetVoid();
+    }
+
+    // Close the current chunk and start the next one.
+    void startChunk()
+    {
+      if (!ChunkFns.empty())
+        closeChunk();
+      Function *Fn = Function::Create(ChunkFty, GlobalValue::InternalLinkage,
+                                      "gsm.chunk." + Twine(ChunkFns.size()), M);
+      // Inlining the chunks back into main would undo the split.
+      Fn->addFnAttr(Attribute::NoInline);
+      ChunkFns.push_back(Fn);
+      if (DBuilder)
+        createSubprogram(Fn, nullptr);
+      enterFunction(Fn, Fn->getArg(0));
+    }
+
+    // Create the local copy of a state slot at the start of the entry block.
+    AllocaInst *createChunkLocal(StringRef Var, bool LoadFromState)
+    {
+      BasicBlock &Entry = CurFn->getEntryBlock();
+      GSMIRBuilder EntryBuilder(M->getContext(), ConstantFolder(), CountingInserter(Stats, &CurVisit));
+      EntryBuilder.SetInsertPoint(&Entry, Entry.begin());
+      Value *Slot = EntryBuilder.CreateConstInBoundsGEP1_32(Int32Ty, StateArg, StateSlots.lookup(Var));
+      AllocaInst *Local = EntryBuilder.CreateAlloca(Int32Ty, nullptr, Var);
+      if (LoadFromState)
+        EntryBuilder.CreateStore(EntryBuilder.CreateLoad(Int32Ty, Slot), Local);
+      ChunkLocals.push_back({Local, Slot});
+      return Local;
+    }
+
+    // Whether Var is declared by the statements lowered so far. nameMap, and
+    // StateSlots with chunking, are the symbol table of the fused checks; a
+    // function does not see the top-level variables.
+    bool isDeclared(StringRef Var)
+    {
+      return nameMap.lookup(Var) || (!InFunction && StateSlots.count(Var));
+    }
+
+    // Whether a declaration of Var declares it a second time in its scope; a
+    // block may declare a variable of an enclosing scope again.
+    bool isRedeclared(StringRef Var)
+    {
+      if (BlockScopes.empty())
+        return isDeclared(Var);
+      for (auto &Declared : BlockScopes.back())
+        if (Declared.first == Var)
+          return true;
+      return false;
+    }
+
+    // Reports a use of an undeclared variable; lowering goes on, so that every
+    // error is found, but the module is discarded.
+    bool checkDeclared(StringRef Var)
+    {
+      if (isDeclared(Var))
+        return true;
+      Sema::reportUndeclared(Var);
+      HasError = true;
+      return false;
+    }
+
+    // Address of a declared variable in CurFn.
+    Value *getVarAddr(StringRef Var)
+    {
+      Value *&Addr = nameMap[Var];
+      if (!Addr && StateArg)
+        Addr = createChunkLocal(Var, true);
+      return Addr;
+    }
+
+    // Allocate a variable at the end of the entry block of CurFn, so that a
+    // declaration in a loop does not grow the stack and mem2reg can promote
+    // the variable.
+    AllocaInst *createEntryAlloca()
+    {
+      BasicBlock &Entry = CurFn->getEntryBlock();
+      if (Builder.GetInsertBlock() == &Entry)
+        return Builder.CreateAlloca(Int32Ty);
+      GSMIRBuilder EntryBuilder(M->getContext(), ConstantFolder(), CountingInserter(Stats, &CurVisit));
+      EntryBuilder.SetInsertPoint(Entry.getTerminator());
+      return EntryBuilder.CreateAlloca(Int32Ty);
+    }
+
+    // Variables of a block end with the top-level statement, so they are
+    // locals of CurFn even with chunking.
+    Value *declareVar(StringRef Var)
+    {
+      if (!BlockScopes.empty())
       {
-        (*I)->accept(*this);
+        BlockScopes.back().push_back({Var, nameMap.lookup(Var)});
+        return nameMap[Var] = createEntryAlloca();
       }
-    };
+      if (!ChunkSize)
+        return nameMap[Var] = createEntryAlloca();
+      unsigned Slot = StateSlots.size();
+      StateSlots[Var] = Slot;
+      return nameMap[Var] = createChunkLocal(Var, false);
+    }
 
-    virtual void visit(Assignment &Node) override
+    // Declare gsm_read on first use. The runtime takes its input from the
+    // arguments of main, so gsm_init(argc, argv) is called at the start of
+    // main; with chunking, main is only built by finish(), which adds it there.
+    Function *getReadFn()
     {
-      // Visit the right-hand side of the assignment and get its value.
-      Node.getRight()->accept(*this);
-      Value *val = V;
+      if (CalcReadFn)
+        return CalcReadFn;
+      CalcReadFnTy = FunctionType::get(Int32Ty, {Int8PtrTy}, false);
+      CalcReadFn = Function::Create(CalcReadFnTy, GlobalValue::ExternalLinkage, "gsm_read", M);
+      if (!ChunkSize)
+      {
+        BasicBlock &Entry = MainFn->getEntryBlock();
+        GSMIRBuilder EntryBuilder(M->getContext(), ConstantFolder(), CountingInserter(Stats, &CurVisit));
+        EntryBuilder.SetInsertPoint(&Entry, Entry.begin());
+        emitInputInit(EntryBuilder);
+      }
+      return CalcReadFn;
+    }
 
-      // Get the name of the variable being assigned.
-      auto varName = Node.getLeft()->getVal();
+    // Look the arguments of the memo function Fn up in its cache, at the end
+    // of its entry block, and return the result stored for them if there is
+    // one. Lookup and store are separate calls, since the calls in between may
+    // grow the table.
+    void emitMemoLookup(StringRef Name, Function *Fn)
+    {
+      if (!MemoLookupFn)
+      {
+        Type *Int32PtrTy = Int32Ty->getPointerTo();
+        MemoLookupFnTy = FunctionType::get(Int32Ty, {Int8PtrPtrTy, Int32Ty, Int32PtrTy, Int32PtrTy}, false);
+        MemoLookupFn = Function::Create(MemoLookupFnTy, GlobalValue::ExternalLinkage, "gsm_memo_lookup", M);
+        MemoStoreFnTy = FunctionType::get(VoidTy, {Int8PtrPtrTy, Int32Ty, Int32PtrTy, Int32Ty}, false);
+        MemoStoreFn = Function::Create(MemoStoreFnTy, GlobalValue::ExternalLinkage, "gsm_memo_store", M);
+      }
+      MemoCache = new GlobalVariable(*M, Int8PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+                                     ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)), "gsm.memo." + Name);
+      ArrayType *ArgsTy = ArrayType::get(Int32Ty, std::max<size_t>(Fn->arg_size(), 1));
+      Value *Args = Builder.CreateAlloca(ArgsTy, nullptr, "memo.args");
+      for (unsigned I = 0, E = Fn->arg_size(); I != E; ++I)
+        Builder.CreateStore(Fn->getArg(I), Builder.CreateConstInBoundsGEP2_32(ArgsTy, Args, 0, I));
+      MemoArgs = Builder.CreateConstInBoundsGEP2_32(ArgsTy, Args, 0, 0);
+      Value *Result = Builder.CreateAlloca(Int32Ty, nullptr, "memo.result");
+      Value *Found = Builder.CreateCall(MemoLookupFnTy, MemoLookupFn,
+                                        {MemoCache, ConstantInt::get(Int32Ty, Fn->arg_size()), MemoArgs, Result});
+      BasicBlock *HitBB = createBlock("memo.hit");
+      BasicBlock *MissBB = createBlock("memo.miss");
+      Builder.CreateCondBr(Builder.CreateICmpNE(Found, Int32Zero), HitBB, MissBB);
+      Builder.SetInsertPoint(HitBB);
+      Builder.CreateRet(Builder.CreateLoad(Int32Ty, Result));
+      Builder.SetInsertPoint(MissBB);
+    }
 
-      // Create a store instruction to assign the value to the variable.
-      Builder.CreateStore(val, nameMap[varName]);
+    // Return Val from the user function being lowered.
+    void emitReturn(Value *Val)
+    {
+      if (MemoCache)
+        Builder.CreateCall(MemoStoreFnTy, MemoStoreFn,
+                           {MemoCache, ConstantInt::get(Int32Ty, CurFn->arg_size()), MemoArgs, Val});
+      Builder.CreateRet(Val);
+    }
 
-      // Create a call instruction to invoke the "gsm_write" function with the value.
-      CallInst *Call = Builder.CreateCall(CalcWriteFnTy, CalcWriteFn, {val});
-    };
+    // Write the values of Written: a few with calls of gsm_write, more with a
+    // single call of gsm_write_all on a constant table.
+    void emitWritten()
+    {
+      if (Written.size() <= 8)
+      {
+        for (int32_t Val : Written)
+          Builder.CreateCall(CalcWriteFnTy, CalcWriteFn, {ConstantInt::get(Int32Ty, Val, true)});
+        return;
+      }
+      Constant *Values = ConstantDataArray::get(M->getContext(), Written);
+      auto *Table = new GlobalVariable(*M, Values->getType(), /*isConstant=*/true,
+                                       GlobalValue::PrivateLinkage, Values, "gsm.written");
+      Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      FunctionType *WriteAllFnTy = FunctionType::get(VoidTy, {Int32Ty->getPointerTo(), Int32Ty}, false);
+      Function *WriteAllFn = Function::Create(WriteAllFnTy, GlobalValue::ExternalLinkage, "gsm_write_all", M);
+      Builder.CreateCall(WriteAllFnTy, WriteAllFn,
+                         {Builder.CreateConstInBoundsGEP2_32(Values->getType(), Table, 0, 0),
+                          ConstantInt::get(Int32Ty, Written.size())});
+    }
 
-    virtual void visit(Factor &Node) override
+    void emitInputInit(GSMIRBuilder &B)
     {
-      if (Node.getKind() == Factor::Ident)
+      FunctionType *InitFnTy = FunctionType::get(VoidTy, {Int32Ty, Int8PtrPtrTy}, false);
+      Function *InitFn = Function::Create(InitFnTy, GlobalValue::ExternalLinkage, "gsm_init", M);
+      B.CreateCall(InitFnTy, InitFn, {MainFn->getArg(0), MainFn->getArg(1)});
+    }
+
+    // Comparisons and `and`/`or` produce i1, everything else is i32.
+    Value *toBool(Value *Val)
+    {
+      if (Val->getType()->isIntegerTy(1))
+        return Val;
+      return Builder.CreateICmpNE(Val, Int32Zero);
+    }
+
+    Value *toInt(Value *Val)
+    {
+      if (Val->getType()->isIntegerTy(1))
+        return Builder.CreateZExt(Val, Int32Ty);
+      return Val;
+    }
+
+    DenseMap<Expr *, Value *> &getBlockValues()
+    {
+      if (BlockValuesBB != Builder.GetInsertBlock())
       {
-        // If the factor is an identifier, load its value from memory.
-        V = Builder.CreateLoad(Int32Ty, nameMap[Node.getVal()]);
+        BlockValues.clear();
+        BlockValuesBB = Builder.GetInsertBlock();
       }
-      else
+      return BlockValues;
+    }
+
+    // Returns the value Node already has in the current block, if any.
+    Value *lookupValue(Expr *Node)
+    {
+      return ReuseValues ? getBlockValues().lookup(Node) : nullptr;
+    }
+
+    void rememberValue(Expr *Node, Value *Val)
+    {
+      if (ReuseValues)
+        getBlockValues()[Node] = Val;
+    }
+
+    // The nodes of a FlatAST are never shared.
+    Value *lookupValue(FlatAST::Index) { return nullptr; }
+    void rememberValue(FlatAST::Index, Value *) {}
+
+    // lowerExpr walks the expressions of either tree: Expr pointers, or the
+    // indices of the expressions of Flat. These give it their shape.
+    bool isBinaryOp(Expr *Node) { return isa<BinaryOp>(Node); }
+    bool isBinaryOp(FlatAST::Index Node) { return Flat->Exprs[Node].K == FlatAST::ExprNode::Binary; }
+    BinaryOp::Operator getOperator(Expr *Node) { return cast<BinaryOp>(Node)->getOperator(); }
+    BinaryOp::Operator getOperator(FlatAST::Index Node)
+    {
+      return static_cast<BinaryOp::Operator>(Flat->Exprs[Node].Op);
+    }
+    Expr *getLeft(Expr *Node) { return cast<BinaryOp>(Node)->getLeft(); }
+    FlatAST::Index getLeft(FlatAST::Index Node) { return Flat->Exprs[Node].LHS; }
+    Expr *getRight(Expr *Node) { return cast<BinaryOp>(Node)->getRight(); }
+    FlatAST::Index getRight(FlatAST::Index Node) { return Flat->Exprs[Node].RHS; }
+
+    // The visit method the IR of Node is attributed to.
+    unsigned getVisitKind(Expr *Node) { return Node->getExprKind(); }
+    unsigned getVisitKind(FlatAST::Index Node)
+    {
+      switch (Flat->Exprs[Node].K)
       {
-        // If the factor is a literal, convert it to an integer and create a constant.
-        int intval;
-        Node.getVal().getAsInteger(10, intval);
-        V = ConstantInt::get(Int32Ty, intval, true);
+      case FlatAST::ExprNode::Binary:
+        return Expr::EK_BinaryOp;
+      case FlatAST::ExprNode::Call:
+        return Expr::EK_Call;
+      default:
+        return Expr::EK_Factor;
       }
+    }
+
+    // Lowers an expression other than a binary operation.
+    Value *lowerLeaf(Expr *Node)
+    {
+      traverse(*Node);
+      return V;
+    }
+
+    Value *lowerLeaf(FlatAST::Index Node)
+    {
+      const FlatAST::ExprNode &N = Flat->Exprs[Node];
+      VisitScope Scope(*this, getVisitKind(Node));
+      if (N.K == FlatAST::ExprNode::Number)
+        return ConstantInt::get(Int32Ty, Flat->Literals[N.LHS], true);
+      if (N.K == FlatAST::ExprNode::Ident)
+        return emitLoad(Flat->Idents[N.LHS]);
+      SmallVector<Value *, 4> Args;
+      for (FlatAST::Index I = N.RHS + 1, E = N.RHS + 1 + Flat->Refs[N.RHS]; I != E; ++I)
+        Args.push_back(toInt(lowerFlatExpr(Flat->Refs[I])));
+      return emitCall(Flat->Idents[N.LHS], Args);
+    }
+
+    // Lowers the expression of Flat rooted at Node and returns its value.
+    Value *lowerFlatExpr(FlatAST::Index Node)
+    {
+      lowerExpr(ExprStep<FlatAST::Index>{StepKind::Eval, getVisitKind(Node), Node});
+      return V;
+    }
+
+    // A step of the lowering of an expression. Expressions are lowered with an
+    // explicit work list rather than by recursing through traverse(), so deeply
+    // nested expressions cannot exhaust the stack. The steps are those of a
+    // recursive lowering, in the same order, and each one runs with CurVisit
+    // set to the visit method it belongs to.
+    enum class StepKind : uint8_t
+    {
+      Eval,            // lower Node and push its value
+      ToInt,           // widen the value on top of the stack to i32
+      Combine,         // pop the operands of the BinaryOp Node and push the result
+      Branch,          // branch to True or False on Node, short-circuiting and/or
+      BranchOnValue,   // pop the value of Node and branch to True or False
+      SetInsertPoint,  // continue in block True
+      ShortCircuitEnd  // pop the right operand of the and/or Node, merge into block True
+    };
+
+    template <typename NodeT> struct ExprStep
+    {
+      StepKind Kind;
+      unsigned Visit;
+      NodeT Node;
+      BasicBlock *True = nullptr, *False = nullptr;
     };
 
-    virtual void visit(BinaryOp &Node) override
+    template <typename NodeT> void lowerExpr(ExprStep<NodeT> Root)
+    {
+      unsigned Saved = CurVisit;
+      SmallVector<ExprStep<NodeT>, 32> Work;
+      SmallVector<Value *, 32> Values;
+      Work.push_back(Root);
+      while (!Work.empty())
+      {
+        ExprStep<NodeT> S = Work.pop_back_val();
+        CurVisit = S.Visit;
+        switch (S.Kind)
+        {
+        case StepKind::Eval:
+        {
+          if (!isBinaryOp(S.Node))
+          {
+            Values.push_back(lowerLeaf(S.Node));
+            break;
+          }
+          if (Value *Known = lookupValue(S.Node))
+          {
+            Values.push_back(Known);
+            break;
+          }
+          unsigned Visit = Expr::EK_BinaryOp;
+          BinaryOp::Operator Op = getOperator(S.Node);
+          if (Op == BinaryOp::And || Op == BinaryOp::Or)
+          {
+            // `and`/`or` used as a value: branch around the right operand and
+            // merge the outcome with a phi in the end block.
+            CurVisit = Visit;
+            bool IsAnd = Op == BinaryOp::And;
+            BasicBlock *RhsBB = createBlock(IsAnd ? "and.rhs" : "or.rhs");
+            BasicBlock *EndBB = createBlock(IsAnd ? "and.end" : "or.end");
+            Work.push_back({StepKind::ShortCircuitEnd, Visit, S.Node, EndBB});
+            Work.push_back({StepKind::Eval, Expr::EK_BinaryOp, getRight(S.Node)});
+            Work.push_back({StepKind::SetInsertPoint, Visit, NodeT(), RhsBB});
+            Work.push_back({StepKind::Branch, Visit, getLeft(S.Node), IsAnd ? RhsBB : EndBB,
+                            IsAnd ? EndBB : RhsBB});
+            break;
+          }
+          Work.push_back({StepKind::Combine, Visit, S.Node});
+          Work.push_back({StepKind::Eval, Visit, getRight(S.Node)});
+          Work.push_back({StepKind::ToInt, Visit, S.Node});
+          Work.push_back({StepKind::Eval, Visit, getLeft(S.Node)});
+          break;
+        }
+        case StepKind::ToInt:
+          Values.back() = toInt(Values.back());
+          break;
+        case StepKind::Combine:
+        {
+          if (CheckSemantics && getOperator(S.Node) == BinaryOp::Div)
+            checkDivisor(getRight(S.Node));
+          Value *Right = toInt(Values.pop_back_val());
+          Value *Left = Values.pop_back_val();
+          Values.push_back(emitBinaryOp(S.Node, Left, Right));
+          rememberValue(S.Node, Values.back());
+          break;
+        }
+        case StepKind::Branch:
+        {
+          // A guard is lowered directly into control flow. The right operand
+          // of `and`/`or` is only evaluated when the left operand does not
+          // decide the outcome.
+          bool IsBinaryOp = isBinaryOp(S.Node);
+          if (IsBinaryOp && getOperator(S.Node) == BinaryOp::And)
+          {
+            BasicBlock *RhsBB = createBlock("and.rhs");
+            Work.push_back({StepKind::Branch, S.Visit, getRight(S.Node), S.True, S.False});
+            Work.push_back({StepKind::SetInsertPoint, S.Visit, NodeT(), RhsBB});
+            Work.push_back({StepKind::Branch, S.Visit, getLeft(S.Node), RhsBB, S.False});
+            break;
+          }
+          if (IsBinaryOp && getOperator(S.Node) == BinaryOp::Or)
+          {
+            BasicBlock *RhsBB = createBlock("or.rhs");
+            Work.push_back({StepKind::Branch, S.Visit, getRight(S.Node), S.True, S.False});
+            Work.push_back({StepKind::SetInsertPoint, S.Visit, NodeT(), RhsBB});
+            Work.push_back({StepKind::Branch, S.Visit, getLeft(S.Node), S.True, RhsBB});
+            break;
+          }
+          Work.push_back({StepKind::BranchOnValue, S.Visit, S.Node, S.True, S.False});
+          Work.push_back({StepKind::Eval, getVisitKind(S.Node), S.Node});
+          break;
+        }
+        case StepKind::BranchOnValue:
+        {
+          Value *Val = toBool(Values.pop_back_val());
+          emitLocation(S.Node);
+          Builder.CreateCondBr(Val, S.True, S.False);
+          break;
+        }
+        case StepKind::SetInsertPoint:
+          Builder.SetInsertPoint(S.True);
+          break;
+        case StepKind::ShortCircuitEnd:
+        {
+          // Every edge that skips the right operand carries the constant the
+          // left operand decided on.
+          bool IsAnd = getOperator(S.Node) == BinaryOp::And;
+          BasicBlock *EndBB = S.True;
+          Value *Right = toBool(Values.pop_back_val());
+          BasicBlock *RhsEndBB = Builder.GetInsertBlock();
+          emitLocation(S.Node);
+          Builder.CreateBr(EndBB);
+
+          Builder.SetInsertPoint(EndBB);
+          PHINode *Phi = Builder.CreatePHI(Int1Ty, 2);
+          Constant *Skipped = ConstantInt::get(Int1Ty, IsAnd ? 0 : 1);
+          for (BasicBlock *Pred : predecessors(EndBB))
+            Phi->addIncoming(Pred == RhsEndBB ? Right : Skipped, Pred);
+          Values.push_back(Phi);
+          rememberValue(S.Node, Phi);
+          break;
+        }
+        }
+      }
+      CurVisit = Saved;
+      if (!Values.empty())
+        V = Values.back();
+    }
+
+    ValueRange getRange(Expr *E)
+    {
+      return Ranges ? Ranges->getRange(E) : ValueRange();
+    }
+
+    // Branch to the trap block if Failed holds and continue in a new block.
+    // The branch is weighted so that the trap stays off the hot path.
+    void emitTrapIf(Value *Failed, const Twine &Name)
+    {
+      if (!TrapBB || TrapBB->getParent() != CurFn)
+      {
+        TrapBB = createBlock("trap");
+        GSMIRBuilder TrapBuilder(M->getContext(), ConstantFolder(), CountingInserter(Stats, &CurVisit));
+        TrapBuilder.SetInsertPoint(TrapBB);
+        TrapBuilder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::trap));
+        TrapBuilder.CreateUnreachable();
+      }
+      BasicBlock *ContBB = createBlock(Name);
+      Builder.CreateCondBr(Failed, TrapBB, ContBB, MDBuilder(M->getContext()).createBranchWeights(1, 1 << 20));
+      Builder.SetInsertPoint(ContBB);
+    }
+
+    // Emit +, - or * of operands with ranges L and R. An operation that cannot
+    // overflow is also nuw if it cannot wrap around as unsigned either; one
+    // that may overflow is checked with CheckedArith.
+    Value *emitArith(BinaryOp::Operator Op, Value *Left, Value *Right, const ValueRange &L,
+                     const ValueRange &R)
+    {
+      bool Overflow;
+      ValueRange::apply(Op, L, R, &Overflow);
+      if (CheckedArith && Overflow)
+      {
+        Intrinsic::ID ID = Op == BinaryOp::Plus    ? Intrinsic::sadd_with_overflow
+                           : Op == BinaryOp::Minus ? Intrinsic::ssub_with_overflow
+                                                   : Intrinsic::smul_with_overflow;
+        Value *Pair = Builder.CreateBinaryIntrinsic(ID, Left, Right);
+        emitTrapIf(Builder.CreateExtractValue(Pair, 1), "no.overflow");
+        return Builder.CreateExtractValue(Pair, 0);
+      }
+      bool NonNegative = L.Lo >= 0 && R.Lo >= 0;
+      switch (Op)
+      {
+      case BinaryOp::Plus:
+        return Builder.CreateAdd(Left, Right, "", NonNegative && !Overflow, true);
+      case BinaryOp::Minus:
+        return Builder.CreateSub(Left, Right, "", NonNegative && L.Lo >= R.Hi, true);
+      default:
+        return Builder.CreateMul(Left, Right, "", NonNegative && !Overflow, true);
+      }
+    }
+
+    // Emit / or % of operands with ranges L and R. Non-negative operands are
+    // divided unsigned, which is cheaper, and a quotient known to have no
+    // remainder is exact. With CheckedArith, a division by zero or of
+    // INT_MIN by -1 that the ranges allow traps.
+    Value *emitDivision(BinaryOp::Operator Op, Value *Left, Value *Right, const ValueRange &L,
+                        const ValueRange &R)
+    {
+      if (CheckedArith)
+      {
+        Value *Failed = nullptr;
+        if (R.contains(0))
+          Failed = Builder.CreateICmpEQ(Right, Int32Zero);
+        if (L.contains(INT32_MIN) && R.contains(-1))
+        {
+          Value *Overflow = Builder.CreateAnd(Builder.CreateICmpEQ(Left, ConstantInt::get(Int32Ty, INT32_MIN, true)),
+                                              Builder.CreateICmpEQ(Right, ConstantInt::get(Int32Ty, -1, true)));
+          Failed = Failed ? Builder.CreateOr(Failed, Overflow) : Overflow;
+        }
+        if (Failed)
+          emitTrapIf(Failed, "no.trap");
+      }
+      bool Unsigned = L.Lo >= 0 && R.Lo >= 0;
+      if (Op == BinaryOp::Div)
+      {
+        bool Exact = L.isMultipleOf(R);
+        return Unsigned ? Builder.CreateUDiv(Left, Right, "", Exact) : Builder.CreateSDiv(Left, Right, "", Exact);
+      }
+      return Unsigned ? Builder.CreateURem(Left, Right) : Builder.CreateSRem(Left, Right);
+    }
+
+    // Sema's check for a division by a literal zero.
+    void checkDivisor(Expr *Divisor)
+    {
+      auto *F = dyn_cast<Factor>(Divisor);
+      if (F && F->getKind() == Factor::Number && F->getNumber() == 0)
+      {
+        Sema::reportDivisionByZero();
+        HasError = true;
+      }
+    }
+
+    void checkDivisor(FlatAST::Index Divisor)
     {
-      // Visit the left-hand side of the binary operation and get its value.
-      Node.getLeft()->accept(*this);
-      Value *Left = V;
+      const FlatAST::ExprNode &N = Flat->Exprs[Divisor];
+      if (N.K == FlatAST::ExprNode::Number && Flat->Literals[N.LHS] == 0)
+      {
+        Sema::reportDivisionByZero();
+        HasError = true;
+      }
+    }
+
+    // Emit the instruction of a binary operation whose operands are lowered.
+    Value *emitBinaryOp(Expr *Node, Value *Left, Value *Right)
+    {
+      auto *BinOp = cast<BinaryOp>(Node);
+      emitLocation(BinOp);
+      return emitBinaryOp(BinOp->getOperator(), Left, Right, getRange(BinOp->getLeft()),
+                          getRange(BinOp->getRight()));
+    }
 
-      // Visit the right-hand side of the binary operation and get its value.
-      Node.getRight()->accept(*this);
-      Value *Right = V;
+    // A FlatAST is not analyzed, so its ranges are full.
+    Value *emitBinaryOp(FlatAST::Index Node, Value *Left, Value *Right)
+    {
+      return emitBinaryOp(getOperator(Node), Left, Right, ValueRange(), ValueRange());
+    }
 
+    // Emit Op on operands with ranges L and R.
+    Value *emitBinaryOp(BinaryOp::Operator Op, Value *Left, Value *Right, const ValueRange &L,
+                        const ValueRange &R)
+    {
       // Perform the binary operation based on the operator type and create the corresponding instruction.
-      switch (Node.getOperator())
+      Value *Res = nullptr;
+      switch (Op)
       {
       case BinaryOp::Plus:
-        V = Builder.CreateNSWAdd(Left, Right);
-        break;
       case BinaryOp::Minus:
-        V = Builder.CreateNSWSub(Left, Right);
-        break;
       case BinaryOp::Mul:
-        V = Builder.CreateNSWMul(Left, Right);
+        Res = emitArith(Op, Left, Right, L, R);
         break;
       case BinaryOp::Div:
-        V = Builder.CreateSDiv(Left, Right);
+      case BinaryOp::Remain:
+        Res = emitDivision(Op, Left, Right, L, R);
         break;
       case BinaryOp::Power:
       {
-        V = Left;
-        Factor *f = (Factor *)Right;
-        int temp;
-        f->getVal().getAsInteger(10, temp);
-        // llvm::errs() << temp
-        //      << " :: " << f->getVal();
-        if (f && f->getKind() == Factor::ValueKind::Number){
-          int right_value_as_int;
-          f->getVal().getAsInteger(10, right_value_as_int);
+        Res = Left;
+        // The exponent has already been lowered, so a literal shows up as a constant.
+        if (auto *C = dyn_cast<ConstantInt>(Right)){
+          int right_value_as_int = C->getSExtValue();
           if(right_value_as_int == 0)
-            V = ConstantInt::get(Int32Ty, 1, true);
-          else{
-            for(int i = 1;i < right_value_as_int;i++){
-              V = Builder.CreateNSWMul(V, Left);
+            Res = ConstantInt::get(Int32Ty, 1, true);
+          else if(right_value_as_int > 1){
+            // Square and multiply from the highest bit of the exponent down.
+            // Every partial result is a power of Left no higher than the
+            // exponent, so a check only fails if the whole power overflows.
+            ValueRange Partial = L; // range of the power multiplied out so far
+            for(int Bit = Log2_32(right_value_as_int) - 1; Bit >= 0; --Bit){
+              Res = emitArith(BinaryOp::Mul, Res, Res, Partial, Partial);
+              Partial = ValueRange::apply(BinaryOp::Mul, Partial, Partial);
+              if(right_value_as_int >> Bit & 1){
+                Res = emitArith(BinaryOp::Mul, Res, Left, Partial, L);
+                Partial = ValueRange::apply(BinaryOp::Mul, Partial, L);
+              }
             }
           }
         }
         break;
       }
-      case BinaryOp::Remain:
-        V = Builder.CreateSRem(Left, Right);
-        break;
       case BinaryOp::Or:
-        V = Builder.CreateOr(Left, Right);
-        break;
       case BinaryOp::And:
-        V = Builder.CreateAnd(Left, Right);
-        break;
+        llvm_unreachable("and/or are lowered by lowerExpr");
       case BinaryOp::Equal_equal:
-        V = Builder.CreateICmpEQ(Left, Right);
+        Res = Builder.CreateICmpEQ(Left, Right);
         break;
       case BinaryOp::Not_equal:
-        V = Builder.CreateICmpNE(Left, Right);
+        Res = Builder.CreateICmpNE(Left, Right);
         break;
       case BinaryOp::More_equal:
-        V = Builder.CreateICmpSGE(Left, Right);
+        Res = Builder.CreateICmpSGE(Left, Right);
         break;
       case BinaryOp::Less_equal:
-        V = Builder.CreateICmpSLE(Left, Right);
+        Res = Builder.CreateICmpSLE(Left, Right);
         break;
       case BinaryOp::Less:
-        V = Builder.CreateICmpSLT(Left, Right);
+        Res = Builder.CreateICmpSLT(Left, Right);
         break;
       case BinaryOp::More:
-        V = Builder.CreateICmpSGT(Left, Right);
+        Res = Builder.CreateICmpSGT(Left, Right);
         break;
       }
-    };
+      return Res;
+    }
 
-    virtual void visit(Declaration &Node) override
+    // Lower a guard directly into control flow.
+    template <typename NodeT> void emitCondBr(NodeT Cond, BasicBlock *TrueBB, BasicBlock *FalseBB)
     {
+      lowerExpr(ExprStep<NodeT>{StepKind::Branch, CurVisit, Cond, TrueBB, FalseBB});
+    }
 
-      // Our code
-      bool hasValue = false;
-      auto e_I = Node.begin_values(), e_E = Node.end_values();
-      // Iterate over the variables declared in the declaration statement.
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I, ++e_I)
-      {
-        StringRef Var = *I;
-        Value *val = nullptr;
-        // Create an alloca instruction to allocate memory for the variable.
-        nameMap[Var] = Builder.CreateAlloca(Int32Ty);
-        
-        if (e_I != e_E) // star or not ? 
-        {
-          (* e_I)->accept(*this);
-
-          val = V;
+    // Returns the variable and literal of a guard of the form `x == 4` or `4 == x`.
+    static bool matchEqualityGuard(Expr *Guard, StringRef &Var, int &Val)
+    {
+      auto *Cmp = dyn_cast<BinaryOp>(Guard);
+      if (!Cmp || Cmp->getOperator() != BinaryOp::Equal_equal)
+        return false;
+      auto *L = dyn_cast<Factor>(Cmp->getLeft());
+      auto *R = dyn_cast<Factor>(Cmp->getRight());
+      if (!L || !R)
+        return false;
+      if (L->getKind() == Factor::Number)
+        std::swap(L, R);
+      if (L->getKind() != Factor::Ident || R->getKind() != Factor::Number)
+        return false;
+      Var = L->getVal();
+      Val = R->getNumber();
+      return true;
+    }
 
-          if (val != nullptr)
-          {
-            Builder.CreateStore(val, nameMap[Var]);
-          }
-        }
-        else if(e_I == e_E || hasValue)
-        {
-          hasValue = true;
-          val = ConstantInt::get(Int32Ty, 0, true);
-          if (val != nullptr)
-          {
-            Builder.CreateStore(val, nameMap[Var]);
-          }
-        }
-      }
-    };
+    bool matchEqualityGuard(FlatAST::Index Guard, StringRef &Var, int &Val)
+    {
+      const FlatAST::ExprNode &Cmp = Flat->Exprs[Guard];
+      if (Cmp.K != FlatAST::ExprNode::Binary || Cmp.Op != BinaryOp::Equal_equal)
+        return false;
+      const FlatAST::ExprNode *L = &Flat->Exprs[Cmp.LHS];
+      const FlatAST::ExprNode *R = &Flat->Exprs[Cmp.RHS];
+      if (L->K == FlatAST::ExprNode::Number)
+        std::swap(L, R);
+      if (L->K != FlatAST::ExprNode::Ident || R->K != FlatAST::ExprNode::Number)
+        return false;
+      Var = Flat->Idents[L->LHS];
+      Val = Flat->Literals[R->LHS];
+      return true;
+    }
 
-    virtual void visit(BE &Node) override
+    // An if/elif ladder whose guards all compare one variable against distinct
+    // literals becomes a single switch, so LLVM can pick a jump table or a
+    // binary search instead of testing every guard in turn.
+    template <typename NodeT>
+    bool lowerAsSwitch(SMLoc Loc, ArrayRef<NodeT> Guards, unsigned NumBodies,
+                       function_ref<void(unsigned)> LowerBody)
     {
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      if (Guards.size() < 2)
+        return false;
+
+      StringRef Var;
+      llvm::SmallVector<int, 8> Cases;
+      DenseSet<int64_t> Seen; // 64-bit, as DenseSet<int> reserves INT_MAX
+      for (NodeT Guard : Guards)
       {
-        if (*I)
-        {
-          Assignment *casted_I = (Assignment *)I;
-          casted_I->accept(*this);
-        }
+        StringRef GuardVar;
+        int Val;
+        if (!matchEqualityGuard(Guard, GuardVar, Val) ||
+            (!Var.empty() && GuardVar != Var) || !Seen.insert(Val).second)
+          return false;
+        Var = GuardVar;
+        Cases.push_back(Val);
       }
-    };
+      // An undeclared variable is reported when the guards are lowered.
+      if (!isDeclared(Var))
+        return false;
 
-    virtual void visit(Loop &Node) override
-    {
-      llvm::BasicBlock* WhileCondBB = llvm::BasicBlock::Create(M->getContext(), "loopc.cond", MainFn);
-      llvm::BasicBlock* WhileBodyBB = llvm::BasicBlock::Create(M->getContext(), "loopc.body", MainFn);
-      llvm::BasicBlock* AfterWhileBB = llvm::BasicBlock::Create(M->getContext(), "after.loopc", MainFn);
+      emitLocation(Loc);
+      BasicBlock *afterIfConditionBB = createBlock("after");
+      bool hasElse = NumBodies > Guards.size();
+      BasicBlock *DefaultBB = hasElse ? createBlock("else.body")
+                                      : afterIfConditionBB;
+      Value *Scrutinee = Builder.CreateLoad(Int32Ty, getVarAddr(Var));
+      SwitchInst *Switch = Builder.CreateSwitch(Scrutinee, DefaultBB, Cases.size());
 
-      Builder.CreateBr(WhileCondBB);
-      Builder.SetInsertPoint(WhileCondBB);
-      Node.getExpr()->accept(*this);
-      Value* val=V;
-      Builder.CreateCondBr(val, WhileBodyBB, AfterWhileBB);
-      Builder.SetInsertPoint(WhileBodyBB);
-      BE *be = Node.getBE();
-      
-      for (auto I = be->begin(), E = be->end(); I != E; ++I){
-        (*I)->accept(*this);
+      for (size_t i = 0, e = NumBodies; i != e; ++i)
+      {
+        BasicBlock *BodyBB = DefaultBB;
+        if (i < Cases.size())
+        {
+          BodyBB = createBlock(i == 0 ? "if.body" : "elif.body");
+          Switch->addCase(cast<ConstantInt>(ConstantInt::get(Int32Ty, Cases[i], true)), BodyBB);
+        }
+        Builder.SetInsertPoint(BodyBB);
+        LowerBody(i);
+        Builder.CreateBr(afterIfConditionBB);
       }
+      Builder.SetInsertPoint(afterIfConditionBB);
+      return true;
+    }
 
-      Builder.CreateBr(WhileCondBB);
-      Builder.SetInsertPoint(AfterWhileBB);
-    
-
-    };
+    // The lowering of the statements is shared by both trees: the visit
+    // methods and lowerFlatStmt pass the parts of a node to these, with
+    // callbacks that lower its bodies.
 
-    virtual void visit(Condition &Node) override
+    // Load a variable, or an undefined value if it is not declared.
+    Value *emitLoad(StringRef Var)
     {
+      if (!checkDeclared(Var))
+        return UndefValue::get(Int32Ty);
+      return Builder.CreateLoad(Int32Ty, getVarAddr(Var));
+    }
 
-      // Our code
-      Value *val = nullptr;
-      int count_exprs = 0;
-      int count_bes = 0;
-      bool hasIf = true;
-      bool endOfCondition = false;
-      llvm::BasicBlock* ifcondBB;
-      llvm::BasicBlock* ifBodyBB;
-      llvm::BasicBlock* afterIfConditionBB = llvm::BasicBlock::Create(M -> getContext(), "after", MainFn);
-
-      llvm::SmallVector<BE *> bes = Node.getAllBes();
-      llvm::SmallVector<Expr *> exprs = Node.getAllExpresions();
-
-      for (auto I = exprs.begin(), E = exprs.end(); I != E; ++I)
+    // Call the user function Name with Args.
+    Value *emitCall(StringRef Name, ArrayRef<Value *> Args)
+    {
+      Function *Fn = Functions.lookup(Name);
+      if (!Fn)
       {
-        count_exprs++;
+        Sema::reportUndefinedFunction(Name);
+        HasError = true;
       }
-      for (auto I = bes.begin(), E = bes.end(); I != E; ++I)
+      else if (Fn->arg_size() != Args.size())
       {
-        count_bes++;
+        Sema::reportArgumentCount(Name, Fn->arg_size());
+        HasError = true;
+        Fn = nullptr;
       }
-      bool hasElse = (count_bes - count_exprs)  == 1;
+      if (!Fn)
+        return UndefValue::get(Int32Ty);
+      return Builder.CreateCall(Fn, Args);
+    }
 
+    // Declare Var, initialized to Val, which was lowered before it.
+    void emitDeclaration(StringRef Var, Value *Val)
+    {
+      if (CheckSemantics && isRedeclared(Var))
+      {
+        Sema::reportRedeclared(Var);
+        HasError = true;
+      }
 
-      auto bes_I = bes.begin();
-      auto E_End = exprs.end();
-      if (hasElse) E_End++;
+      // Create an alloca instruction to allocate memory for the variable.
+      Value *Addr = declareVar(Var);
 
-      for (auto I = exprs.begin(), E = exprs.end(); I != E_End; ++I)
+      if (DBuilder && (!ChunkSize || !BlockScopes.empty()))
       {
-        
-        if (hasIf)
-        {
-          ifcondBB = llvm::BasicBlock::Create(M -> getContext(), "if.condition", MainFn);
-          Builder.CreateBr(ifcondBB);
-          Builder.SetInsertPoint(ifcondBB);
-          (*I)->accept(*this);
-          val = V;
-          
-          ifBodyBB = llvm::BasicBlock::Create(M -> getContext(), "if.body", MainFn);
-          if(hasElse && count_exprs == 1){ // next is else
-            ifcondBB = llvm::BasicBlock::Create(M -> getContext(), "else.body", MainFn);
-            Builder.CreateCondBr(val, ifBodyBB, ifcondBB);
-            Builder.SetInsertPoint(ifBodyBB);
-          }
-          else if(count_exprs > 1){ // next is elif
-            ifcondBB = llvm::BasicBlock::Create(M -> getContext(), "elif.condition", MainFn);
-            Builder.CreateCondBr(val, ifBodyBB, ifcondBB);
-            Builder.SetInsertPoint(ifBodyBB);
-          } else{
-            Builder.CreateCondBr(val, ifBodyBB, afterIfConditionBB);
-            Builder.SetInsertPoint(ifBodyBB);
+        // Make the variable visible to debuggers under its GSM name.
+        DILocalVariable *DVar = DBuilder->createAutoVariable(
+            DScope, Var, DFile, Builder.getCurrentDebugLocation().getLine(), DInt32Ty);
+        DBuilder->insertDeclare(Addr, DVar, DBuilder->createExpression(),
+                                Builder.getCurrentDebugLocation().get(), Builder.GetInsertBlock());
+      }
+      Builder.CreateStore(Val, Addr);
+    }
 
+    // Store Val into Var, if it is Declared, and write it at the top level.
+    void emitAssignment(StringRef Var, Value *Val, bool Declared)
+    {
+      if (Declared)
+        Builder.CreateStore(Val, getVarAddr(Var));
+
+      // Create a call instruction to invoke the "gsm_write" function with the
+      // value; functions do not write.
+      if (!InFunction)
+        Builder.CreateCall(CalcWriteFnTy, CalcWriteFn, {Val});
+    }
+
+    // Whether a read statement at Loc may be lowered; functions do not read.
+    bool checkRead(SMLoc Loc)
+    {
+      if (!InFunction)
+        return true;
+      Sema::reportReadInFunction(Loc);
+      HasError = true;
+      return false;
+    }
+
+    // Read a value into Var.
+    void emitRead(StringRef Var)
+    {
+      if (!checkDeclared(Var))
+        return;
+      // The runtime reports the variable by name when the input is bad.
+      Constant *&Name = VarNames[Var];
+      if (!Name)
+        Name = Builder.CreateGlobalStringPtr(Var, "gsm.name." + Var);
+      Value *Val = Builder.CreateCall(CalcReadFnTy, getReadFn(), {Name});
+      Builder.CreateStore(Val, getVarAddr(Var));
+    }
+
+    // A block is a scope. It gets a lexical block in the debug information
+    // if it declares variables, so that debuggers tell hidden ones apart.
+    void lowerBlock(SMLoc Loc, bool DeclaresVars, function_ref<void()> LowerStmts)
+    {
+      DIScope *SavedScope = DScope;
+      if (DBuilder && DeclaresVars)
+      {
+        auto LineCol = SrcMgr.getLineAndColumn(Loc);
+        DScope = DBuilder->createLexicalBlock(DScope, DFile, LineCol.first, LineCol.second);
+      }
+      BlockScopes.emplace_back();
+      LowerStmts();
+      for (auto &Hidden : llvm::reverse(BlockScopes.back()))
+      {
+        if (Hidden.second)
+          nameMap[Hidden.first] = Hidden.second;
+        else
+          nameMap.erase(Hidden.first);
+      }
+      BlockScopes.pop_back();
+      DScope = SavedScope;
+    }
+
+    template <typename NodeT> void lowerLoop(SMLoc Loc, NodeT Cond, function_ref<void()> LowerBody)
+    {
+      llvm::BasicBlock* WhileCondBB = createBlock("loopc.cond");
+      llvm::BasicBlock* WhileBodyBB = createBlock("loopc.body");
+      llvm::BasicBlock* AfterWhileBB = createBlock("after.loopc");
+
+      emitLocation(Loc);
+      Builder.CreateBr(WhileCondBB);
+      Builder.SetInsertPoint(WhileCondBB);
+      emitCondBr(Cond, WhileBodyBB, AfterWhileBB);
+      Builder.SetInsertPoint(WhileBodyBB);
+      LowerBody();
+
+      emitLocation(Loc);
+      Builder.CreateBr(WhileCondBB);
+      Builder.SetInsertPoint(AfterWhileBB);
+    }
+
+    // Lower an if/elif/else chain; LowerBody lowers the I-th body, the one
+    // of else after those of the guards.
+    template <typename NodeT>
+    void lowerCondition(SMLoc Loc, ArrayRef<NodeT> Guards, unsigned NumBodies,
+                        function_ref<void(unsigned)> LowerBody)
+    {
+      if (lowerAsSwitch(Loc, Guards, NumBodies, LowerBody))
+        return;
+
+      llvm::BasicBlock* afterIfConditionBB = createBlock("after");
+      bool hasElse = NumBodies > Guards.size();
+
+      emitLocation(Loc);
+      llvm::BasicBlock* ifcondBB = createBlock("if.condition");
+      Builder.CreateBr(ifcondBB);
+
+      for (size_t i = 0, e = NumBodies; i != e; ++i)
+      {
+        Builder.SetInsertPoint(ifcondBB);
+        if (i < Guards.size())
+        {
+          // Guard of the if/elif arm; a false guard falls through to the next arm.
+          llvm::BasicBlock* ifBodyBB = createBlock(i == 0 ? "if.body" : "elif.body");
+          if (i + 1 < Guards.size())
+            ifcondBB = createBlock("elif.condition");
+          else if (hasElse)
+            ifcondBB = createBlock("else.body");
+          else
+            ifcondBB = afterIfConditionBB;
+          emitCondBr(Guards[i], ifBodyBB, ifcondBB);
+          Builder.SetInsertPoint(ifBodyBB);
+        }
+
+        LowerBody(i);
+        Builder.CreateBr(afterIfConditionBB);
+      }
+      Builder.SetInsertPoint(afterIfConditionBB);
+    }
+
+    // A function is lowered into an internal function of its own, between
+    // the top-level statements around it; their state is saved meanwhile.
+    // Its parameters belong to the block of its body, like in Sema. EndLoc
+    // is where it returns 0 when its body ends without a return.
+    void lowerFunction(StringRef Name, ArrayRef<StringRef> Params, bool Memo, SMLoc Loc, SMLoc EndLoc,
+                       function_ref<void()> LowerBody)
+    {
+      FunctionType *Fty = FunctionType::get(Int32Ty, SmallVector<Type *, 4>(Params.size(), Int32Ty), false);
+      Function *Fn = Function::Create(Fty, GlobalValue::InternalLinkage, "gsm.fn." + Name, M);
+      if (!Functions.try_emplace(Name, Fn).second)
+      {
+        Sema::reportRedefinedFunction(Name);
+        HasError = true;
+      }
+
+      Function *SavedFn = CurFn;
+      Value *SavedState = StateArg;
+      StringMap<Value *> SavedNames = std::move(nameMap);
+      DISubprogram *SavedSP = DSP;
+      DIScope *SavedScope = DScope;
+      BasicBlock *SavedTrapBB = TrapBB;
+      IRBuilderBase::InsertPoint SavedIP = Builder.saveIP();
+      DebugLoc SavedLoc = Builder.getCurrentDebugLocation();
+
+      unsigned Line = 1;
+      if (DBuilder)
+      {
+        Line = SrcMgr.getLineAndColumn(Loc).first;
+        createSubprogram(Fn, DInt32Ty, Name, Line);
+      }
+      enterFunction(Fn, nullptr);
+      InFunction = true;
+      emitLocation(Loc);
+      BlockScopes.emplace_back();
+      for (unsigned I = 0, E = Params.size(); I != E; ++I)
+      {
+        if (CheckSemantics && isRedeclared(Params[I]))
+        {
+          Sema::reportRedeclared(Params[I]);
+          HasError = true;
+        }
+        Value *Addr = declareVar(Params[I]);
+        Builder.CreateStore(Fn->getArg(I), Addr);
+        if (DBuilder)
+        {
+          DILocalVariable *DVar = DBuilder->createParameterVariable(DSP, Params[I], I + 1, DFile, Line, DInt32Ty);
+          DBuilder->insertDeclare(Addr, DVar, DBuilder->createExpression(),
+                                  Builder.getCurrentDebugLocation().get(), Builder.GetInsertBlock());
+        }
+      }
+      if (Memo)
+        emitMemoLookup(Name, Fn);
+
+      LowerBody();
+      // Falling off the end returns 0.
+      emitLocation(EndLoc);
+      emitReturn(Int32Zero);
+
+      BlockScopes.pop_back();
+      InFunction = false;
+      MemoCache = nullptr;
+      MemoArgs = nullptr;
+      CurFn = SavedFn;
+      StateArg = SavedState;
+      nameMap = std::move(SavedNames);
+      DSP = SavedSP;
+      DScope = SavedScope;
+      TrapBB = SavedTrapBB;
+      Builder.restoreIP(SavedIP);
+      Builder.SetCurrentDebugLocation(SavedLoc);
+    }
+
+    // Return Val from the function being lowered, if any.
+    void emitReturnStatement(SMLoc Loc, Value *Val)
+    {
+      if (!InFunction)
+      {
+        Sema::reportReturnOutsideFunction(Loc);
+        HasError = true;
+        return;
+      }
+      emitLocation(Loc);
+      emitReturn(Val);
+      // Statements after the return are unreachable.
+      Builder.SetInsertPoint(createBlock("after.return"));
+    }
+
+    // Lower a statement of Flat, and the statements of its blocks.
+    void lowerFlatStmt(const FlatAST::StmtNode &S)
+    {
+      VisitScope Scope(*this, S.Kind);
+      switch (S.Kind)
+      {
+      case Expr::EK_Declaration:
+      {
+        // Each initializer runs before its variable is declared.
+        const FlatAST::DeclNode &D = Flat->Decls[S.Node];
+        for (FlatAST::Index I = 0; I != D.NumVars; ++I)
+        {
+          Value *Val = Int32Zero;
+          if (I < D.NumInits)
+          {
+            emitLocation(S.Loc);
+            Val = toInt(lowerFlatExpr(Flat->Refs[D.FirstInit + I]));
           }
-      
-          hasIf = false;
-
-   
-        } else if(count_exprs > 0){
-          // Builder.CreateBr(ifcondBB);
-          Builder.SetInsertPoint(ifcondBB);
-          (*I)->accept(*this);
-
-          val = V;
-          ifBodyBB = llvm::BasicBlock::Create(M -> getContext(), "elif.body", MainFn);
-          if(hasElse && count_exprs == 1){ // next is else
-            ifcondBB = llvm::BasicBlock::Create(M -> getContext(), "else.body", MainFn);
-            Builder.CreateCondBr(val, ifBodyBB, ifcondBB);
-            Builder.SetInsertPoint(ifBodyBB);
-          } else if(count_exprs > 1){ // next is elif
-            ifcondBB = llvm::BasicBlock::Create(M -> getContext(), "elif.condition", MainFn);
-            Builder.CreateCondBr(val, ifBodyBB, ifcondBB);
-            Builder.SetInsertPoint(ifBodyBB);
-          } else{
-            Builder.CreateCondBr(val, ifBodyBB, afterIfConditionBB);
-            Builder.SetInsertPoint(ifBodyBB);
-          }
+          emitLocation(S.Loc);
+          emitDeclaration(Flat->Idents[Flat->Refs[D.FirstVar + I]], Val);
         }
-        else{ //else body
-          Builder.SetInsertPoint(ifcondBB);
+        break;
+      }
+      case Expr::EK_Assignment:
+      {
+        const FlatAST::AssignNode &A = Flat->Assigns[S.Node];
+        bool Declared = checkDeclared(Flat->Idents[A.Var]);
+        emitLocation(S.Loc);
+        Value *Val = toInt(lowerFlatExpr(A.Value));
+        emitLocation(S.Loc);
+        emitAssignment(Flat->Idents[A.Var], Val, Declared);
+        break;
+      }
+      case Expr::EK_Read:
+      {
+        if (!checkRead(S.Loc))
+          break;
+        emitLocation(S.Loc);
+        const FlatAST::ReadNode &R = Flat->Reads[S.Node];
+        for (FlatAST::Index I = R.FirstVar, E = R.FirstVar + R.NumVars; I != E; ++I)
+          emitRead(Flat->Idents[Flat->Refs[I]]);
+        break;
+      }
+      case Expr::EK_Loop:
+      {
+        const FlatAST::LoopNode &L = Flat->Loops[S.Node];
+        lowerLoop(S.Loc, L.Cond, [&] { lowerFlatBlock(L.Body, S.Loc); });
+        break;
+      }
+      case Expr::EK_Condition:
+      {
+        const FlatAST::CondNode &C = Flat->Conds[S.Node];
+        lowerCondition(S.Loc, makeArrayRef(Flat->Refs).slice(C.FirstGuard, C.NumGuards), C.NumBodies,
+                       [&](unsigned I) { lowerFlatBlock(Flat->Refs[C.FirstBody + I], S.Loc); });
+        break;
+      }
+      case Expr::EK_FunctionDef:
+      {
+        const FlatAST::FuncNode &F = Flat->Funcs[S.Node];
+        SmallVector<StringRef, 4> Params;
+        for (FlatAST::Index I = F.FirstParam, E = F.FirstParam + F.NumParams; I != E; ++I)
+          Params.push_back(Flat->Idents[Flat->Refs[I]]);
+        const FlatAST::BENode &Body = Flat->BEs[F.Body];
+        lowerFunction(Flat->Idents[F.Name], Params, F.Memo, S.Loc, S.Loc, [&] {
+          for (FlatAST::Index I = Body.FirstStmt, E = Body.FirstStmt + Body.NumStmts; I != E; ++I)
+            lowerFlatStmt(Flat->BlockStmts[I]);
+        });
+        break;
+      }
+      case Expr::EK_Return:
+        emitReturnStatement(S.Loc, toInt(lowerFlatExpr(S.Node)));
+        break;
+      default:
+        break;
+      }
+    }
+
+    // Lower the block Flat->BEs[Block] of a statement at Loc.
+    void lowerFlatBlock(FlatAST::Index Block, SMLoc Loc)
+    {
+      const FlatAST::BENode &B = Flat->BEs[Block];
+      ArrayRef<FlatAST::StmtNode> Stmts = makeArrayRef(Flat->BlockStmts).slice(B.FirstStmt, B.NumStmts);
+      bool DeclaresVars = llvm::any_of(
+          Stmts, [](const FlatAST::StmtNode &Stmt) { return Stmt.Kind == Expr::EK_Declaration; });
+      lowerBlock(Loc, DeclaresVars, [&] {
+        for (const FlatAST::StmtNode &Stmt : Stmts)
+          lowerFlatStmt(Stmt);
+      });
+    }
+
+  public:
+    // Constructor for the visitor class.
+    ToIRVisitor(Module *M, const SourceMgr &SrcMgr, const CodeGenOptions &Opts)
+        : M(M), Stats(Opts.Stats),
+          Builder(M->getContext(), ConstantFolder(), CountingInserter(Opts.Stats, &CurVisit)),
+          CheckSemantics(Opts.CheckSemantics), ReuseValues(Opts.ReuseValues), CheckedArith(Opts.CheckedArith),
+          ChunkSize(Opts.ChunkSize), SrcMgr(SrcMgr)
+    {
+      // Initialize LLVM types and constants.
+      VoidTy = Type::getVoidTy(M->getContext());
+      Int1Ty = Type::getInt1Ty(M->getContext());
+      Int32Ty = Type::getInt32Ty(M->getContext());
+      Int8PtrTy = Type::getInt8PtrTy(M->getContext());
+      Int8PtrPtrTy = Int8PtrTy->getPointerTo();
+      Int32Zero = ConstantInt::get(Int32Ty, 0, true);
+
+      CalcWriteFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
+      CalcWriteFn = Function::Create(CalcWriteFnTy, GlobalValue::ExternalLinkage, "gsm_write", M);
+
+      // Optimization remarks need source locations. Without -g they are
+      // tracked in a compile unit that emits no debug information.
+      if (Opts.EmitDebugInfo || Opts.wantsRemarks())
+      {
+        // Describe the source buffer as the single compile unit of the module.
+        SmallString<128> Path(SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBufferIdentifier());
+        sys::fs::make_absolute(Path);
+        DBuilder = std::make_unique<DIBuilder>(*M);
+        DFile = DBuilder->createFile(sys::path::filename(Path), sys::path::parent_path(Path));
+        DBuilder->createCompileUnit(dwarf::DW_LANG_C, DFile, "gsm", /*isOptimized=*/false, "", 0, "",
+                                    Opts.EmitDebugInfo ? DICompileUnit::FullDebug : DICompileUnit::NoDebug);
+        DInt32Ty = DBuilder->createBasicType("int", 32, dwarf::DW_ATE_signed);
+        M->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+        M->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+      }
+    }
+
+    // Whether a semantic error was found while lowering.
+    bool hasError() const { return HasError; }
+
+    // Entry point for generating LLVM IR from the AST.
+    void run(AST *Tree, ArrayRef<int32_t> Written = None, const RangeAnalysis *Ranges = nullptr)
+    {
+      this->Written = Written;
+      this->Ranges = Ranges;
+      begin();
+
+      // Visit the root node of the AST to generate IR.
+      traverse(*static_cast<Expr *>(Tree));
+
+      finish();
+    }
+
+    // Generates the same IR from a FlatAST, walking its statements in order.
+    void run(const FlatAST &Tree)
+    {
+      Flat = &Tree;
+      begin();
+      {
+        VisitScope Scope(*this, Expr::EK_Goal);
+        for (const FlatAST::StmtNode &S : Tree.Stmts)
+        {
+          startStatement(S.Kind == Expr::EK_FunctionDef);
+          lowerFlatStmt(S);
+        }
+      }
+      finish();
+      Flat = nullptr;
+    }
+
+    // Create main and position the builder in its entry block. Statements are
+    // lowered one after the other by emitStatement until finish() is called.
+    void begin()
+    {
+      // Create the main function with the appropriate function type.
+      MainFty = FunctionType::get(Int32Ty, {Int32Ty, Int8PtrPtrTy}, false);
+      MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, "main", M);
+
+      if (DBuilder)
+        createSubprogram(MainFn, DInt32Ty);
+
+      // With chunking, main only calls the chunks and is filled in by finish().
+      if (ChunkSize)
+      {
+        ChunkFty = FunctionType::get(VoidTy, {Int32Ty->getPointerTo()}, false);
+        return;
+      }
+
+      enterFunction(MainFn, nullptr);
+      emitWritten();
+    }
+
+    void emitStatement(Expr *Stmt)
+    {
+      startStatement(isa<FunctionDef>(Stmt));
+      traverse(*Stmt);
+    }
+
+    // Start the next chunk before a top-level statement, if it is due. A
+    // function is lowered into its own function, outside the chunks.
+    void startStatement(bool IsFunction)
+    {
+      if (ChunkSize && !IsFunction && NumStmts++ % ChunkSize == 0)
+      {
+        VisitScope Scope(*this, CompileStats::Driver);
+        startChunk();
+      }
+    }
+
+    void finish()
+    {
+      if (ChunkSize)
+      {
+        if (!ChunkFns.empty())
+          closeChunk();
+
+        // Allocate the shared state and run the chunks in program order.
+        enterFunction(MainFn, nullptr);
+        if (DBuilder)
+          Builder.SetCurrentDebugLocation(DILocation::get(M->getContext(), 1, 1, DSP));
+        ArrayType *StateTy = ArrayType::get(Int32Ty, StateSlots.size());
+        Value *State = Builder.CreateAlloca(StateTy, nullptr, "state");
+        Value *StatePtr = Builder.CreateConstInBoundsGEP2_32(StateTy, State, 0, 0);
+        if (CalcReadFn)
+          emitInputInit(Builder);
+        emitWritten();
+        for (Function *Chunk : ChunkFns)
+          Builder.CreateCall(ChunkFty, Chunk, {StatePtr});
+      }
+
+      // Create a return instruction at the end of the main function.
+      Builder.CreateRet(Int32Zero);
+
+      if (DBuilder)
+        DBuilder->finalize();
+    }
+
+    // Visit function for the GSM node in the AST.
+    void visit(Goal &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Goal);
+      // Iterate over the children of the GSM node and visit each child.
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      {
+        emitStatement(*I);
+      }
+    };
+
+    void visit(Assignment &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Assignment);
+      // Like Sema, check the destination before the value.
+      bool Declared = checkDeclared(Node.getLeft()->getVal());
+
+      // Visit the right-hand side of the assignment and get its value.
+      emitLocation(&Node);
+      traverse(*Node.getRight());
+      Value *val = toInt(V);
+      emitLocation(&Node);
+
+      // Assign the value to the variable being assigned.
+      emitAssignment(Node.getLeft()->getVal(), val, Declared);
+    };
+
+    void visit(Read &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Read);
+      if (!checkRead(Node.getLocation()))
+        return;
+      emitLocation(&Node);
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        emitRead(*I);
+    };
+
+    void visit(Factor &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Factor);
+      if ((V = lookupValue(&Node)))
+        return;
+      emitLocation(&Node);
+      if (Node.getKind() == Factor::Ident)
+      {
+        // If the factor is an identifier, load its value from memory.
+        V = emitLoad(Node.getVal());
+        rememberValue(&Node, V);
+      }
+      else
+      {
+        // If the factor is a literal, create a constant of its value.
+        V = ConstantInt::get(Int32Ty, Node.getNumber(), true);
+      }
+    };
+
+    void visit(BinaryOp &Node)
+    {
+      lowerExpr(ExprStep<Expr *>{StepKind::Eval, Expr::EK_BinaryOp, &Node});
+    };
+
+    void visit(Declaration &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Declaration);
 
+      // Iterate over the variables declared in the declaration statement;
+      // those without an initializer start at 0.
+      auto e_I = Node.begin_values(), e_E = Node.end_values();
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      {
+        Value *val = ConstantInt::get(Int32Ty, 0, true);
+
+        // The initializer runs before the variable is declared, so it reads
+        // the variable of an outer scope that this one hides.
+        if (e_I != e_E)
+        {
+          traverse(**e_I++);
+          val = toInt(V);
         }
 
-        // (*(bes_I_tmp -> getAssigns().begin())) -> accept(*this);
-        for (auto F = (*bes_I)->begin(), G = (*bes_I)->end(); G != F; ++F){
-          (*F)->accept(*this);
+        emitLocation(&Node);
+        emitDeclaration(*I, val);
+      }
+    };
+
+    void visit(BE &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_BE);
+      bool DeclaresVars = llvm::any_of(Node, [](Expr *Stmt) { return isa<Declaration>(Stmt); });
+      lowerBlock(Node.getLocation(), DeclaresVars, [&] {
+        for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        {
+          if (*I)
+            traverse(**I);
         }
-        Builder.CreateBr(afterIfConditionBB);
-        count_exprs--;
-        bes_I++;
+      });
+    };
+
+    void visit(::Loop &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Loop);
+      lowerLoop(Node.getLocation(), Node.getExpr(), [&] { traverse(*Node.getBE()); });
+    };
+
+    void visit(Condition &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Condition);
+      llvm::ArrayRef<BE *> bes = Node.getAllBes();
+      lowerCondition(Node.getLocation(), Node.getAllExpresions(), bes.size(),
+                     [&](unsigned I) { traverse(*bes[I]); });
+    };
+
+    void visit(FunctionDef &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_FunctionDef);
+      lowerFunction(Node.getName(), Node.getParams(), Node.isMemo(), Node.getLocation(),
+                    Node.getBody()->getLocation(), [&] {
+                      for (Expr *Stmt : *Node.getBody())
+                        traverse(*Stmt);
+                    });
+    };
+
+    void visit(Call &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Call);
+      SmallVector<Value *, 4> Args;
+      for (Expr *Arg : Node.getArgs())
+      {
+        traverse(*Arg);
+        Args.push_back(toInt(V));
       }
-      Builder.SetInsertPoint(afterIfConditionBB);
+      emitLocation(&Node);
+      V = emitCall(Node.getName(), Args);
+    };
+
+    void visit(Return &Node)
+    {
+      VisitScope Scope(*this, Expr::EK_Return);
+      traverse(*Node.getValue());
+      emitReturnStatement(Node.getLocation(), toInt(V));
     };
   };
 }; // namespace
 
-void CodeGen::compile(AST *Tree)
+// Prints the optimization remarks selected by -Rpass, -Rpass-missed and
+// -Rpass-analysis at their GSM source location, together with the basic block
+// (loopc.body, if.condition, ...) and the function they refer to.
+class RemarkHandler : public DiagnosticHandler
+{
+  const SourceMgr &SrcMgr;
+  Optional<Regex> Passed, Missed, Analysis;
+
+  // The driver rejects invalid patterns before compiling anything.
+  static Optional<Regex> compile(const std::string &Pattern)
+  {
+    if (Pattern.empty())
+      return None;
+    Regex Filter(Pattern);
+    assert(Filter.isValid() && "invalid remark filter");
+    return Filter;
+  }
+
+  static bool matches(const Optional<Regex> &Filter, StringRef PassName)
+  {
+    return Filter && Filter->match(PassName);
+  }
+
+  // Maps a line and column of a debug location back into the source buffer.
+  SMLoc findLoc(unsigned Line, unsigned Column) const
+  {
+    StringRef Buffer = SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBuffer();
+    size_t Pos = 0;
+    for (unsigned L = 1; L < Line && Pos != StringRef::npos; ++L)
+    {
+      Pos = Buffer.find('\n', Pos);
+      if (Pos != StringRef::npos)
+        ++Pos;
+    }
+    if (Pos == StringRef::npos || Column == 0 || Pos + Column - 1 >= Buffer.size())
+      return SMLoc();
+    return SMLoc::getFromPointer(Buffer.data() + Pos + Column - 1);
+  }
+
+public:
+  RemarkHandler(const SourceMgr &SrcMgr, const CodeGenOptions &Opts)
+      : SrcMgr(SrcMgr), Passed(compile(Opts.RemarksPassed)), Missed(compile(Opts.RemarksMissed)),
+        Analysis(compile(Opts.RemarksAnalysis)) {}
+
+  bool isPassedOptRemarkEnabled(StringRef PassName) const override { return matches(Passed, PassName); }
+  bool isMissedOptRemarkEnabled(StringRef PassName) const override { return matches(Missed, PassName); }
+  bool isAnalysisRemarkEnabled(StringRef PassName) const override { return matches(Analysis, PassName); }
+  bool isAnyRemarkEnabled() const override { return Passed || Missed || Analysis; }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override
+  {
+    auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+    if (!Remark)
+      return false; // everything else is printed by the default handler
+    if (!Remark->isEnabled())
+      return true;
+
+    const char *Flag = Remark->isPassed()   ? "-Rpass"
+                       : Remark->isMissed() ? "-Rpass-missed"
+                                            : "-Rpass-analysis";
+    std::string Msg;
+    raw_string_ostream OS(Msg);
+    OS << Remark->getMsg() << " [" << Flag << "=" << Remark->getPassName() << "]";
+
+    const BasicBlock *BB = nullptr;
+    if (auto *IRRemark = dyn_cast<DiagnosticInfoIROptimization>(Remark))
+    {
+      const Value *Region = IRRemark->getCodeRegion();
+      BB = dyn_cast_or_null<BasicBlock>(Region);
+      if (auto *I = dyn_cast_or_null<Instruction>(Region))
+        BB = I->getParent();
+    }
+    if (BB && BB->hasName())
+      OS << " in " << BB->getName() << " of " << Remark->getFunction().getName();
+    else
+      OS << " in " << Remark->getFunction().getName();
+
+    SMLoc Loc;
+    if (Remark->isLocationAvailable())
+      Loc = findLoc(Remark->getLocation().getLine(), Remark->getLocation().getColumn());
+    SrcMgr.PrintMessage(errs(), Loc, SourceMgr::DK_Remark, OS.str());
+    return true;
+  }
+};
+
+// Installs the remark handler and, with -remarks-file, the YAML remark
+// streamer on the context of the module. The returned file must stay open
+// until the module has been optimized.
+static bool setupRemarks(LLVMContext &Ctx, const SourceMgr &SrcMgr, const CodeGenOptions &Opts,
+                         std::unique_ptr<ToolOutputFile> &RemarksFile)
+{
+  Ctx.setDiagnosticHandler(std::make_unique<RemarkHandler>(SrcMgr, Opts));
+  if (Opts.RemarksFile.empty())
+    return false;
+  Expected<std::unique_ptr<ToolOutputFile>> File =
+      setupLLVMOptimizationRemarks(Ctx, Opts.RemarksFile, "", "yaml", false);
+  if (!File)
+  {
+    errs() << "Cannot write remarks to " << Opts.RemarksFile << ": " << toString(File.takeError()) << "\n";
+    return true;
+  }
+  RemarksFile = std::move(*File);
+  RemarksFile->keep();
+  return false;
+}
+
+// Creates a target machine for the host. Every thread of the parallel back
+// end needs its own.
+static std::unique_ptr<TargetMachine> createTargetMachine(unsigned OptLevel)
+{
+  std::string Triple = sys::getDefaultTargetTriple();
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(Triple, Error);
+  if (!T)
+  {
+    errs() << Error << "\n";
+    return nullptr;
+  }
+  CodeGenOpt::Level Level = OptLevel == 0   ? CodeGenOpt::None
+                            : OptLevel == 1 ? CodeGenOpt::Less
+                            : OptLevel == 2 ? CodeGenOpt::Default
+                                            : CodeGenOpt::Aggressive;
+  return std::unique_ptr<TargetMachine>(T->createTargetMachine(
+      Triple, "generic", "", TargetOptions(), Reloc::PIC_, None, Level));
+}
+
+// Target machine of the serial back end for an optimization level. It is
+// created once and reused by every later compile in the process. The cache is
+// never freed, since it would be destroyed after llvm_shutdown.
+static TargetMachine *getTargetMachine(unsigned OptLevel)
+{
+  static TargetMachine *Cache[4];
+  TargetMachine *&TM = Cache[std::min(OptLevel, 3u)];
+  if (!TM)
+    TM = createTargetMachine(OptLevel).release();
+  return TM;
+}
+
+void CodeGen::warmUp()
+{
+  for (unsigned OptLevel = 0; OptLevel <= 3; ++OptLevel)
+    getTargetMachine(OptLevel);
+}
+
+// Variants of the program that -multiversion adds to the baseline, best
+// first, with the level gsm_cpu_level returns for CPUs that can run them.
+static const struct
+{
+  const char *CPU;
+  const char *Suffix;
+  int Level;
+} Variants[] = {{"x86-64-v4", "avx512", 2}, {"x86-64-v3", "avx2", 1}};
+
+// Moves the body of main into gsm.body and clones it, with the chunks it
+// calls, once per variant; the clones are compiled for the CPU of their
+// variant. main then asks the runtime which variant the CPU can run and calls
+// it, or the original functions on older CPUs.
+static void multiversion(Module &M)
+{
+  LLVMContext &Ctx = M.getContext();
+  Function *Main = M.getFunction("main");
+  Function *Body = Function::Create(Main->getFunctionType(), GlobalValue::InternalLinkage, "gsm.body", M);
+  Body->getBasicBlockList().splice(Body->end(), Main->getBasicBlockList());
+  for (unsigned I = 0, E = Main->arg_size(); I != E; ++I)
+    Main->getArg(I)->replaceAllUsesWith(Body->getArg(I));
+  Body->setSubprogram(Main->getSubprogram());
+  Main->setSubprogram(nullptr);
+
+  SmallVector<Function *, 16> Fns;
+  for (Function &F : M)
+    if (!F.isDeclaration() && &F != Main)
+      Fns.push_back(&F);
+
+  IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Main));
+  FunctionCallee LevelFn = M.getOrInsertFunction("gsm_cpu_level", Builder.getInt32Ty());
+  BasicBlock *BaselineBB = BasicBlock::Create(Ctx, "baseline", Main);
+  SwitchInst *Switch = Builder.CreateSwitch(Builder.CreateCall(LevelFn), BaselineBB, array_lengthof(Variants));
+  auto CallBody = [&](BasicBlock *BB, Function *Fn)
+  {
+    Builder.SetInsertPoint(BB);
+    Builder.CreateRet(Builder.CreateCall(Fn, {Main->getArg(0), Main->getArg(1)}));
+  };
+  CallBody(BaselineBB, Body);
+
+  for (auto &V : Variants)
+  {
+    // Clones call the clones of the same variant.
+    ValueToValueMapTy VMap;
+    for (Function *F : Fns)
+    {
+      Function *Clone = Function::Create(F->getFunctionType(), F->getLinkage(), F->getName() + "." + V.Suffix, M);
+      for (unsigned I = 0, E = F->arg_size(); I != E; ++I)
+        VMap[F->getArg(I)] = Clone->getArg(I);
+      VMap[F] = Clone;
+    }
+    for (Function *F : Fns)
+    {
+      auto *Clone = cast<Function>(VMap[F]);
+      SmallVector<ReturnInst *, 4> Returns;
+      CloneFunctionInto(Clone, F, VMap, CloneFunctionChangeType::LocalChangesOnly, Returns);
+      Clone->addFnAttr("target-cpu", V.CPU);
+    }
+    BasicBlock *BB = BasicBlock::Create(Ctx, V.Suffix, Main);
+    Switch->addCase(Builder.getInt32(V.Level), BB);
+    CallBody(BB, cast<Function>(VMap[Body]));
+  }
+}
+
+// Runs the default LLVM pipeline for the optimization level. From -O2 on, it
+// also runs the loop-nest passes that LLVM leaves off by default, interchange
+// and unroll-and-jam, at the points where the LLVM pipeline would add them;
+// LICM is part of the default pipeline.
+static void optimize(Module &M, TargetMachine &TM, unsigned OptLevel)
+{
+  if (OptLevel == 0)
+    return;
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB(&TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  if (OptLevel >= 2)
+  {
+    PB.registerLateLoopOptimizationsEPCallback(
+        [](LoopPassManager &LPM, OptimizationLevel) { LPM.addPass(LoopInterchangePass()); });
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &FPM, OptimizationLevel Level)
+        { FPM.addPass(createFunctionToLoopPassAdaptor(LoopUnrollAndJamPass(Level.getSpeedupLevel()))); });
+  }
+
+  OptimizationLevel Level = OptLevel == 1   ? OptimizationLevel::O1
+                            : OptLevel == 2 ? OptimizationLevel::O2
+                                            : OptimizationLevel::O3;
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+  MPM.run(M, MAM);
+}
+
+static bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &OS)
+{
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile))
+  {
+    errs() << "Cannot emit object files for " << M.getTargetTriple() << "\n";
+    return true;
+  }
+  PM.run(M);
+  return false;
+}
+
+// Splits the module into Parts pieces, then optimizes and compiles them on a
+// thread pool. Each piece is reloaded from bitcode into its own LLVMContext,
+// since a context must not be shared between threads. The objects are then
+// combined into one relocatable object with `ld -r`.
+static bool emitObjectParallel(Module &M, unsigned Parts, const CodeGenOptions &Opts,
+                               SmallVectorImpl<char> &Object)
+{
+  std::vector<SmallString<0>> Bitcode;
+  SplitModule(
+      M, Parts,
+      [&](std::unique_ptr<Module> MPart)
+      {
+        Bitcode.emplace_back();
+        raw_svector_ostream OS(Bitcode.back());
+        WriteBitcodeToFile(*MPart, OS);
+      },
+      /*PreserveLocals=*/false);
+
+  std::vector<SmallString<0>> Objects(Bitcode.size());
+  std::atomic<bool> HasError(false);
+  ThreadPool Pool(hardware_concurrency(Parts));
+  for (size_t I = 0, E = Bitcode.size(); I != E; ++I)
+    Pool.async([&, I]
+               {
+                 LLVMContext Ctx;
+                 Expected<std::unique_ptr<Module>> MPart =
+                     parseBitcodeFile(MemoryBufferRef(Bitcode[I], "gsm.part"), Ctx);
+                 std::unique_ptr<TargetMachine> TM = createTargetMachine(Opts.OptLevel);
+                 if (!MPart || !TM)
+                 {
+                   if (!MPart)
+                     consumeError(MPart.takeError());
+                   HasError = true;
+                   return;
+                 }
+                 optimize(**MPart, *TM, Opts.OptLevel);
+                 raw_svector_ostream OS(Objects[I]);
+                 if (emitObject(**MPart, *TM, OS))
+                   HasError = true;
+               });
+  Pool.wait();
+  if (HasError)
+    return true;
+
+  ErrorOr<std::string> Ld = sys::findProgramByName("ld");
+  if (!Ld)
+  {
+    errs() << "Cannot find ld to combine the parallel objects\n";
+    return true;
+  }
+
+  // Write the parts and the combined object to temporary files.
+  std::vector<std::unique_ptr<FileRemover>> Removers;
+  auto createTemp = [&](StringRef Prefix, SmallString<128> &Path)
+  {
+    int FD;
+    if (std::error_code EC = sys::fs::createTemporaryFile(Prefix, "o", FD, Path))
+    {
+      errs() << "Cannot create a temporary file: " << EC.message() << "\n";
+      return true;
+    }
+    Removers.push_back(std::make_unique<FileRemover>(Path));
+    sys::Process::SafelyCloseFileDescriptor(FD);
+    return false;
+  };
+
+  SmallVector<SmallString<128>, 8> PartPaths(Objects.size());
+  for (size_t I = 0, E = Objects.size(); I != E; ++I)
+  {
+    if (createTemp("gsm-part", PartPaths[I]))
+      return true;
+    std::error_code EC;
+    raw_fd_ostream OS(PartPaths[I], EC);
+    OS << Objects[I];
+  }
+  SmallString<128> LinkedPath;
+  if (createTemp("gsm", LinkedPath))
+    return true;
+
+  SmallVector<StringRef, 16> Args = {"ld", "-r", "-o", LinkedPath};
+  Args.append(PartPaths.begin(), PartPaths.end());
+  std::string ErrMsg;
+  if (sys::ExecuteAndWait(*Ld, Args, None, {}, 0, 0, &ErrMsg) != 0)
+  {
+    errs() << "ld -r failed " << ErrMsg << "\n";
+    return true;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Linked = MemoryBuffer::getFile(LinkedPath);
+  if (!Linked)
+    return true;
+  Object.append((*Linked)->getBufferStart(), (*Linked)->getBufferEnd());
+  return false;
+}
+
+// Optimizes the finished module and writes IR or an object file.
+bool CodeGen::emit(std::unique_ptr<Module> MPtr)
+{
+  CompileStats::Phase Phase(Opts.Stats, CompileStats::Backend);
+  std::unique_ptr<ToolOutputFile> RemarksFile;
+  if (Opts.wantsRemarks())
+  {
+    if (setupRemarks(MPtr->getContext(), SrcMgr, Opts, RemarksFile))
+      return true;
+  }
+  if (Opts.Multiversion)
+  {
+    if (Triple(sys::getDefaultTargetTriple()).getArch() == Triple::x86_64)
+      multiversion(*MPtr);
+    else
+      errs() << "-multiversion needs an x86-64 target, compiling one variant\n";
+  }
+  if (Opts.Run)
+    return run(std::move(MPtr));
+
+  Module &M = *MPtr;
+  std::error_code EC;
+  ToolOutputFile Out(Opts.OutputFile, EC, Opts.EmitObject ? sys::fs::OF_None : sys::fs::OF_Text);
+  if (EC)
+  {
+    errs() << "Cannot open " << Opts.OutputFile << ": " << EC.message() << "\n";
+    return true;
+  }
+
+  // Unoptimized IR is printed exactly as ToIRVisitor produced it.
+  if (!Opts.EmitObject && Opts.OptLevel == 0)
+  {
+    M.print(Out.os(), nullptr);
+    Out.keep();
+    return false;
+  }
+
+  TargetMachine *TM = getTargetMachine(Opts.OptLevel);
+  if (!TM)
+    return true;
+  M.setTargetTriple(TM->getTargetTriple().str());
+  M.setDataLayout(TM->createDataLayout());
+
+  // main and every chunk are separate functions that can be compiled apart.
+  // Remarks are reported from one context, so they keep the module whole.
+  unsigned Parts = 1;
+  if (Opts.EmitObject && Opts.ChunkSize && !Opts.wantsRemarks())
+  {
+    unsigned Defined = 0;
+    for (Function &F : M)
+      Defined += !F.isDeclaration();
+    Parts = std::min(hardware_concurrency(Opts.Threads).compute_thread_count(), Defined);
+  }
+
+  SmallString<0> Object;
+  if (Parts > 1)
+  {
+    if (emitObjectParallel(M, Parts, Opts, Object))
+      return true;
+  }
+  else
+  {
+    optimize(M, *TM, Opts.OptLevel);
+    if (!Opts.EmitObject)
+    {
+      M.print(Out.os(), nullptr);
+      Out.keep();
+      return false;
+    }
+    raw_svector_ostream OS(Object);
+    if (emitObject(M, *TM, OS))
+      return true;
+  }
+  Out.os() << Object;
+  Out.keep();
+  return false;
+}
+
+// JIT-compiles the module and runs main with Opts.RunArgs. The program runs in
+// a child process, since the runtime exits on bad input and the program may
+// not terminate at all; its output goes to the same stdout and stderr.
+bool CodeGen::run(std::unique_ptr<Module> M)
+{
+  TargetMachine *TM = getTargetMachine(Opts.OptLevel);
+  if (!TM)
+    return true;
+  M->setTargetTriple(TM->getTargetTriple().str());
+  M->setDataLayout(TM->createDataLayout());
+  optimize(*M, *TM, Opts.OptLevel);
+
+  sys::DynamicLibrary::AddSymbol("gsm_write", reinterpret_cast<void *>(&gsm_write));
+  sys::DynamicLibrary::AddSymbol("gsm_write_all", reinterpret_cast<void *>(&gsm_write_all));
+  sys::DynamicLibrary::AddSymbol("gsm_init", reinterpret_cast<void *>(&gsm_init));
+  sys::DynamicLibrary::AddSymbol("gsm_read", reinterpret_cast<void *>(&gsm_read));
+  sys::DynamicLibrary::AddSymbol("gsm_cpu_level", reinterpret_cast<void *>(&gsm_cpu_level));
+  sys::DynamicLibrary::AddSymbol("gsm_memo_lookup", reinterpret_cast<void *>(&gsm_memo_lookup));
+  sys::DynamicLibrary::AddSymbol("gsm_memo_store", reinterpret_cast<void *>(&gsm_memo_store));
+
+  std::string Error;
+  std::unique_ptr<ExecutionEngine> EE(EngineBuilder(std::move(M))
+                                          .setEngineKind(EngineKind::JIT)
+                                          .setErrorStr(&Error)
+                                          .setOptLevel(TM->getOptLevel())
+                                          .create());
+  if (!EE)
+  {
+    errs() << "Cannot create the JIT: " << Error << "\n";
+    return true;
+  }
+  EE->finalizeObject();
+  auto Main = reinterpret_cast<int (*)(int, char **)>(EE->getFunctionAddress("main"));
+
+  outs().flush();
+  fflush(stdout);
+  pid_t Pid = fork();
+  if (Pid == 0)
+  {
+    // A trap or fault of the program is its own failure: it must not reach
+    // the crash handlers LLVM installed for gsm, which print a stack dump of
+    // the compiler and ask for a bug report.
+    for (int Sig : {SIGILL, SIGTRAP, SIGABRT, SIGFPE, SIGBUS, SIGSEGV})
+      signal(Sig, SIG_DFL);
+    std::vector<char *> Argv = {const_cast<char *>("gsm-program")};
+    for (std::string &Arg : Opts.RunArgs)
+      Argv.push_back(&Arg[0]);
+    Argv.push_back(nullptr);
+    int Ret = Main(Argv.size() - 1, Argv.data());
+    fflush(stdout);
+    _exit(Ret);
+  }
+  if (Pid < 0)
+  {
+    errs() << "Cannot start the program\n";
+    return true;
+  }
+
+  int Status;
+  while (waitpid(Pid, &Status, 0) < 0)
+    if (errno != EINTR)
+      return true;
+  if (WIFSIGNALED(Status))
+  {
+    errs() << "The program was terminated by signal " << WTERMSIG(Status) << " ("
+           << strsignal(WTERMSIG(Status)) << ")\n";
+    ExitCode = 128 + WTERMSIG(Status);
+  }
+  else
+    ExitCode = WEXITSTATUS(Status);
+  return false;
+}
+
+// A module that is being filled one top-level statement at a time.
+struct CodeGen::StreamState
+{
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M;
+  ToIRVisitor ToIR;
+
+  StreamState(const SourceMgr &SrcMgr, const CodeGenOptions &Opts)
+      : M(std::make_unique<Module>("calc.expr", Ctx)),
+        ToIR(M.get(), SrcMgr, Opts) {}
+};
+
+CodeGen::CodeGen(const SourceMgr &SrcMgr, const CodeGenOptions &Opts)
+    : SrcMgr(SrcMgr), Opts(Opts) {}
+
+CodeGen::~CodeGen() = default;
+
+void CodeGen::startStream()
+{
+  CompileStats::Phase Phase(Opts.Stats, CompileStats::IRGen);
+  Stream = std::make_unique<StreamState>(SrcMgr, Opts);
+  Stream->ToIR.begin();
+}
+
+bool CodeGen::compileStatement(Expr *Stmt)
+{
+  // The visitor only keeps names and IR values, so the statement may be
+  // freed as soon as this returns.
+  CompileStats::Phase Phase(Opts.Stats, CompileStats::IRGen);
+  Stream->ToIR.emitStatement(Stmt);
+  return Stream->ToIR.hasError();
+}
+
+bool CodeGen::finishStream()
+{
+  {
+    CompileStats::Phase Phase(Opts.Stats, CompileStats::IRGen);
+    Stream->ToIR.finish();
+  }
+  bool HasError = emit(std::move(Stream->M));
+  Stream.reset();
+  return HasError;
+}
+
+bool CodeGen::compile(AST *Tree, ArrayRef<int32_t> Written)
 {
   // Create an LLVM context and a module.
+  CompileStats::Phase IRGenPhase(Opts.Stats, CompileStats::IRGen);
   LLVMContext Ctx;
-  Module *M = new Module("calc.expr", Ctx);
+  std::unique_ptr<Module> M = std::make_unique<Module>("calc.expr", Ctx);
+
+  // The ranges decide which checks are needed. LLVM derives most of the
+  // flags they give on its own, so they are not worth the walk otherwise.
+  RangeAnalysis Ranges;
+  if (Opts.CheckedArith)
+    Ranges.run(Tree);
 
   // Create an instance of the ToIRVisitor and run it on the AST to generate LLVM IR.
-  ToIRVisitor ToIR(M);
-  ToIR.run(Tree);
+  ToIRVisitor ToIR(M.get(), SrcMgr, Opts);
+  ToIR.run(Tree, Written, Opts.CheckedArith ? &Ranges : nullptr);
+  IRGenPhase.stop();
+  if (ToIR.hasError())
+  {
+    llvm::errs() << "Semantic errors occurred\n";
+    return true;
+  }
 
-  // Print the generated module to the standard output.
-  M->print(outs(), nullptr);
+  // Optimize the module and write it out.
+  return emit(std::move(M));
+}
+
+bool CodeGen::compile(const FlatAST &Flat)
+{
+  CompileStats::Phase IRGenPhase(Opts.Stats, CompileStats::IRGen);
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = std::make_unique<Module>("calc.expr", Ctx);
+  ToIRVisitor ToIR(M.get(), SrcMgr, Opts);
+  ToIR.run(Flat);
+  IRGenPhase.stop();
+  if (ToIR.hasError())
+  {
+    llvm::errs() << "Semantic errors occurred\n";
+    return true;
+  }
+  return emit(std::move(M));
 }
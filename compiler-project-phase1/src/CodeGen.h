@@ -2,11 +2,85 @@
 #define CODEGEN_H
 
 #include "AST.h"
+#include "Stats.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/SourceMgr.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm
+{
+ class Module;
+}
+
+class FlatAST;
+
+// Options that control how the module is lowered and what is written out.
+struct CodeGenOptions
+{
+ bool EmitDebugInfo = false;      // emit DWARF compile unit, subprograms and locations
+ unsigned OptLevel = 0;           // default LLVM pipeline to run, 0 runs none
+ unsigned ChunkSize = 0;          // top-level statements per outlined chunk, 0 keeps them in main
+ unsigned Threads = 0;            // threads that optimize and compile chunks, 0 uses every core
+ bool EmitObject = false;         // write a relocatable object instead of textual IR
+ bool Multiversion = false;       // clone the program for x86-64-v3 and -v4 CPUs, picked at startup
+ std::string OutputFile = "-";
+ bool Run = false;                // JIT-compile the module and run main instead of writing it
+ std::vector<std::string> RunArgs; // arguments passed to the program when it runs
+ CompileStats *Stats = nullptr;   // counters to update, null unless -compile-stats is on
+ std::string RemarksPassed;       // regexes of the passes whose remarks are printed
+ std::string RemarksMissed;
+ std::string RemarksAnalysis;
+ std::string RemarksFile;         // YAML file that receives every remark
+ bool CheckSemantics = false;     // run the checks of Sema while lowering, instead of before
+ bool ReuseValues = false;        // reuse the value of a shared expression node within a basic block
+ bool CheckedArith = false;       // trap on divisions by zero and overflows the ranges do not rule out
+
+ bool wantsRemarks() const
+ {
+  return !RemarksPassed.empty() || !RemarksMissed.empty() || !RemarksAnalysis.empty() ||
+         !RemarksFile.empty();
+ }
+};
 
 class CodeGen
 {
+ const llvm::SourceMgr &SrcMgr; // maps node locations back to line and column
+ CodeGenOptions Opts;
+
+ struct StreamState;
+ std::unique_ptr<StreamState> Stream; // module being built by compileStatement
+
+ int ExitCode = 0; // exit code of the program, with Run
+
+ bool emit(std::unique_ptr<llvm::Module> M);
+ bool run(std::unique_ptr<llvm::Module> M);
+
 public:
- void compile(AST *Tree);
+ CodeGen(const llvm::SourceMgr &SrcMgr, const CodeGenOptions &Opts);
+ ~CodeGen();
+
+ // Lowers the tree and writes the result; returns true on error. Written are
+ // values the program already wrote at compile time (see PartialEval.h),
+ // which main writes before it runs Tree.
+ bool compile(AST *Tree, llvm::ArrayRef<int32_t> Written = llvm::None);
+
+ // Lowers a FlatAST the same way, by index, without the pointer-based tree.
+ bool compile(const FlatAST &Flat);
+
+ // Statement-at-a-time compilation: lower each top-level statement as soon as
+ // it is checked, then write the module once the input is exhausted.
+ // compileStatement returns true if the statement has semantic errors.
+ void startStream();
+ bool compileStatement(Expr *Stmt);
+ bool finishStream();
+
+ // Exit code of the program after compile or finishStream with Run, else 0.
+ int getExitCode() const { return ExitCode; }
 
+ // Creates the target machines up front, so that later compiles (or the
+ // workers of the compile server) reuse them.
+ static void warmUp();
 };
-#endif
\ No newline at end of file
+#endif
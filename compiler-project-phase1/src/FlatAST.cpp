@@ -0,0 +1,244 @@
+#include "FlatAST.h"
+
+namespace
+{
+  // Copies the pointer-based AST into a FlatAST. Children are appended before
+  // their parents, which yields the post-order layout of the expression array.
+  class FlatASTBuilder : public ASTVisitor
+  {
+    FlatAST &Flat;
+    FlatAST::Index Last; // index produced by the most recently visited node
+
+  public:
+    FlatASTBuilder(FlatAST &Flat) : Flat(Flat), Last(0) {}
+
+    // Converts Stmt and returns its statement node.
+    FlatAST::StmtNode convertStmt(Expr *Stmt)
+    {
+      FlatAST::Index FirstExpr = Flat.Exprs.size();
+      Stmt->accept(*this);
+      return {Stmt->getExprKind(), Last, FirstExpr, static_cast<FlatAST::Index>(Flat.Exprs.size()),
+              Stmt->getLocation()};
+    }
+
+    virtual void visit(Goal &Node) override
+    {
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Flat.Stmts.push_back(convertStmt(*I));
+    };
+
+    virtual void visit(Factor &Node) override
+    {
+      FlatAST::ExprNode N;
+      N.Op = 0;
+      N.RHS = 0;
+      if (Node.getKind() == Factor::Ident)
+      {
+        N.K = FlatAST::ExprNode::Ident;
+        N.LHS = Flat.getIdentId(Node.getVal());
+      }
+      else
+      {
+        N.K = FlatAST::ExprNode::Number;
+        N.LHS = Flat.Literals.size();
+        Flat.Literals.push_back(Node.getNumber());
+      }
+      Last = Flat.Exprs.size();
+      Flat.Exprs.push_back(N);
+    };
+
+    // The operands are converted from an explicit stack rather than by
+    // recursion, in the same post-order, so deep nesting cannot exhaust the
+    // stack. Operands holds the indices of the converted operands.
+    virtual void visit(BinaryOp &Node) override
+    {
+      llvm::SmallVector<std::pair<Expr *, bool>, 32> Stack; // node, operands done
+      llvm::SmallVector<FlatAST::Index, 32> Operands;
+      Stack.push_back({&Node, false});
+      while (!Stack.empty())
+      {
+        std::pair<Expr *, bool> Item = Stack.pop_back_val();
+        auto *Op = llvm::dyn_cast<BinaryOp>(Item.first);
+        if (!Op)
+          Item.first->accept(*this);
+        else if (!Item.second)
+        {
+          Stack.push_back({Op, true});
+          Stack.push_back({Op->getRight(), false});
+          Stack.push_back({Op->getLeft(), false});
+          continue;
+        }
+        else
+        {
+          FlatAST::Index Right = Operands.pop_back_val();
+          FlatAST::Index Left = Operands.pop_back_val();
+          Last = Flat.Exprs.size();
+          Flat.Exprs.push_back({FlatAST::ExprNode::Binary,
+                                static_cast<uint8_t>(Op->getOperator()), Left, Right});
+        }
+        Operands.push_back(Last);
+      }
+    };
+
+    virtual void visit(Assignment &Node) override
+    {
+      Node.getRight()->accept(*this);
+      FlatAST::Index Value = Last;
+      Last = Flat.Assigns.size();
+      Flat.Assigns.push_back({Flat.getIdentId(Node.getLeft()->getVal()), Value});
+    };
+
+    virtual void visit(Declaration &Node) override
+    {
+      // Convert the initializers first, so both lists are contiguous in Refs.
+      llvm::SmallVector<FlatAST::Index, 8> Inits;
+      for (auto I = Node.begin_values(), E = Node.end_values(); I != E; ++I)
+      {
+        (*I)->accept(*this);
+        Inits.push_back(Last);
+      }
+
+      FlatAST::DeclNode D;
+      D.FirstVar = Flat.Refs.size();
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Flat.Refs.push_back(Flat.getIdentId(*I));
+      D.NumVars = Flat.Refs.size() - D.FirstVar;
+      D.FirstInit = Flat.Refs.size();
+      D.NumInits = Inits.size();
+      Flat.Refs.insert(Flat.Refs.end(), Inits.begin(), Inits.end());
+
+      Last = Flat.Decls.size();
+      Flat.Decls.push_back(D);
+    };
+
+    virtual void visit(Read &Node) override
+    {
+      FlatAST::ReadNode R;
+      R.FirstVar = Flat.Refs.size();
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Flat.Refs.push_back(Flat.getIdentId(*I));
+      R.NumVars = Flat.Refs.size() - R.FirstVar;
+      Last = Flat.Reads.size();
+      Flat.Reads.push_back(R);
+    };
+
+    // The statements of nested blocks are appended while the statements of
+    // this one are converted, so these are collected and appended last.
+    virtual void visit(BE &Node) override
+    {
+      llvm::SmallVector<FlatAST::StmtNode, 8> Stmts;
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+        Stmts.push_back(convertStmt(*I));
+      FlatAST::BENode B;
+      B.FirstStmt = Flat.BlockStmts.size();
+      B.NumStmts = Stmts.size();
+      Flat.BlockStmts.insert(Flat.BlockStmts.end(), Stmts.begin(), Stmts.end());
+      Last = Flat.BEs.size();
+      Flat.BEs.push_back(B);
+    };
+
+    virtual void visit(Loop &Node) override
+    {
+      Node.getExpr()->accept(*this);
+      FlatAST::Index Cond = Last;
+      Node.getBE()->accept(*this);
+      FlatAST::Index Body = Last;
+      Last = Flat.Loops.size();
+      Flat.Loops.push_back({Cond, Body});
+    };
+
+    virtual void visit(Condition &Node) override
+    {
+      llvm::SmallVector<FlatAST::Index, 8> Guards;
+      for (Expr *Guard : Node.getAllExpresions())
+      {
+        Guard->accept(*this);
+        Guards.push_back(Last);
+      }
+
+      llvm::SmallVector<FlatAST::Index, 8> Bodies;
+      for (BE *Body : Node.getAllBes())
+      {
+        Body->accept(*this);
+        Bodies.push_back(Last);
+      }
+
+      FlatAST::CondNode C;
+      C.FirstGuard = Flat.Refs.size();
+      C.NumGuards = Guards.size();
+      Flat.Refs.insert(Flat.Refs.end(), Guards.begin(), Guards.end());
+      C.FirstBody = Flat.Refs.size();
+      C.NumBodies = Bodies.size();
+      Flat.Refs.insert(Flat.Refs.end(), Bodies.begin(), Bodies.end());
+
+      Last = Flat.Conds.size();
+      Flat.Conds.push_back(C);
+    };
+
+    virtual void visit(FunctionDef &Node) override
+    {
+      Node.getBody()->accept(*this);
+      FlatAST::FuncNode F;
+      F.Name = Flat.getIdentId(Node.getName());
+      F.FirstParam = Flat.Refs.size();
+      for (llvm::StringRef Param : Node.getParams())
+        Flat.Refs.push_back(Flat.getIdentId(Param));
+      F.NumParams = Flat.Refs.size() - F.FirstParam;
+      F.Body = Last;
+      F.Memo = Node.isMemo();
+      Last = Flat.Funcs.size();
+      Flat.Funcs.push_back(F);
+    };
+
+    virtual void visit(Call &Node) override
+    {
+      llvm::SmallVector<FlatAST::Index, 8> Args;
+      for (Expr *Arg : Node.getArgs())
+      {
+        Arg->accept(*this);
+        Args.push_back(Last);
+      }
+      FlatAST::ExprNode N;
+      N.K = FlatAST::ExprNode::Call;
+      N.Op = 0;
+      N.LHS = Flat.getIdentId(Node.getName());
+      N.RHS = Flat.Refs.size();
+      Flat.Refs.push_back(Args.size());
+      Flat.Refs.insert(Flat.Refs.end(), Args.begin(), Args.end());
+      Last = Flat.Exprs.size();
+      Flat.Exprs.push_back(N);
+    };
+
+    // The statement refers to the value, which ends its range of Exprs.
+    virtual void visit(Return &Node) override
+    {
+      Node.getValue()->accept(*this);
+    };
+  };
+}
+
+FlatAST FlatAST::build(AST *Tree)
+{
+  FlatAST Flat;
+  FlatASTBuilder Builder(Flat);
+  Tree->accept(Builder);
+  return Flat;
+}
+
+void FlatAST::append(Expr *Stmt)
+{
+  FlatASTBuilder Builder(*this);
+  Stmts.push_back(Builder.convertStmt(Stmt));
+}
+
+template <typename T> static size_t bytesOf(const std::vector<T> &Vec)
+{
+  return Vec.size() * sizeof(T);
+}
+
+size_t FlatAST::getMemorySize() const
+{
+  return bytesOf(Stmts) + bytesOf(BlockStmts) + bytesOf(Exprs) + bytesOf(Assigns) + bytesOf(Decls) +
+         bytesOf(BEs) + bytesOf(Loops) + bytesOf(Conds) + bytesOf(Reads) + bytesOf(Funcs) + bytesOf(Refs) +
+         bytesOf(Literals) + bytesOf(Idents);
+}
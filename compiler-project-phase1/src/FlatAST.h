@@ -0,0 +1,145 @@
+#ifndef FLATAST_H
+#define FLATAST_H
+
+#include "AST.h"
+#include "llvm/ADT/StringMap.h"
+#include <cstdint>
+#include <vector>
+
+// FlatAST is a compact, index-based copy of the AST. Nodes live in one
+// contiguous array per category and refer to each other with 32-bit indices,
+// literals and identifiers are kept in side tables. Expressions are stored in
+// post-order, so the operands of a node always precede it and a linear scan
+// over an expression range visits children before their parents.
+class FlatAST
+{
+public:
+    using Index = uint32_t;
+
+    // An expression: an identifier, a number literal, a binary operation or
+    // a call
+    struct ExprNode
+    {
+        enum Kind : uint8_t
+        {
+            Ident,
+            Number,
+            Binary,
+            Call
+        };
+
+        Kind K;
+        uint8_t Op; // BinaryOp::Operator, only meaningful for Binary
+        Index LHS;  // identifier id, literal index, left operand or function id
+        Index RHS;  // right operand, or for a Call the number of arguments in
+                    // Refs, followed by the arguments
+    };
+
+    // `Var = Value;`
+    struct AssignNode
+    {
+        Index Var;
+        Index Value;
+    };
+
+    // `int Vars... = Inits...;`, both lists live in Refs
+    struct DeclNode
+    {
+        Index FirstVar, NumVars;
+        Index FirstInit, NumInits;
+    };
+
+    // `read Vars...;`, the variables live in Refs
+    struct ReadNode
+    {
+        Index FirstVar, NumVars;
+    };
+
+    // `begin ... end`, a contiguous range of BlockStmts
+    struct BENode
+    {
+        Index FirstStmt, NumStmts;
+    };
+
+    // `loopc Cond: Body`
+    struct LoopNode
+    {
+        Index Cond;
+        Index Body;
+    };
+
+    // if/elif/else: the guards and the bodies live in Refs
+    struct CondNode
+    {
+        Index FirstGuard, NumGuards;
+        Index FirstBody, NumBodies;
+    };
+
+    // `memo`? `def Name(Params...): Body`, the parameters live in Refs
+    struct FuncNode
+    {
+        Index Name;
+        Index FirstParam, NumParams;
+        Index Body;
+        bool Memo;
+    };
+
+    // A statement, together with the range of Exprs it owns; the Node of a
+    // return statement is its value in Exprs. Loc is where it starts, which
+    // error messages and debug information point at.
+    struct StmtNode
+    {
+        Expr::ExprKind Kind;
+        Index Node;
+        Index FirstExpr, EndExpr;
+        llvm::SMLoc Loc;
+    };
+
+    std::vector<StmtNode> Stmts;      // top-level statements
+    std::vector<StmtNode> BlockStmts; // statements of the BEs
+    std::vector<ExprNode> Exprs;
+    std::vector<AssignNode> Assigns;
+    std::vector<DeclNode> Decls;
+    std::vector<BENode> BEs;
+    std::vector<LoopNode> Loops;
+    std::vector<CondNode> Conds;
+    std::vector<ReadNode> Reads;
+    std::vector<FuncNode> Funcs;
+    std::vector<Index> Refs; // child lists of Decls, Conds, Reads, Funcs and calls
+
+    // Side tables
+    std::vector<int> Literals;         // decoded number literals
+    std::vector<llvm::StringRef> Idents; // identifier spelling by id
+
+    // Interns an identifier and returns its dense id.
+    Index getIdentId(llvm::StringRef Name)
+    {
+        auto Res = IdentIds.try_emplace(Name, Idents.size());
+        if (Res.second)
+            Idents.push_back(Name);
+        return Res.first->second;
+    }
+
+    // Bytes held by the node arrays and side tables, excluding the interner.
+    size_t getMemorySize() const;
+
+    // Number of nodes of every category.
+    size_t getNumNodes() const
+    {
+        return Stmts.size() + BlockStmts.size() + Exprs.size() + Assigns.size() + Decls.size() +
+               BEs.size() + Loops.size() + Conds.size() + Reads.size() + Funcs.size();
+    }
+
+    // Flattens a tree produced by the Parser.
+    static FlatAST build(AST *Tree);
+
+    // Appends a top-level statement produced by Parser::parseNext. The
+    // statement is copied, so its AST may be freed afterwards; identifiers
+    // still refer to the source buffer.
+    void append(Expr *Stmt);
+
+private:
+    llvm::StringMap<Index> IdentIds;
+};
+
+#endif
@@ -0,0 +1,359 @@
+// Fuzz target that hunts for programs whose compile time or memory grows
+// faster than their size. The input bytes are decoded into a program of the
+// grammar in grammar-gh.txt, which is lexed, parsed, checked and lowered in
+// process like gsm does it. A program whose cost per byte exceeds the limits
+// below is printed and the target aborts, so that libFuzzer keeps the input
+// and can shrink it with -minimize_crash=1. So does a program that passes
+// Sema but that CodeGen rejects.
+//
+// Built with clang, gsm-fuzzer is linked with libFuzzer. Other compilers get
+// the driver of LLVM's FuzzMutate, which runs the target on the files named
+// on the command line and on the files of the directories named there. Both
+// replay the corpus in ../fuzz with `gsm-fuzzer -runs=0 ../fuzz`, which is
+// how ctest runs it.
+
+#include "CodeGen.h"
+#include "Parser.h"
+#include "Sema.h"
+#include "llvm/FuzzMutate/FuzzerCLI.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Options come after -ignore_remaining_args=1 on the command line.
+static llvm::cl::opt<unsigned>
+    OptLevel("O",
+             llvm::cl::desc("Optimization level the programs are compiled at (0-3)"),
+             llvm::cl::Prefix,
+             llvm::cl::init(2));
+
+static llvm::cl::opt<unsigned>
+    MaxMicrosPerByte("max-us-per-byte",
+                     llvm::cl::desc("Flag programs that take more CPU time to compile, per byte"),
+                     llvm::cl::init(100));
+
+static llvm::cl::opt<unsigned>
+    MaxHeapPerByte("max-heap-per-byte",
+                   llvm::cl::desc("Flag programs whose AST and IR take more heap, per byte"),
+                   llvm::cl::init(4096));
+
+static llvm::cl::opt<unsigned>
+    MinBytes("min-bytes",
+             llvm::cl::desc("Measure smaller programs as if they had <n> bytes"),
+             llvm::cl::value_desc("n"),
+             llvm::cl::init(1024));
+
+static llvm::cl::opt<bool>
+    PrintProgram("print-program",
+                 llvm::cl::desc("Print every decoded program"),
+                 llvm::cl::init(false));
+
+namespace
+{
+    // Decodes fuzzer input into a program that parses and passes Sema. Every
+    // choice takes the next byte; once the input is used up, every choice is
+    // 0, which always picks an alternative that ends the program.
+    class ProgramWriter
+    {
+        static constexpr unsigned MaxExprDepth = 64;
+
+        const uint8_t *Data, *End;
+        std::string Out;
+        std::vector<std::string> Vars;   // visible variables, innermost last
+        std::vector<size_t> BlockStarts; // size of Vars when each open block began
+        unsigned NumNames = 0;
+        unsigned ExprDepth = 0;
+
+        unsigned choose(unsigned N) { return Data == End ? 0 : *Data++ % N; }
+
+        // Names are made of letters only and never spell a keyword.
+        std::string newName()
+        {
+            std::string Name = "v";
+            for (unsigned N = NumNames++; N; N /= 26)
+                Name += char('a' + N % 26);
+            return Name;
+        }
+
+        const std::string &pickVar() { return Vars[choose(Vars.size())]; }
+
+        // Up to four bytes, so that exponents and divisors can be large.
+        void writeNumber(bool NonZero)
+        {
+            uint32_t Val = 0;
+            for (unsigned I = choose(5); I; --I)
+                Val = Val << 8 | choose(256);
+            Val &= 0x7fffffff;
+            Out += std::to_string(NonZero && !Val ? 1 : Val);
+        }
+
+        // Sema rejects a literal 0 as a divisor, hence NonZero: in the text,
+        // the divisor is the leftmost factor of the expression after the '/'.
+        void writeExpr(bool NonZero = false)
+        {
+            unsigned Kind = ExprDepth < MaxExprDepth ? choose(4) : 0;
+            if (Kind == 0)
+            {
+                if (!Vars.empty() && choose(2))
+                    Out += pickVar();
+                else
+                    writeNumber(NonZero);
+                return;
+            }
+            ++ExprDepth;
+            if (Kind == 1)
+            {
+                // Now and then a whole run of parentheses, so that short
+                // inputs reach deep nesting.
+                unsigned Parens = choose(8) == 7 ? 1 + choose(255) : 1;
+                Out.append(Parens, '(');
+                writeExpr(NonZero);
+                Out.append(Parens, ')');
+            }
+            else
+            {
+                static const char *const Ops[] = {"+", "-", "*", "/", "%", "^", "==", "!=",
+                                                  ">=", "<=", ">", "<", "and", "or"};
+                unsigned Op = choose(llvm::array_lengthof(Ops));
+                writeExpr(NonZero);
+                Out += ' ';
+                Out += Ops[Op];
+                Out += ' ';
+                writeExpr(Op == 3 || Op == 4);
+            }
+            --ExprDepth;
+        }
+
+        void writeBlock()
+        {
+            Out += "begin\n";
+            if (BlockStarts.size() < BE::MaxDepth)
+            {
+                BlockStarts.push_back(Vars.size());
+                writeStatements();
+                Vars.resize(BlockStarts.back());
+                BlockStarts.pop_back();
+            }
+            Out += "end\n";
+        }
+
+        void writeDeclaration()
+        {
+            // A block may hide a variable of an enclosing scope.
+            size_t Start = BlockStarts.empty() ? 0 : BlockStarts.back();
+            unsigned NumVars = 1 + choose(3);
+            std::vector<std::string> Names;
+            for (unsigned I = 0; I < NumVars; ++I)
+            {
+                std::string Name = Start && choose(4) == 1 ? Vars[choose(Start)] : newName();
+                if (std::find(Vars.begin() + Start, Vars.end(), Name) != Vars.end())
+                    Name = newName();
+                Names.push_back(Name);
+            }
+            std::sort(Names.begin(), Names.end());
+            Names.erase(std::unique(Names.begin(), Names.end()), Names.end());
+            Out += "int ";
+            for (size_t I = 0; I < Names.size(); ++I)
+                Out += (I ? ", " : "") + Names[I];
+            // Each variable is declared right after its initializer. Now and
+            // then the initializers may read all of them, which Sema has to
+            // reject like CodeGen does.
+            size_t Before = Vars.size();
+            unsigned NumValues = choose(Names.size() + 1);
+            bool ReadAhead = NumValues && choose(8) == 7;
+            if (ReadAhead)
+                Vars.insert(Vars.end(), Names.begin(), Names.end());
+            if (NumValues)
+                Out += " = ";
+            for (unsigned I = 0; I < NumValues; ++I)
+            {
+                Out += I ? ", " : "";
+                writeExpr();
+                if (!ReadAhead)
+                    Vars.push_back(Names[I]);
+            }
+            Vars.resize(Before);
+            Vars.insert(Vars.end(), Names.begin(), Names.end());
+            Out += ";\n";
+        }
+
+        void writeStatement()
+        {
+            static const char *const AssignOps[] = {"=", "+=", "-=", "*=", "/=", "%="};
+            switch (Vars.empty() ? 0 : choose(5))
+            {
+            case 0:
+                writeDeclaration();
+                break;
+            case 1:
+            {
+                unsigned Op = choose(llvm::array_lengthof(AssignOps));
+                Out += pickVar() + " " + AssignOps[Op] + " ";
+                writeExpr(Op >= 4);
+                Out += ";\n";
+                break;
+            }
+            case 2:
+                Out += "if ";
+                writeExpr();
+                Out += ": ";
+                writeBlock();
+                while (choose(2))
+                {
+                    Out += "elif ";
+                    writeExpr();
+                    Out += ": ";
+                    writeBlock();
+                }
+                if (choose(2))
+                {
+                    Out += "else: ";
+                    writeBlock();
+                }
+                break;
+            case 3:
+                Out += "loopc ";
+                writeExpr();
+                Out += ": ";
+                writeBlock();
+                break;
+            case 4:
+                Out += "read " + pickVar();
+                while (choose(2))
+                    Out += ", " + pickVar();
+                Out += ";\n";
+                break;
+            }
+        }
+
+        void writeStatements()
+        {
+            while (choose(4))
+                writeStatement();
+        }
+
+    public:
+        ProgramWriter(const uint8_t *Data, size_t Size) : Data(Data), End(Data + Size) {}
+
+        std::string write()
+        {
+            while (Data != End)
+                writeStatement();
+            return std::move(Out);
+        }
+    };
+}
+
+// Compiles Program like gsm does, and adds the heap held by its AST and IR to
+// Stats. Returns true if CodeGen fails on a program that passed Sema.
+static bool compile(llvm::StringRef Program, CompileStats &Stats)
+{
+    llvm::SourceMgr SrcMgr;
+    SrcMgr.AddNewSourceBuffer(llvm::MemoryBuffer::getMemBuffer(Program, "<fuzz input>"), llvm::SMLoc());
+    llvm::BumpPtrAllocator ASTArena;
+    Lexer Lex(Program);
+    Parser Parser(Lex, ASTArena, /*Quiet=*/true);
+
+    CompileStats::Phase ParsePhase(&Stats, CompileStats::Parse);
+    AST *Tree = Parser.parse();
+    ParsePhase.stop();
+    if (!Tree || Parser.hasError())
+        return false;
+
+    CompileStats::Phase SemaPhase(&Stats, CompileStats::Sema);
+    if (Sema().semantic(Tree))
+        return false;
+    SemaPhase.stop();
+
+    CodeGenOptions Opts;
+    Opts.OptLevel = OptLevel;
+    Opts.EmitObject = true;
+    Opts.OutputFile = "/dev/null";
+    Opts.Stats = &Stats;
+    return CodeGen(SrcMgr, Opts).compile(Tree);
+}
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::parseFuzzerCLOpts(*argc, *argv);
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
+{
+    std::string Program = ProgramWriter(Data, Size).write();
+    if (PrintProgram)
+        llvm::errs() << Program << "\n";
+
+    CompileStats Stats;
+    std::clock_t Start = std::clock();
+    bool Failed = compile(Program, Stats);
+    uint64_t Micros = uint64_t(std::clock() - Start) * 1000000 / CLOCKS_PER_SEC;
+    int64_t Heap = 0;
+    for (unsigned Phase : {CompileStats::Parse, CompileStats::Sema, CompileStats::IRGen})
+        Heap += std::max<int64_t>(Stats.BytesByPhase[Phase], 0);
+
+    if (Failed)
+    {
+        llvm::errs() << "gsm-fuzzer: CodeGen failed on a program that passed Sema:\n" << Program << "\n";
+        abort();
+    }
+    uint64_t Bytes = std::max<uint64_t>(Program.size(), MinBytes);
+    if (Micros > MaxMicrosPerByte * Bytes || uint64_t(Heap) > MaxHeapPerByte * Bytes)
+    {
+        llvm::errs() << "gsm-fuzzer: a program of " << Program.size() << " bytes took " << Micros
+                     << " us and " << Heap << " heap bytes to compile:\n"
+                     << Program << "\n";
+        abort();
+    }
+    return 0;
+}
+
+#ifndef GSM_LIBFUZZER
+int main(int argc, char **argv)
+{
+    // Like libFuzzer, take a directory as its files, in name order so that
+    // the replay does not depend on the file system.
+    llvm::BumpPtrAllocator Alloc;
+    llvm::StringSaver Saver(Alloc);
+    std::vector<char *> Args;
+    bool Remaining = false;
+    for (int I = 0; I < argc; ++I)
+    {
+        llvm::StringRef Arg(argv[I]);
+        Remaining |= Arg == "-ignore_remaining_args=1";
+        if (I == 0 || Remaining || !llvm::sys::fs::is_directory(Arg))
+        {
+            Args.push_back(argv[I]);
+            continue;
+        }
+        std::error_code EC;
+        std::vector<std::string> Files;
+        for (llvm::sys::fs::directory_iterator It(Arg, EC), End; It != End && !EC; It.increment(EC))
+            if (!llvm::sys::fs::is_directory(It->path()))
+                Files.push_back(It->path());
+        if (EC)
+        {
+            llvm::errs() << "gsm-fuzzer: cannot read " << Arg << ": " << EC.message() << "\n";
+            return 1;
+        }
+        std::sort(Files.begin(), Files.end());
+        for (const std::string &File : Files)
+            Args.push_back(const_cast<char *>(Saver.save(File).data()));
+    }
+    int ArgCount = Args.size();
+    Args.push_back(nullptr);
+    return llvm::runFuzzerOnInputs(ArgCount, Args.data(), LLVMFuzzerTestOneInput, LLVMFuzzerInitialize);
+}
+#endif
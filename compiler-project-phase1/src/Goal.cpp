@@ -1,9 +1,20 @@
+#include "ASTFile.h"
 #include "CodeGen.h"
+#include "LanguageServer.h"
+#include "ParallelParser.h"
 #include "Parser.h"
+#include "PartialEval.h"
 #include "Sema.h"
+#include "Server.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 
 // Define a command-line option for specifying the input expression.
 static llvm::cl::opt<std::string>
@@ -11,43 +22,517 @@ static llvm::cl::opt<std::string>
           llvm::cl::desc("<input expression>"),
           llvm::cl::init(""));
 
+// Define a command-line option for reading the program from a file instead.
+static llvm::cl::opt<std::string>
+    InputFile("input-file",
+              llvm::cl::desc("Read the program from <file> instead of the command line"),
+              llvm::cl::value_desc("file"),
+              llvm::cl::init(""));
+
+// Define command-line options for caching the checked AST in a binary file.
+static llvm::cl::opt<std::string>
+    EmitAST("emit-ast",
+            llvm::cl::desc("Write the checked AST to <file> and stop"),
+            llvm::cl::value_desc("file"),
+            llvm::cl::init(""));
+
+static llvm::cl::opt<std::string>
+    LoadAST("load-ast",
+            llvm::cl::desc("Compile the AST cached in <file> by -emit-ast"),
+            llvm::cl::value_desc("file"),
+            llvm::cl::init(""));
+
+// Define a command-line option for emitting DWARF debug information.
+static llvm::cl::opt<bool>
+    DebugInfo("g",
+              llvm::cl::desc("Emit debug information with GSM source locations"),
+              llvm::cl::init(false));
+
+// Define a command-line option for compiling the program through the flat AST.
+static llvm::cl::opt<bool>
+    FlatSema("flat-ast",
+             llvm::cl::desc("Parse the program into the flat, index-based AST, and check and lower that"),
+             llvm::cl::init(false));
+
+// Define a command-line option for checking the program while it is lowered.
+static llvm::cl::opt<bool>
+    FusedSema("fused-sema",
+              llvm::cl::desc("Run semantic analysis during IR generation instead of as a separate pass"),
+              llvm::cl::init(false));
+
+// Define a command-line option for sharing the nodes of equal expressions.
+static llvm::cl::opt<bool>
+    HashCons("hash-cons",
+             llvm::cl::desc("Share the nodes of equal expressions and reuse their values within a basic block"),
+             llvm::cl::init(false));
+
+// Define a command-line option for checked arithmetic.
+static llvm::cl::opt<bool>
+    CheckedArith("checked-arith",
+                 llvm::cl::desc("Trap on division by zero and signed overflow where value ranges allow them"),
+                 llvm::cl::init(false));
+
+// Define command-line options for running the program at compile time.
+static llvm::cl::opt<bool>
+    PartialEval("partial-eval",
+                llvm::cl::desc("Run the program at compile time until it reads input and emit what is left"),
+                llvm::cl::init(false));
+static llvm::cl::opt<unsigned>
+    EvalBudget("eval-budget",
+               llvm::cl::desc("Steps -partial-eval may take before it leaves the rest to run time"),
+               llvm::cl::init(1000000));
+
+// Define a command-line option for statement-at-a-time compilation.
+static llvm::cl::opt<bool>
+    Stream("stream",
+           llvm::cl::desc("Parse, check and lower one top-level statement at a time"),
+           llvm::cl::init(false));
+
+// Define a command-line option for lexing and parsing on several threads.
+static llvm::cl::opt<unsigned>
+    ParseThreads("parse-threads",
+                 llvm::cl::desc("Threads that lex and parse the program (0 uses every core)"),
+                 llvm::cl::init(1));
+
+// Define command-line options for optimization and output.
+static llvm::cl::opt<unsigned>
+    OptLevel("O",
+             llvm::cl::desc("Optimization level (0-3)"),
+             llvm::cl::Prefix,
+             llvm::cl::init(0));
+
+static llvm::cl::opt<std::string>
+    OutputFile("o",
+               llvm::cl::desc("Write the output to <file>"),
+               llvm::cl::value_desc("file"),
+               llvm::cl::init("-"));
+
+static llvm::cl::opt<bool>
+    EmitObject("c",
+               llvm::cl::desc("Emit a relocatable object file instead of LLVM IR"),
+               llvm::cl::init(false));
+
+static llvm::cl::opt<bool>
+    Multiversion("multiversion",
+                 llvm::cl::desc("Compile the program for x86-64, AVX2 and AVX-512 CPUs and pick one when it starts"),
+                 llvm::cl::init(false));
+
+// Define command-line options for outlining statements and compiling them in parallel.
+static llvm::cl::opt<unsigned>
+    ChunkSize("chunk-size",
+              llvm::cl::desc("Outline every <n> top-level statements into their own function"),
+              llvm::cl::value_desc("n"),
+              llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+    Threads("threads",
+            llvm::cl::desc("Threads that optimize and compile chunks (0 uses every core)"),
+            llvm::cl::init(0));
+
+// Define command-line options for optimization remarks.
+static llvm::cl::opt<std::string>
+    RemarksPassed("Rpass",
+                  llvm::cl::desc("Report optimizations done by passes whose name matches <regex>"),
+                  llvm::cl::value_desc("regex"),
+                  llvm::cl::init(""));
+
+static llvm::cl::opt<std::string>
+    RemarksMissed("Rpass-missed",
+                  llvm::cl::desc("Report missed optimizations of passes whose name matches <regex>"),
+                  llvm::cl::value_desc("regex"),
+                  llvm::cl::init(""));
+
+static llvm::cl::opt<std::string>
+    RemarksAnalysis("Rpass-analysis",
+                    llvm::cl::desc("Report analyses of passes whose name matches <regex>"),
+                    llvm::cl::value_desc("regex"),
+                    llvm::cl::init(""));
+
+static llvm::cl::opt<std::string>
+    RemarksFile("remarks-file",
+                llvm::cl::desc("Write all optimization remarks to <file> as YAML"),
+                llvm::cl::value_desc("file"),
+                llvm::cl::init(""));
+
+// Define command-line options for running the program right away.
+static llvm::cl::opt<bool>
+    Run("run",
+        llvm::cl::desc("Compile the program in memory and run it with the arguments after --"),
+        llvm::cl::init(false));
+
+// The arguments after "--", which are passed to the program. They are split
+// off before the options are parsed, so that none of them is mistaken for
+// the program or for an option of gsm.
+static std::vector<std::string> RunArgs;
+
+static bool parseArguments(int argc, const char **argv, llvm::StringRef Overview, llvm::raw_ostream *Errs)
+{
+    int NumOptions = 1;
+    while (NumOptions < argc && llvm::StringRef(argv[NumOptions]) != "--")
+        ++NumOptions;
+    RunArgs.assign(argv + std::min(NumOptions + 1, argc), argv + argc);
+    return llvm::cl::ParseCommandLineOptions(NumOptions, argv, Overview, Errs);
+}
+
+// Define command-line options for the compile server.
+static llvm::cl::opt<bool>
+    Serve("serve",
+          llvm::cl::desc("Serve compile and run requests on a Unix domain socket"),
+          llvm::cl::init(false));
+
+static llvm::cl::opt<std::string>
+    SocketPath("socket",
+               llvm::cl::desc("Socket of the compile server (default: $GSM_SOCKET, $XDG_RUNTIME_DIR/gsm.sock or /tmp/gsm-<uid>.sock)"),
+               llvm::cl::value_desc("path"),
+               llvm::cl::init(""));
+
+static llvm::cl::opt<unsigned>
+    Workers("workers",
+            llvm::cl::desc("Worker processes of the compile server (0 uses every core)"),
+            llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+    RequestTimeout("request-timeout",
+                   llvm::cl::desc("Kill a request of the compile server, and the program it runs, "
+                                  "after <n> seconds (0 never does)"),
+                   llvm::cl::value_desc("n"),
+                   llvm::cl::init(60));
+
+// Define a command-line option for the editor mode.
+static llvm::cl::opt<bool>
+    LSP("lsp",
+        llvm::cl::desc("Serve the Language Server Protocol on stdin and stdout, for editors"),
+        llvm::cl::init(false));
+
+// Define command-line options for the compile statistics. LLVM already
+// registers -stats and -stats-json for statistics of its own.
+static llvm::cl::opt<bool>
+    CompileStatsText("compile-stats",
+                     llvm::cl::desc("Print compile statistics (tokens, AST nodes, IR per visit method, memory)"),
+                     llvm::cl::init(false));
+
+static llvm::cl::opt<bool>
+    CompileStatsJSON("compile-stats-json",
+                     llvm::cl::desc("Print the compile statistics as JSON"),
+                     llvm::cl::init(false));
+
+static int compileProgram();
+
+// Handles one request of the compile server with the arguments of the client.
+// Resetting the options restores their cl::init values, which is why every
+// option above has one.
+static int serveRequest(int argc, const char **argv)
+{
+    llvm::cl::ResetAllOptionOccurrences();
+    if (!parseArguments(argc, argv, "", &llvm::errs()))
+        return 1;
+    if (Serve || LSP)
+    {
+        llvm::errs() << "-serve and -lsp cannot be requested from the server\n";
+        return 1;
+    }
+    return compileProgram();
+}
+
 // The main function of the program.
 int main(int argc, const char **argv)
 {
     // Initialize the LLVM framework.
     llvm::InitLLVM X(argc, argv);
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
 
     // Parse command-line options.
-    llvm::cl::ParseCommandLineOptions(argc, argv, "Goal - the expression compiler\n");
+    if (!parseArguments(argc, argv, "Goal - the expression compiler\n", nullptr))
+        return 1;
 
-    // Create a lexer object and initialize it with the input expression.
-    Lexer Lex(Input);
+    if (Serve)
+    {
+        // Everything set up so far, and the target machines, are inherited by
+        // the workers, so requests start with warm state.
+        CodeGen::warmUp();
+        std::string Path = SocketPath.empty() ? gsmserver::getDefaultSocketPath() : SocketPath;
+        return gsmserver::runServer(Path, llvm::hardware_concurrency(Workers).compute_thread_count(),
+                                    RequestTimeout, serveRequest);
+    }
+    if (LSP)
+        return runLanguageServer();
 
-    // Create a parser object and initialize it with the lexer.
-    Parser Parser(Lex);
+    return compileProgram();
+}
 
-    // Parse the input expression and generate an abstract syntax tree (AST).
-    AST *Tree = Parser.parse();
+// Prints the statistics of a successful compile and passes its exit code on.
+static int reportStats(CompileStats *Stats, int ExitCode)
+{
+    if (Stats)
+        Stats->print(llvm::errs(), CompileStatsJSON);
+    return ExitCode;
+}
+
+// Compiles the program selected by the command-line options.
+static int compileProgram()
+{
+    if (!Run && !RunArgs.empty())
+    {
+        llvm::errs() << "Arguments after -- are only used with -run\n";
+        return 1;
+    }
+    if (!Input.empty() && !InputFile.empty())
+    {
+        llvm::errs() << "A program on the command line cannot be combined with -input-file\n";
+        return 1;
+    }
+    if (Run && (EmitObject || OutputFile != "-"))
+    {
+        llvm::errs() << "-run cannot be combined with -c or -o\n";
+        return 1;
+    }
 
-    // Check if parsing was successful or if there were any syntax errors.
-    if (!Tree || Parser.hasError())
+    if (!LoadAST.empty() && (!Input.empty() || !InputFile.empty() || Stream || !EmitAST.empty()))
+    {
+        llvm::errs() << "-load-ast cannot be combined with a program, -stream or -emit-ast\n";
+        return 1;
+    }
+    if (!EmitAST.empty() && Stream)
+    {
+        llvm::errs() << "-emit-ast cannot be combined with -stream\n";
+        return 1;
+    }
+    // Nodes are shared across the whole program, which neither a stream of
+    // statements nor independently parsed runs of them can do.
+    if (HashCons && (Stream || ParseThreads != 1))
+    {
+        llvm::errs() << "-hash-cons cannot be combined with -stream or -parse-threads\n";
+        return 1;
+    }
+    if (PartialEval && (Stream || FusedSema))
+    {
+        llvm::errs() << "-partial-eval cannot be combined with -stream or -fused-sema\n";
+        return 1;
+    }
+    if (FlatSema && (FusedSema || Stream || HashCons || PartialEval || !EmitAST.empty()))
     {
-        llvm::errs() << "Syntax errors occurred\n";
+        llvm::errs() << "-flat-ast cannot be combined with -fused-sema, -stream, -hash-cons, -partial-eval or -emit-ast\n";
         return 1;
     }
+    // An invalid pattern would select no remarks without a word.
+    for (const llvm::cl::opt<std::string> *Remarks : {&RemarksPassed, &RemarksMissed, &RemarksAnalysis})
+    {
+        std::string Error;
+        if (!Remarks->empty() && !llvm::Regex(*Remarks).isValid(Error))
+        {
+            llvm::errs() << "invalid regex for -" << Remarks->ArgStr << ": " << Error << "\n";
+            return 1;
+        }
+    }
 
-    // Perform semantic analysis on the AST.
+    // Load the program into a source manager, which maps locations back to
+    // lines. A cached AST brings the source it was parsed from along.
+    llvm::SourceMgr SrcMgr;
+    llvm::BumpPtrAllocator ASTArena;
+    ASTFile CachedAST;
+    AST *LoadedTree = nullptr;
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    if (!LoadAST.empty())
+    {
+        LoadedTree = CachedAST.load(LoadAST, SrcMgr, ASTArena);
+        if (!LoadedTree)
+            return 1;
+    }
+    else if (!InputFile.empty())
+    {
+        auto FileOrErr = llvm::MemoryBuffer::getFile(InputFile);
+        if (std::error_code EC = FileOrErr.getError())
+        {
+            llvm::errs() << "Cannot open " << InputFile << ": " << EC.message() << "\n";
+            return 1;
+        }
+        Buffer = std::move(*FileOrErr);
+    }
+    else
+        Buffer = llvm::MemoryBuffer::getMemBuffer(Input, "<command line>");
+    if (Buffer)
+        SrcMgr.AddNewSourceBuffer(std::move(Buffer), llvm::SMLoc());
+
+    // Statistics are only collected when they were requested.
+    CompileStats StatsStorage;
+    CompileStats *Stats = CompileStatsText || CompileStatsJSON ? &StatsStorage : nullptr;
+    if (Stats)
+        Stats->countTokens(SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBuffer());
+
+    // Create a lexer object and initialize it with the input expression.
+    Lexer Lex(SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBuffer());
+
+    // Create a parser object and initialize it with the lexer. The AST lives in
+    // the arena, so it is released in one go when main returns.
+    Parser Parser(Lex, ASTArena, /*Quiet=*/false, HashCons);
+
+    CodeGenOptions CGOpts;
+    CGOpts.EmitDebugInfo = DebugInfo;
+    CGOpts.OptLevel = OptLevel;
+    CGOpts.ChunkSize = ChunkSize;
+    CGOpts.Threads = Threads;
+    CGOpts.EmitObject = EmitObject;
+    CGOpts.Multiversion = Multiversion;
+    CGOpts.OutputFile = OutputFile;
+    CGOpts.Run = Run;
+    CGOpts.RunArgs = RunArgs;
+    CGOpts.Stats = Stats;
+    CGOpts.RemarksPassed = RemarksPassed;
+    CGOpts.RemarksMissed = RemarksMissed;
+    CGOpts.RemarksAnalysis = RemarksAnalysis;
+    CGOpts.RemarksFile = RemarksFile;
+    // A tree written with -emit-ast is checked on its own.
+    CGOpts.CheckSemantics = FusedSema && EmitAST.empty();
+    CGOpts.ReuseValues = HashCons;
+    CGOpts.CheckedArith = CheckedArith;
+
+    if (Stream)
+    {
+        // Each statement only depends on earlier declarations, so it can be
+        // checked and lowered right away and its AST released afterwards.
+        Sema Semantic;
+        CodeGen CodeGenerator(SrcMgr, CGOpts);
+        CodeGenerator.startStream();
+        for (;;)
+        {
+            CompileStats::Phase ParsePhase(Stats, CompileStats::Parse);
+            Expr *Stmt = Parser.parseNext();
+            ParsePhase.stop();
+            if (!Stmt)
+                break;
+            if (Stats)
+                Stats->countNodes(*Stmt);
+
+            CompileStats::Phase SemaPhase(Stats, CompileStats::Sema);
+            if (!CGOpts.CheckSemantics && Semantic.semanticStatement(Stmt))
+            {
+                llvm::errs() << "Semantic errors occurred\n";
+                return 1;
+            }
+            SemaPhase.stop();
+            if (CodeGenerator.compileStatement(Stmt))
+            {
+                llvm::errs() << "Semantic errors occurred\n";
+                return 1;
+            }
+            ASTArena.Reset();
+        }
+        if (Parser.hasError())
+        {
+            llvm::errs() << "Syntax errors occurred\n";
+            return 1;
+        }
+        if (CodeGenerator.finishStream())
+            return 1;
+        return reportStats(Stats, CodeGenerator.getExitCode());
+    }
+
+    // With -flat-ast, each statement is copied into the FlatAST as soon as it
+    // is parsed and its AST released, so the pointer-based tree of the whole
+    // program never exists. A cached or parallel-parsed tree is flattened.
+    if (FlatSema)
+    {
+        FlatAST Flat;
+        {
+            CompileStats::Phase ParsePhase(Stats, CompileStats::Parse);
+            AST *Tree = LoadedTree;
+            ParallelParser ParParser;
+            if (!Tree && ParseThreads != 1)
+                Tree = ParParser.parse(SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBuffer(),
+                                       ParseThreads, ASTArena);
+            if (Tree)
+            {
+                if (Stats)
+                    Stats->countNodes(*static_cast<Goal *>(Tree));
+                Flat = FlatAST::build(Tree);
+            }
+            else
+            {
+                while (Expr *Stmt = Parser.parseNext())
+                {
+                    if (Stats)
+                        Stats->countNodes(*Stmt);
+                    Flat.append(Stmt);
+                    ASTArena.Reset();
+                }
+                if (Parser.hasError())
+                {
+                    llvm::errs() << "Syntax errors occurred\n";
+                    return 1;
+                }
+            }
+        }
+
+        CompileStats::Phase SemaPhase(Stats, CompileStats::Sema);
+        Sema Semantic;
+        if (Semantic.semantic(Flat))
+        {
+            llvm::errs() << "Semantic errors occurred\n";
+            return 1;
+        }
+        SemaPhase.stop();
+
+        CodeGen CodeGenerator(SrcMgr, CGOpts);
+        if (CodeGenerator.compile(Flat))
+            return 1;
+        return reportStats(Stats, CodeGenerator.getExitCode());
+    }
+
+    // Parse the input expression and generate an abstract syntax tree (AST).
+    // If the parallel parser finds a syntax error, the serial one reparses the
+    // program to report it. The parallel parser owns the arenas of the
+    // statements it returns, so it lives as long as the tree.
+    AST *Tree = LoadedTree;
+    ParallelParser ParParser;
+    if (!Tree)
+    {
+        CompileStats::Phase ParsePhase(Stats, CompileStats::Parse);
+        if (ParseThreads != 1)
+            Tree = ParParser.parse(SrcMgr.getMemoryBuffer(SrcMgr.getMainFileID())->getBuffer(),
+                                   ParseThreads, ASTArena);
+        if (!Tree)
+            Tree = Parser.parse();
+        ParsePhase.stop();
+
+        // Check if parsing was successful or if there were any syntax errors.
+        if (!Tree || Parser.hasError())
+        {
+            llvm::errs() << "Syntax errors occurred\n";
+            return 1;
+        }
+    }
+
+    // Perform semantic analysis on the AST. A cached AST is checked again, so
+    // that a stale or edited file cannot hand CodeGen an unchecked tree. With
+    // -fused-sema, CodeGen runs the checks while it lowers the tree.
+    CompileStats::Phase SemaPhase(Stats, CompileStats::Sema);
     Sema Semantic;
-    if (Semantic.semantic(Tree))
+    if (!CGOpts.CheckSemantics && Semantic.semantic(Tree))
     {
         llvm::errs() << "Semantic errors occurred\n";
         return 1;
     }
+    SemaPhase.stop();
+
+    if (Stats)
+        Stats->countNodes(*static_cast<Goal *>(Tree), HashCons);
+
+    if (!EmitAST.empty())
+        return ASTFile::write(Tree, SrcMgr, EmitAST) ? 1 : reportStats(Stats, 0);
+
+    // With -partial-eval, the statements up to the first one that needs input
+    // run now, and only the rest is compiled.
+    std::vector<int32_t> Written;
+    if (PartialEval)
+        Tree = PartialEvaluator::evaluate(*static_cast<Goal *>(Tree), EvalBudget, ASTArena, Written,
+                                          CheckedArith);
 
     // Generate code for the AST using a code generator.
-    CodeGen CodeGenerator;
-    CodeGenerator.compile(Tree);
+    CodeGen CodeGenerator(SrcMgr, CGOpts);
+    if (CodeGenerator.compile(Tree, Written))
+        return 1;
 
-    // The program executed successfully.
-    return 0;
+    // The program executed successfully; with -run, report how the program exited.
+    return reportStats(Stats, CodeGenerator.getExitCode());
 }
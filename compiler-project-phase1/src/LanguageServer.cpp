@@ -0,0 +1,488 @@
+#include "LanguageServer.h"
+#include "ParallelParser.h"
+#include "Parser.h"
+#include "Sema.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace llvm;
+
+Document::Document(StringRef Text)
+{
+    replace(0, 0, Text.str());
+}
+
+// The statement that contains Pos: the last one that starts at or before it.
+size_t Document::find(Position Pos) const
+{
+    auto I = std::upper_bound(Stmts.begin(), Stmts.end(), Pos,
+                              [](Position P, const std::unique_ptr<Statement> &S) { return P < S->Start; });
+    return I == Stmts.begin() ? 0 : I - Stmts.begin() - 1;
+}
+
+// Like editors do, a column past the end of its line means the end of it.
+size_t Document::getOffset(const Statement &S, Position Pos) const
+{
+    Position P = S.Start;
+    size_t Offset = 0;
+    for (; Offset < S.Text.size() && P < Pos; ++Offset)
+    {
+        if (S.Text[Offset] != '\n')
+            ++P.Column;
+        else if (P.Line == Pos.Line)
+            break;
+        else
+            P = {P.Line + 1, 0};
+    }
+    return Offset;
+}
+
+Document::Position Document::getPosition(const Statement &S, size_t Offset) const
+{
+    Position P = S.Start;
+    for (char C : S.Text.take_front(Offset))
+        P = C == '\n' ? Position{P.Line + 1, 0} : Position{P.Line, P.Column + 1};
+    return P;
+}
+
+unsigned Document::firstDeclarer(StringRef Var) const
+{
+    unsigned First = ~0u;
+    auto I = Declarers.find(Var);
+    if (I != Declarers.end())
+        for (const Statement *S : I->second)
+            First = std::min(First, S->Index);
+    return First;
+}
+
+std::unique_ptr<Document::Statement> Document::parse(StringRef Text,
+                                                     const std::shared_ptr<BumpPtrAllocator> &Arena)
+{
+    auto S = std::make_unique<Statement>();
+    S->Text = Text;
+    S->Arena = Arena;
+    S->NumNewlines = Text.count('\n');
+    S->Tail = Text.size() - (Text.rfind('\n') + 1);
+
+    // A function is tracked under its name followed by "(", which no variable
+    // can be called.
+    auto functionKey = [&Arena](StringRef Name)
+    {
+        char *Key = Arena->Allocate<char>(Name.size() + 1);
+        std::memcpy(Key, Name.data(), Name.size());
+        Key[Name.size()] = '(';
+        return StringRef(Key, Name.size() + 1);
+    };
+
+    Lexer Lex(Text);
+    Parser Parser(Lex, *Arena, /*Quiet=*/true);
+    while (Expr *Stmt = Parser.parseNext())
+    {
+        S->Stmts.push_back(Stmt);
+        if (auto *Dec = dyn_cast<Declaration>(Stmt))
+            S->Decls.append(Dec->begin(), Dec->end());
+        else if (auto *Fn = dyn_cast<FunctionDef>(Stmt))
+            S->Decls.push_back(functionKey(Fn->getName()));
+    }
+    if (Parser.hasError())
+    {
+        const Token &Tok = Parser.getErrorToken();
+        S->SyntaxDiags.push_back({size_t(Tok.getText().data() - Text.data()), Tok.getText().size(),
+                                  Tok.is(Token::eoi) ? "Unexpected end of input"
+                                                     : ("Unexpected: " + Tok.getText()).str()});
+    }
+
+    // The names come from the tokens, so a statement with a syntax error
+    // still gets checked again when the variables it mentions change.
+    Lexer NameLex(Text);
+    Token Tok;
+    StringRef PrevIdent; // the token before Tok, if it is an identifier
+    for (NameLex.next(Tok); !Tok.is(Token::eoi); NameLex.next(Tok))
+    {
+        if (Tok.is(Token::l_paren) && !PrevIdent.empty())
+            S->Names.push_back(functionKey(PrevIdent));
+        PrevIdent = Tok.is(Token::ident) ? Tok.getText() : StringRef();
+        if (Tok.is(Token::ident))
+            S->Names.push_back(Tok.getText());
+    }
+    llvm::sort(S->Names);
+    S->Names.erase(std::unique(S->Names.begin(), S->Names.end()), S->Names.end());
+    return S;
+}
+
+// Checks S against the variables declared and the functions defined by the
+// statements before it.
+void Document::check(Statement &S)
+{
+    S.SemaDiags.clear();
+    Diagnosed.erase(&S);
+    StringSet<> Scope;
+    Sema::FunctionTable Functions;
+    for (StringRef Name : S.Names)
+    {
+        unsigned First = firstDeclarer(Name);
+        if (First >= S.Index)
+            continue;
+        if (!Name.endswith("("))
+        {
+            Scope.insert(Name);
+            continue;
+        }
+        StringRef Fn = Name.drop_back();
+        for (Expr *Stmt : Stmts[First]->Stmts)
+            if (auto *Def = dyn_cast<FunctionDef>(Stmt))
+                if (Def->getName() == Fn)
+                {
+                    Functions[Fn] = Def->getParams().size();
+                    break;
+                }
+    }
+    Sema::semanticStatements(S.Stmts, Scope, Functions, [&S](SMLoc Loc, const std::string &Message)
+                             {
+                                 // Diagnostics point at a name or a number; mark the whole token.
+                                 size_t Offset = Loc.getPointer() - S.Text.data();
+                                 Token Tok;
+                                 Lexer(S.Text.drop_front(Offset)).next(Tok);
+                                 S.SemaDiags.push_back({Offset, Tok.getText().size(), Message});
+                             });
+    if (!S.SyntaxDiags.empty() || !S.SemaDiags.empty())
+        Diagnosed.insert(&S);
+}
+
+// Replaces the statements in [Begin, End) with the ones in Text.
+void Document::replace(size_t Begin, size_t End, std::string Text)
+{
+    // The new text has to end on a boundary that is still one, or the next
+    // statements are parsed with it; they are taken in growing numbers, so
+    // that a block left open does not split the rest of the text again for
+    // every statement. ";=" is a single token, so a text that starts with
+    // '=' joins the statement before it.
+    std::vector<StringRef> Runs;
+    for (size_t Grow = 1;; Grow *= 2)
+    {
+        if (Begin > 0 && !Text.empty() && Text[0] == '=')
+            Text.insert(0, Stmts[--Begin]->Text.str());
+        Runs = ParallelParser::split(Text, ~0u);
+        // The split stops at a NUL, like the lexer; the rest stays with the last statement.
+        Runs.back() = StringRef(Runs.back().data(), Text.data() + Text.size() - Runs.back().data());
+        if (End == Stmts.size() || Runs.back().empty())
+            break;
+        for (size_t E = std::min(End + Grow, Stmts.size()); End != E; ++End)
+            Text += Stmts[End]->Text;
+    }
+    if (End != Stmts.size())
+        Runs.pop_back();
+
+    // The statements of one edit share an arena, which lives as long as the
+    // last of them.
+    auto Arena = std::make_shared<BumpPtrAllocator>();
+    char *Copy = Arena->Allocate<char>(Text.size());
+    std::memcpy(Copy, Text.data(), Text.size());
+    std::vector<std::unique_ptr<Statement>> NewStmts;
+    for (StringRef Run : Runs)
+        NewStmts.push_back(parse(StringRef(Copy + (Run.data() - Text.data()), Run.size()), Arena));
+    size_t NumNew = NewStmts.size();
+
+    // Where each variable declared in the old or the new statements was
+    // first declared before the edit, in the numbering after it. A variable
+    // first declared in the replaced range counts as declared at Begin,
+    // which is all that matters to the statements outside of it.
+    StringMap<unsigned> OldFirst;
+    auto noteDeclared = [&](StringRef Var)
+    {
+        if (OldFirst.count(Var))
+            return;
+        unsigned First = firstDeclarer(Var);
+        if (First != ~0u && First >= Begin)
+            First = First < End ? Begin : First - End + Begin + NumNew;
+        OldFirst[Var] = First;
+    };
+    for (size_t I = Begin; I != End; ++I)
+        for (StringRef Var : Stmts[I]->Decls)
+            noteDeclared(Var);
+    for (const auto &S : NewStmts)
+        for (StringRef Var : S->Decls)
+            noteDeclared(Var);
+
+    for (size_t I = Begin; I != End; ++I)
+    {
+        Statement *S = Stmts[I].get();
+        Diagnosed.erase(S);
+        for (StringRef Var : S->Decls)
+        {
+            auto D = Declarers.find(Var);
+            if (D == Declarers.end())
+                continue;
+            llvm::erase_value(D->second, S);
+            if (D->second.empty())
+                Declarers.erase(D);
+        }
+        for (StringRef Name : S->Names)
+        {
+            auto U = Users.find(Name);
+            U->second.erase(S);
+            if (U->second.empty())
+                Users.erase(U);
+        }
+    }
+    // Only a change in the number of statements moves the ones after them.
+    size_t NumKept = std::min(End - Begin, NumNew);
+    std::move(NewStmts.begin(), NewStmts.begin() + NumKept, Stmts.begin() + Begin);
+    Stmts.erase(Stmts.begin() + Begin + NumKept, Stmts.begin() + End);
+    Stmts.insert(Stmts.begin() + Begin + NumKept, std::make_move_iterator(NewStmts.begin() + NumKept),
+                 std::make_move_iterator(NewStmts.end()));
+
+    // Number the statements again, up to the first one after the new ones
+    // that did not move.
+    for (size_t I = Begin; I != Stmts.size(); ++I)
+    {
+        Statement &S = *Stmts[I];
+        Position Start = {0, 0};
+        if (I)
+        {
+            const Statement &Prev = *Stmts[I - 1];
+            Start = {Prev.Start.Line + Prev.NumNewlines,
+                     Prev.NumNewlines ? Prev.Tail : Prev.Start.Column + Prev.Tail};
+        }
+        if (I >= Begin + NumNew && S.Index == I && S.Start.Line == Start.Line &&
+            S.Start.Column == Start.Column)
+            break;
+        S.Index = I;
+        S.Start = Start;
+    }
+
+    for (size_t I = Begin; I != Begin + NumNew; ++I)
+    {
+        Statement *S = Stmts[I].get();
+        for (StringRef Var : S->Decls)
+            Declarers[Var].push_back(S);
+        for (StringRef Name : S->Names)
+            Users[Name].insert(S);
+    }
+
+    // A statement outside the range is affected by a variable only if the
+    // variable is now declared first on the other side of it. The first
+    // definition of a function may also have been replaced by one with other
+    // parameters, so every call after it is affected.
+    DenseSet<Statement *> Affected;
+    for (const auto &Var : OldFirst)
+    {
+        unsigned Old = Var.second, New = firstDeclarer(Var.first());
+        bool IsFunction = Var.first().endswith("(");
+        auto U = Users.find(Var.first());
+        if ((Old == New && !IsFunction) || U == Users.end())
+            continue;
+        for (Statement *S : U->second)
+            if ((S->Index < Begin || S->Index >= Begin + NumNew) &&
+                (IsFunction ? std::min(Old, New) < S->Index : (Old < S->Index) != (New < S->Index)))
+                Affected.insert(S);
+    }
+    for (size_t I = Begin; I != Begin + NumNew; ++I)
+        check(*Stmts[I]);
+    for (Statement *S : Affected)
+        check(*S);
+}
+
+void Document::edit(Position Start, Position End, StringRef Text)
+{
+    if (End < Start)
+        std::swap(Start, End);
+    size_t First = find(Start), Last = find(End);
+    const Statement &F = *Stmts[First], &L = *Stmts[Last];
+    std::string NewText = F.Text.take_front(getOffset(F, Start)).str();
+    NewText += Text;
+    NewText += L.Text.drop_front(getOffset(L, End));
+    replace(First, Last + 1, std::move(NewText));
+}
+
+void Document::edit(StringRef Text)
+{
+    Stmts.clear();
+    Diagnosed.clear();
+    Declarers.clear();
+    Users.clear();
+    replace(0, 0, Text.str());
+}
+
+std::vector<Document::Diagnostic> Document::getDiagnostics() const
+{
+    std::vector<const Statement *> Sorted(Diagnosed.begin(), Diagnosed.end());
+    llvm::sort(Sorted, [](const Statement *A, const Statement *B) { return A->Index < B->Index; });
+    std::vector<Diagnostic> Diags;
+    for (const Statement *S : Sorted)
+        for (const auto *List : {&S->SyntaxDiags, &S->SemaDiags})
+            for (const Statement::Diag &D : *List)
+                Diags.push_back({getPosition(*S, D.Offset), getPosition(*S, D.Offset + D.Length), D.Message});
+    return Diags;
+}
+
+namespace
+{
+    // Reads a message of the base protocol: headers up to an empty line,
+    // then a JSON body of Content-Length bytes.
+    bool readMessage(std::string &Body)
+    {
+        size_t Length = 0;
+        bool HasLength = false;
+        char Line[256];
+        for (;;)
+        {
+            if (!std::fgets(Line, sizeof(Line), stdin))
+                return false;
+            StringRef Header = StringRef(Line).trim();
+            if (Header.empty() && HasLength)
+                break;
+            if (Header.consume_front_insensitive("Content-Length:"))
+                HasLength = !Header.trim().getAsInteger(10, Length);
+        }
+        Body.resize(Length);
+        return std::fread(&Body[0], 1, Length, stdin) == Length;
+    }
+
+    void writeMessage(json::Object Message)
+    {
+        Message["jsonrpc"] = "2.0";
+        std::string Body;
+        raw_string_ostream(Body) << json::Value(std::move(Message));
+        outs() << "Content-Length: " << Body.size() << "\r\n\r\n"
+               << Body;
+        outs().flush();
+    }
+
+    json::Value toJSON(Document::Position Pos)
+    {
+        return json::Object{{"line", Pos.Line}, {"character", Pos.Column}};
+    }
+
+    Document::Position getPosition(const json::Object *Pos)
+    {
+        if (!Pos)
+            return {0, 0};
+        return {unsigned(Pos->getInteger("line").getValueOr(0)),
+                unsigned(Pos->getInteger("character").getValueOr(0))};
+    }
+
+    class LanguageServer
+    {
+        StringMap<std::unique_ptr<Document>> Docs; // by URI
+        bool ShutdownRequested = false;
+
+        void reply(const json::Value &Id, json::Value Result)
+        {
+            writeMessage(json::Object{{"id", Id}, {"result", std::move(Result)}});
+        }
+
+        void replyError(const json::Value &Id, int Code, const Twine &Message)
+        {
+            writeMessage(json::Object{{"id", Id},
+                                      {"error", json::Object{{"code", Code}, {"message", Message.str()}}}});
+        }
+
+        void publish(StringRef Uri, const Document *Doc, const json::Value *Version)
+        {
+            json::Array Diags;
+            if (Doc)
+                for (const Document::Diagnostic &D : Doc->getDiagnostics())
+                    Diags.push_back(json::Object{
+                        {"range", json::Object{{"start", toJSON(D.Start)}, {"end", toJSON(D.End)}}},
+                        {"severity", 1},
+                        {"source", "gsm"},
+                        // Unexpected tokens may hold bytes that are no UTF-8.
+                        {"message", json::isUTF8(D.Message) ? D.Message : json::fixUTF8(D.Message)}});
+            json::Object Params{{"uri", Uri}, {"diagnostics", std::move(Diags)}};
+            if (Version)
+                Params["version"] = *Version;
+            writeMessage(json::Object{{"method", "textDocument/publishDiagnostics"},
+                                      {"params", std::move(Params)}});
+        }
+
+    public:
+        // Handles one request or notification; returns false after exit.
+        bool handle(const json::Object &Message, int &ExitCode)
+        {
+            const json::Value *Id = Message.get("id");
+            Optional<StringRef> Method = Message.getString("method");
+            const json::Object *Params = Message.getObject("params");
+            const json::Object *TextDoc = Params ? Params->getObject("textDocument") : nullptr;
+            Optional<StringRef> Uri = TextDoc ? TextDoc->getString("uri") : None;
+            if (!Method)
+                return true;
+
+            if (*Method == "initialize" && Id)
+                reply(*Id, json::Object{
+                               {"capabilities",
+                                json::Object{{"textDocumentSync",
+                                              json::Object{{"openClose", true}, {"change", 2}}}}},
+                               {"serverInfo", json::Object{{"name", "gsm"}}}});
+            else if (*Method == "shutdown" && Id)
+            {
+                ShutdownRequested = true;
+                reply(*Id, nullptr);
+            }
+            else if (*Method == "exit")
+            {
+                ExitCode = ShutdownRequested ? 0 : 1;
+                return false;
+            }
+            else if (*Method == "textDocument/didOpen" && Uri)
+            {
+                auto &Doc = Docs[*Uri];
+                Doc = std::make_unique<Document>(TextDoc->getString("text").getValueOr(""));
+                publish(*Uri, Doc.get(), TextDoc->get("version"));
+            }
+            else if (*Method == "textDocument/didChange" && Uri && Docs.count(*Uri))
+            {
+                Document &Doc = *Docs[*Uri];
+                if (const json::Array *Changes = Params->getArray("contentChanges"))
+                    for (const json::Value &Change : *Changes)
+                    {
+                        const json::Object *C = Change.getAsObject();
+                        if (!C)
+                            continue;
+                        StringRef Text = C->getString("text").getValueOr("");
+                        if (const json::Object *Range = C->getObject("range"))
+                            Doc.edit(getPosition(Range->getObject("start")), getPosition(Range->getObject("end")),
+                                     Text);
+                        else
+                            Doc.edit(Text);
+                    }
+                publish(*Uri, &Doc, TextDoc->get("version"));
+            }
+            else if (*Method == "textDocument/didClose" && Uri)
+            {
+                Docs.erase(*Uri);
+                publish(*Uri, nullptr, nullptr);
+            }
+            else if (Id)
+                replyError(*Id, -32601, "Unsupported method " + *Method);
+            return true;
+        }
+    };
+}
+
+int runLanguageServer()
+{
+    LanguageServer Server;
+    std::string Body;
+    int ExitCode = 1; // the client went away without exit
+    while (readMessage(Body))
+    {
+        Expected<json::Value> Message = json::parse(Body);
+        if (!Message)
+        {
+            writeMessage(json::Object{
+                {"id", nullptr},
+                {"error", json::Object{{"code", -32700}, {"message", toString(Message.takeError())}}}});
+            continue;
+        }
+        if (const json::Object *Obj = Message->getAsObject())
+            if (!Server.handle(*Obj, ExitCode))
+                break;
+    }
+    return ExitCode;
+}
@@ -0,0 +1,106 @@
+#ifndef LANGUAGESERVER_H
+#define LANGUAGESERVER_H
+
+#include "AST.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// A program open in an editor, kept up to date edit by edit. The text is held
+// as a list of top-level statements, split like ParallelParser::split does
+// it: after every semicolon outside begin/end. Each one keeps its text, AST
+// and diagnostics. An edit re-lexes and re-parses the statements it touches,
+// growing the range while its end does not fall on a statement boundary any
+// more, e.g. after a `begin` was typed.
+//
+// A top-level statement sees the variables of the statements before it, so
+// Sema is run again on the new statements and on those that mention a name
+// whose first top-level declaration moved past them, which changes whether
+// they may use or declare it. Functions are tracked the same way, and the
+// calls after a replaced definition are checked again too, since its number
+// of parameters may have changed. Everything else keeps its diagnostics.
+//
+// Positions are zero-based lines and columns, counted in bytes.
+class Document
+{
+public:
+    struct Position
+    {
+        unsigned Line, Column;
+        bool operator<(const Position &O) const
+        {
+            return Line < O.Line || (Line == O.Line && Column < O.Column);
+        }
+    };
+
+    struct Diagnostic
+    {
+        Position Start, End;
+        std::string Message;
+    };
+
+private:
+    struct Statement
+    {
+        llvm::StringRef Text; // up to and including its top-level semicolon
+        // Owns Text and the AST, with the other statements of the same edit.
+        std::shared_ptr<llvm::BumpPtrAllocator> Arena;
+        // The statements in Text; those from a syntax error on are missing.
+        llvm::SmallVector<Expr *, 1> Stmts;
+        llvm::SmallVector<llvm::StringRef, 2> Decls; // variables and functions ("name(") it declares at the top level
+        llvm::SmallVector<llvm::StringRef, 4> Names; // identifiers in Text, once each
+
+        struct Diag
+        {
+            size_t Offset, Length; // in Text
+            std::string Message;
+        };
+        llvm::SmallVector<Diag, 0> SyntaxDiags, SemaDiags;
+
+        unsigned Index = ~0u;   // in Document::Stmts
+        Position Start = {0, 0};
+        unsigned NumNewlines = 0;
+        unsigned Tail = 0; // bytes after the last newline
+    };
+
+    // Never empty; the last statement is the text after the last boundary.
+    std::vector<std::unique_ptr<Statement>> Stmts;
+    // Statements that declare each variable at the top level, and statements
+    // that mention each name at all.
+    llvm::StringMap<llvm::SmallVector<Statement *, 1>> Declarers;
+    llvm::StringMap<llvm::DenseSet<Statement *>> Users;
+    // Statements with diagnostics, so that publishing them does not have to
+    // visit every statement.
+    llvm::DenseSet<Statement *> Diagnosed;
+
+    size_t find(Position Pos) const;
+    size_t getOffset(const Statement &S, Position Pos) const;
+    Position getPosition(const Statement &S, size_t Offset) const;
+    unsigned firstDeclarer(llvm::StringRef Var) const;
+    static std::unique_ptr<Statement> parse(llvm::StringRef Text,
+                                            const std::shared_ptr<llvm::BumpPtrAllocator> &Arena);
+    void check(Statement &S);
+    void replace(size_t Begin, size_t End, std::string Text);
+
+public:
+    explicit Document(llvm::StringRef Text);
+
+    // Replaces the text in [Start, End) with Text.
+    void edit(Position Start, Position End, llvm::StringRef Text);
+    // Replaces the whole text.
+    void edit(llvm::StringRef Text);
+
+    std::vector<Diagnostic> getDiagnostics() const;
+    size_t getNumStatements() const { return Stmts.size(); }
+};
+
+// Serves the Language Server Protocol on stdin and stdout until the client
+// sends exit, publishing the syntax and semantic errors of the open programs
+// after every change. Returns the exit code.
+int runLanguageServer();
+
+#endif
@@ -28,21 +28,21 @@ namespace charinfo
 
 void Lexer::next(Token &token)
 {
-    while (*BufferPtr && charinfo::isWhitespace(*BufferPtr))
+    while (BufferPtr != BufferEnd && *BufferPtr && charinfo::isWhitespace(*BufferPtr))
     {
         ++BufferPtr;
     }
     // make sure we didn't reach the end of input
-    if (!*BufferPtr)
+    if (BufferPtr == BufferEnd || !*BufferPtr)
     {
-        token.Kind = Token::eoi;
+        formToken(token, BufferPtr, Token::eoi);
         return;
     }
     // collect characters and check for keywords or ident
     if (charinfo::isLetter(*BufferPtr))
     {
         const char *end = BufferPtr + 1;
-        while (charinfo::isLetter(*end))
+        while (end != BufferEnd && charinfo::isLetter(*end))
             ++end;
         llvm::StringRef Name(BufferPtr, end - BufferPtr);
         Token::TokenKind kind;
@@ -64,6 +64,14 @@ void Lexer::next(Token &token)
             kind = Token::end; // added
         else if (Name == "loopc")
             kind = Token::loop; // added
+        else if (Name == "read")
+            kind = Token::KW_read;
+        else if (Name == "def")
+            kind = Token::KW_def;
+        else if (Name == "memo")
+            kind = Token::KW_memo;
+        else if (Name == "return")
+            kind = Token::KW_return;
         else
             kind = Token::ident;
         // generate the token
@@ -73,14 +81,26 @@ void Lexer::next(Token &token)
     // check for numbers
     else if (charinfo::isDigit(*BufferPtr))
     {
+        // The literal is decoded here, once; later phases use the value.
+        uint64_t Value = *BufferPtr - '0';
+        bool Overflow = false;
         const char *end = BufferPtr + 1;
-        while (charinfo::isDigit(*end))
-            ++end;
+        for (; end != BufferEnd && charinfo::isDigit(*end); ++end)
+        {
+            Value = Value * 10 + (*end - '0');
+            if (Value > INT32_MAX)
+            {
+                Overflow = true;
+                Value = 0;
+            }
+        }
         formToken(token, end, Token::number);
+        token.Value = Overflow ? 0 : static_cast<int32_t>(Value);
+        token.Overflow = Overflow;
         return;
     }
     // check for double op
-    else if (charinfo::secCharIsEqual(*(BufferPtr + 1)))
+    else if (BufferPtr + 1 != BufferEnd && charinfo::secCharIsEqual(*(BufferPtr + 1)))
     {
         const char *end = BufferPtr + 2;
 
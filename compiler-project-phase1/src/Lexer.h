@@ -3,6 +3,8 @@
 
 #include "llvm/ADT/StringRef.h"        // encapsulates a pointer to a C string and its length
 #include "llvm/Support/MemoryBuffer.h" // read-only access to a block of memory, filled with the content of a file
+#include "llvm/Support/SMLoc.h"        // location in the source buffer, resolved to line and column by a SourceMgr
+#include <cstdint>
 
 class Lexer;
 
@@ -49,16 +51,25 @@ public:
         l_paren,
         r_paren,
         // KW_type,
-        KW_int
+        KW_int,
+        KW_read,
+        KW_def,
+        KW_memo,
+        KW_return
     };
 
 private:
     TokenKind Kind;
+    bool Overflow;        // a number token whose value does not fit in 32 bits
+    int32_t Value;        // decoded value of a number token
     llvm::StringRef Text; // points to the start of the text of the token
 
 public:
     TokenKind getKind() const { return Kind; }
     llvm::StringRef getText() const { return Text; }
+    int32_t getValue() const { return Value; }
+    bool hasOverflow() const { return Overflow; }
+    llvm::SMLoc getLocation() const { return llvm::SMLoc::getFromPointer(Text.data()); }
 
     // to test if the token is of a certain kind
     bool is(TokenKind K) const { return Kind == K; }
@@ -75,12 +86,14 @@ class Lexer
 {
     const char *BufferStart; // pointer to the beginning of the input
     const char *BufferPtr;   // pointer to the next unprocessed character
+    const char *BufferEnd;   // end of the input, unless a NUL comes first
 
 public:
     Lexer(const llvm::StringRef &Buffer)
     {
         BufferStart = Buffer.begin();
         BufferPtr = BufferStart;
+        BufferEnd = Buffer.end();
     }
 
     void next(Token &token); // return the next token
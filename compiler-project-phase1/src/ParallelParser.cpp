@@ -0,0 +1,90 @@
+#include "ParallelParser.h"
+#include "Parser.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+using namespace llvm;
+
+// Same classification as the lexer, so the pre-scan sees the same words.
+static bool isLetter(char C)
+{
+  return (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z');
+}
+
+std::vector<StringRef> ParallelParser::split(StringRef Buffer, unsigned NumRuns)
+{
+  std::vector<StringRef> Runs;
+  const char *Start = Buffer.begin(), *P = Start, *End = Buffer.end();
+  size_t Target = Buffer.size() / std::max(NumRuns, 1u) + 1;
+  int Depth = 0; // begin/end nesting
+
+  // The lexer stops at a NUL, so the last run does as well.
+  while (P != End && *P)
+  {
+    if (isLetter(*P))
+    {
+      const char *Word = P;
+      while (++P != End && isLetter(*P))
+        ;
+      StringRef Name(Word, P - Word);
+      if (Name == "begin")
+        ++Depth;
+      else if (Name == "end")
+        --Depth;
+      continue;
+    }
+    // ";=" is lexed as one unknown token, so it is no boundary.
+    if (*P++ == ';' && Depth == 0 && size_t(P - Start) >= Target &&
+        Runs.size() + 1 < NumRuns && (P == End || *P != '='))
+    {
+      Runs.push_back(StringRef(Start, P - Start));
+      Start = P;
+    }
+  }
+  Runs.push_back(StringRef(Start, P - Start));
+  return Runs;
+}
+
+AST *ParallelParser::parse(StringRef Buffer, unsigned Threads, BumpPtrAllocator &Arena)
+{
+  ThreadPoolStrategy Strategy = hardware_concurrency(Threads);
+  // A few runs per thread even out runs that take longer than others.
+  std::vector<StringRef> Runs = split(Buffer, Strategy.compute_thread_count() * 4);
+
+  std::vector<SmallVector<Expr *, 0>> Stmts(Runs.size());
+  std::vector<char> Failed(Runs.size());
+  size_t FirstArena = Arenas.size();
+  for (size_t I = 0; I < Runs.size(); ++I)
+    Arenas.push_back(std::make_unique<BumpPtrAllocator>());
+
+  ThreadPool Pool(Strategy);
+  for (size_t I = 0; I < Runs.size(); ++I)
+    Pool.async([&, I]
+               {
+                 Lexer Lex(Runs[I]);
+                 Parser Parser(Lex, *Arenas[FirstArena + I], /*Quiet=*/true);
+                 while (Expr *Stmt = Parser.parseNext())
+                   Stmts[I].push_back(Stmt);
+                 Failed[I] = Parser.hasError();
+               });
+  Pool.wait();
+
+  size_t NumStmts = 0;
+  for (size_t I = 0; I < Runs.size(); ++I)
+  {
+    if (Failed[I])
+      return nullptr;
+    NumStmts += Stmts[I].size();
+  }
+
+  Expr **List = Arena.Allocate<Expr *>(NumStmts);
+  Expr **Next = List;
+  for (const auto &Run : Stmts)
+    Next = std::copy(Run.begin(), Run.end(), Next);
+
+  // Like Parser::parseGoal, the Goal starts at the first token.
+  Token First;
+  Lexer(Buffer).next(First);
+  return new (Arena.Allocate<Goal>()) Goal(First.getLocation(), ArrayRef<Expr *>(List, NumStmts));
+}
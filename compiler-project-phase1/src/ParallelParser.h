@@ -0,0 +1,32 @@
+#ifndef PARALLELPARSER_H
+#define PARALLELPARSER_H
+
+#include "AST.h"
+#include "llvm/Support/Allocator.h"
+#include <memory>
+#include <vector>
+
+// Parses a program on several threads. A pre-scan splits the input after
+// top-level semicolons, i.e. semicolons outside begin/end, into runs of
+// statements of roughly equal size. Every run is lexed and parsed on its own,
+// into an arena of its own, and the statements are joined into one Goal in
+// source order.
+//
+// Identifiers are StringRefs into the source buffer, in the serial parser as
+// well, so the runs share no state and the tree equals the one of Parser.
+class ParallelParser
+{
+    std::vector<std::unique_ptr<llvm::BumpPtrAllocator>> Arenas; // one per run
+
+public:
+    // Returns nullptr if the input contains a syntax error. No error is
+    // printed; the serial Parser reports it with the usual message.
+    // Threads == 0 uses every core. The Goal and its statement list are
+    // allocated in Arena, the statements in arenas owned by this object.
+    AST *parse(llvm::StringRef Buffer, unsigned Threads, llvm::BumpPtrAllocator &Arena);
+
+    // Splits Buffer into at most NumRuns runs of whole top-level statements.
+    static std::vector<llvm::StringRef> split(llvm::StringRef Buffer, unsigned NumRuns);
+};
+
+#endif
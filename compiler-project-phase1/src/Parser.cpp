@@ -9,74 +9,66 @@ AST *Parser::parse()
 
 AST *Parser::parseGoal()
 {
+    llvm::SMLoc Loc = Tok.getLocation();
     llvm::SmallVector<Expr *> exprs;
     while (!Tok.is(Token::eoi))
     {
-        switch (Tok.getKind())
-        {
-        case Token::KW_int:
-        {
-            Expr *d;
-            d = parseDec();
-            if (d)
-                exprs.push_back(d);
-            else
-                goto _error2;
-            break;
-        }    
-        case Token::ident:
-            {
-                Expr *a;
-                a = parseAssign();
-
-                // if (!Tok.is(Token::semicolon))
-                // {
-                //     error();
-                //     goto _error2;
-                // }
-                if (a)
-                    exprs.push_back(a);
-                else
-                    goto _error2;
-                break;
-            }
-        case Token::KW_if:
-        {
-           Expr *e;
-            e = parseCondition();
+        Expr *e = parseNext();
+        if (!e)
+            return nullptr;
+        exprs.push_back(e);
+    }
+    return create<Goal>(Loc, copyToArena<Expr *>(exprs));
+}
 
-            if (e)
-                exprs.push_back(e);
-            else
-                goto _error2;
-            break; 
-        }
-        case Token::loop:
-        {
-            Expr *l;
-            l = parseLoop();
+Expr *Parser::parseNext()
+{
+    if (Tok.is(Token::eoi))
+        return nullptr;
+    Expr *e = parseStatement();
+    // A statement that contains a syntax error is not handed out.
+    if (e && !HasError)
+        return e;
 
-            if (l)
-                exprs.push_back(l);
-            else
-                goto _error2;
-            break;
-        } 
-        default:
-            goto _error2;
-            break;
-        }
-        advance(); // TODO: watch this part
-    }
-    return new Goal(exprs);
-_error2:
+    // Nothing after a syntax error is parsed.
     while (Tok.getKind() != Token::eoi)
         advance();
     return nullptr;
 }
 
+// Statements are the same at the top level and inside begin/end blocks.
+Expr *Parser::parseStatement()
+{
+    switch (Tok.getKind())
+    {
+    case Token::KW_int:
+        return parseDec();
+    case Token::ident:
+        return parseAssign();
+    case Token::KW_if:
+        return parseCondition();
+    case Token::loop:
+        return parseLoop();
+    case Token::KW_read:
+        return parseRead();
+    case Token::KW_def:
+    case Token::KW_memo:
+        // Functions are only defined at the top level.
+        if (BlockDepth)
+            break;
+        return parseFunction();
+    case Token::KW_return:
+        return parseReturn();
+    default:
+        break;
+    }
+    error();
+    return nullptr;
+}
+
 Expr *Parser::parseDec()
 {
+    llvm::SMLoc Loc = Tok.getLocation();
     Expr *E;
     llvm::SmallVector<llvm::StringRef, 8> Vars;
     llvm::SmallVector<Expr *> Numbers;
@@ -101,6 +93,9 @@ Expr *Parser::parseDec()
         countIdentifiers++;
         advance();
     }
+    // An initializer may name a variable before or after it is stored to.
+    for (llvm::StringRef Var : Vars)
+        invalidate(Var);
 
     if (Tok.is(Token::equal))
     {
@@ -113,6 +108,8 @@ Expr *Parser::parseDec()
         }
         else
             goto _error;
+        for (llvm::StringRef Var : Vars)
+            invalidate(Var);
 
         while (countExprs <= countIdentifiers && Tok.is(Token::comma))
         {
@@ -122,10 +119,11 @@ Expr *Parser::parseDec()
             {
                 Numbers.push_back(E);
                 countExprs++;
-                Factor *temp = (Factor *)E;
             }
             else
                 goto _error;
+            for (llvm::StringRef Var : Vars)
+                invalidate(Var);
         }
         if(countExprs > countIdentifiers){
             error();
@@ -133,10 +131,10 @@ Expr *Parser::parseDec()
         }
     }
 
-    if (expect(Token::semicolon))
+    if (consume(Token::semicolon))
         goto _error;
 
-    return new Declaration(Vars, Numbers);
+    return create<Declaration>(Loc, copyToArena<llvm::StringRef>(Vars), copyToArena<Expr *>(Numbers));
 _error: // TODO: Check this later in case of error :)
     while (Tok.getKind() != Token::eoi)
         advance();
@@ -145,6 +143,7 @@ _error: // TODO: Check this later in case of error :)
 
 Expr *Parser::parseCondition()
 {
+    llvm::SMLoc Loc = Tok.getLocation();
     Expr *E;
     BE *B;
 
@@ -214,7 +213,7 @@ Expr *Parser::parseCondition()
         }
         else goto _error3;
     }
-    return new Condition(exprs, bes);
+    return create<Condition>(Loc, copyToArena<Expr *>(exprs), copyToArena<BE *>(bes));
 
 _error3: // TODO: Check this later in case of error :)
     while (Tok.getKind() != Token::eoi)
@@ -224,6 +223,7 @@ _error3: // TODO: Check this later in case of error :)
 
 Expr *Parser::parseLoop()
 {
+    llvm::SMLoc Loc = Tok.getLocation();
     Expr *E;
     BE *B;
 
@@ -239,7 +239,7 @@ Expr *Parser::parseLoop()
 
     B = (BE *)(parseBE());
 
-    return new Loop(E, B);
+    return create<Loop>(Loc, E, B);
 
 _error5: // TODO: Check this later in case of error :)
     while (Tok.getKind() != Token::eoi)
@@ -247,208 +247,398 @@ _error5: // TODO: Check this later in case of error :)
     return nullptr;
 }
 
-Assignment *Parser::parseAssign()
+Expr *Parser::parseRead()
 {
-    Expr *E;
-    Factor *F;
-    F = (Factor *)(parseFactor());
+    llvm::SMLoc Loc = Tok.getLocation();
+    llvm::SmallVector<llvm::StringRef, 8> Vars;
 
-    if (!Tok.is(Token::equal) && !Tok.is(Token::plus_equal) && !Tok.is(Token::minus_equal) &&
-        !Tok.is(Token::remain_equal) && !Tok.is(Token::mult_equal) && !Tok.is(Token::div_equal))
-    {
-        error();
-        return nullptr;
-    }
+    if (consume(Token::KW_read))
+        goto _error6;
 
+    if (expect(Token::ident))
+        goto _error6;
+    Vars.push_back(Tok.getText());
     advance();
-    E = parseExpr();
 
-    if (expect(Token::semicolon))
-        goto _error4;
+    while (Tok.is(Token::comma))
+    {
+        advance();
+        if (expect(Token::ident))
+            goto _error6;
+        Vars.push_back(Tok.getText());
+        advance();
+    }
+    for (llvm::StringRef Var : Vars)
+        invalidate(Var);
 
-    advance();
+    if (consume(Token::semicolon))
+        goto _error6;
 
-    return new Assignment(F, E);
-    
-    _error4: // TODO: Check this later in case of error :)
-        while (Tok.getKind() != Token::eoi)
-            advance();
-        return nullptr;
-}
+    return create<Read>(Loc, copyToArena<llvm::StringRef>(Vars));
 
-Expr *Parser::parseExpr()
-{
-    Expr *Left = parseExpr1();
-    while (Tok.is(Token::KW_or))
-    {
-        BinaryOp::Operator Op =
-            BinaryOp::Or;
+_error6:
+    while (Tok.getKind() != Token::eoi)
         advance();
-        Expr *Right = parseExpr1();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
+    return nullptr;
 }
 
-Expr *Parser::parseExpr1()
+// Parses `memo`? `def` ident `(` (ident (`,` ident)*)? `)` `:` BE. The body
+// has variables of its own, so the hash-consed identifiers around it are not
+// shared with it.
+Expr *Parser::parseFunction()
 {
-    Expr *Left = parseExpr2();
-    while (Tok.is(Token::KW_and))
-    {
-        BinaryOp::Operator Op =
-            BinaryOp::And;
+    llvm::SMLoc Loc = Tok.getLocation();
+    llvm::StringRef Name;
+    llvm::SmallVector<llvm::StringRef, 4> Params;
+    BE *Body;
+    bool Memo = Tok.is(Token::KW_memo);
+    if (Memo)
         advance();
-        Expr *Right = parseExpr2();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
-}
 
-Expr *Parser::parseExpr2()
-{
-    Expr *Left = parseExpr3();
-    while (Tok.isOneOf(Token::equal_equal, Token::not_equal))
+    if (consume(Token::KW_def))
+        goto _error7;
+    if (expect(Token::ident))
+        goto _error7;
+    Name = Tok.getText();
+    advance();
+    if (consume(Token::l_paren))
+        goto _error7;
+    if (Tok.is(Token::ident))
     {
-        BinaryOp::Operator Op =
-            Tok.is(Token::equal_equal) ? BinaryOp::Equal_equal : BinaryOp::Not_equal;
+        Params.push_back(Tok.getText());
         advance();
-        Expr *Right = parseExpr3();
-        Left = new BinaryOp(Op, Left, Right);
+        while (Tok.is(Token::comma))
+        {
+            advance();
+            if (expect(Token::ident))
+                goto _error7;
+            Params.push_back(Tok.getText());
+            advance();
+        }
     }
-    return Left;
+    if (consume(Token::r_paren) || consume(Token::colon))
+        goto _error7;
+
+    IdentNodes.clear();
+    Body = llvm::cast_or_null<BE>(parseBE());
+    IdentNodes.clear();
+    if (!Body)
+        return nullptr;
+    return create<FunctionDef>(Loc, Name, copyToArena<llvm::StringRef>(Params), Body, Memo);
+
+_error7:
+    while (Tok.getKind() != Token::eoi)
+        advance();
+    return nullptr;
 }
 
-Expr *Parser::parseExpr3()
+Expr *Parser::parseReturn()
 {
-    Expr *Left = parseExpr4();
-    while (Tok.isOneOf(Token::more_equal, Token::less_equal))
-    {
-        BinaryOp::Operator Op =
-            Tok.is(Token::more_equal) ? BinaryOp::More_equal : BinaryOp::Less_equal;
+    llvm::SMLoc Loc = Tok.getLocation();
+    Expr *E;
+    if (consume(Token::KW_return))
+        goto _error8;
+    E = parseExpr();
+    if (!E || consume(Token::semicolon))
+        goto _error8;
+    return create<Return>(Loc, E);
+
+_error8:
+    while (Tok.getKind() != Token::eoi)
         advance();
-        Expr *Right = parseExpr4();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
+    return nullptr;
 }
 
-Expr *Parser::parseExpr4()
+Assignment *Parser::parseAssign()
 {
-    Expr *Left = parseExpr5();
-    while (Tok.isOneOf(Token::more, Token::less))
+    llvm::SMLoc Loc = Tok.getLocation();
+    Expr *E;
+    Factor *F;
+    F = llvm::dyn_cast_or_null<Factor>(parseFactor());
+
+    // The destination is a variable, not a call.
+    if (!F || !Tok.isOneOf(Token::equal, Token::plus_equal, Token::minus_equal, Token::remain_equal,
+                           Token::mult_equal, Token::div_equal))
     {
-        BinaryOp::Operator Op =
-            Tok.is(Token::more) ? BinaryOp::More : BinaryOp::Less;
-        advance();
-        Expr *Right = parseExpr5();
-        Left = new BinaryOp(Op, Left, Right);
+        error();
+        return nullptr;
     }
-    return Left;
+
+    advance();
+    E = parseExpr();
+    invalidate(F->getVal());
+
+    if (expect(Token::semicolon))
+        goto _error4;
+
+    advance();
+
+    return create<Assignment>(Loc, F, E);
+    
+    _error4: // TODO: Check this later in case of error :)
+        while (Tok.getKind() != Token::eoi)
+            advance();
+        return nullptr;
 }
 
-Expr *Parser::parseExpr5()
+// Binding strength of the binary operators, from `or` (0) to `^` (MaxLevel);
+// every level is left-associative.
+static const unsigned MaxLevel = 7;
+
+static bool getBinaryOperator(const Token &Tok, unsigned &Level, BinaryOp::Operator &Op)
 {
-    Expr *Left = parseExpr6();
-    while (Tok.isOneOf(Token::plus, Token::minus))
+    switch (Tok.getKind())
     {
-        BinaryOp::Operator Op =
-            Tok.is(Token::plus) ? BinaryOp::Plus : BinaryOp::Minus;
-        advance();
-        Expr *Right = parseExpr6();
-        Left = new BinaryOp(Op, Left, Right);
+    case Token::KW_or:
+        Level = 0, Op = BinaryOp::Or;
+        return true;
+    case Token::KW_and:
+        Level = 1, Op = BinaryOp::And;
+        return true;
+    case Token::equal_equal:
+        Level = 2, Op = BinaryOp::Equal_equal;
+        return true;
+    case Token::not_equal:
+        Level = 2, Op = BinaryOp::Not_equal;
+        return true;
+    case Token::more_equal:
+        Level = 3, Op = BinaryOp::More_equal;
+        return true;
+    case Token::less_equal:
+        Level = 3, Op = BinaryOp::Less_equal;
+        return true;
+    case Token::more:
+        Level = 4, Op = BinaryOp::More;
+        return true;
+    case Token::less:
+        Level = 4, Op = BinaryOp::Less;
+        return true;
+    case Token::plus:
+        Level = 5, Op = BinaryOp::Plus;
+        return true;
+    case Token::minus:
+        Level = 5, Op = BinaryOp::Minus;
+        return true;
+    case Token::star:
+        Level = 6, Op = BinaryOp::Mul;
+        return true;
+    case Token::slash:
+        Level = 6, Op = BinaryOp::Div;
+        return true;
+    case Token::remain:
+        Level = 6, Op = BinaryOp::Remain;
+        return true;
+    case Token::power:
+        Level = 7, Op = BinaryOp::Power;
+        return true;
+    default:
+        return false;
     }
-    return Left;
 }
 
-Expr *Parser::parseExpr6()
+// expr := expr1 ("or" expr1)*, expr1 := expr2 ("and" expr2)*, and so on down
+// to term := factor ("^" factor)* and factor := number | ident | "(" expr ")".
+// Instead of one function per level, the pending levels and parentheses are
+// kept on a stack, so the nesting depth is only limited by memory. The frames
+// are handled in the order of the recursive descent, which gives the same tree
+// and reports the same syntax errors.
+Expr *Parser::parseExpr()
 {
-    Expr *Left = parseTerm();
-    while (Tok.isOneOf(Token::star, Token::slash, Token::remain))
+    llvm::SmallVector<ExprFrame, 16> Stack;
+    Stack.push_back({ExprFrame::Levels, 0, MaxLevel});
+    for (;;)
     {
+        // Parse an operand, opening the parentheses in front of it.
+        while (Tok.is(Token::l_paren))
+        {
+            advance();
+            Stack.push_back({ExprFrame::Paren});
+            Stack.push_back({ExprFrame::Levels, 0, MaxLevel});
+        }
+        Expr *Res = parseFactor();
+
+        // Hand the operand down until a level continues with an operator.
+        unsigned Level;
         BinaryOp::Operator Op;
-        if(Tok.is(Token::star))
-            Op = BinaryOp::Mul;
-        else if(Tok.is(Token::slash))
-            Op = BinaryOp::Div;
-        else if(Tok.is(Token::remain))
-            Op = BinaryOp::Remain; // new 
+        for (;;)
+        {
+            if (Stack.empty())
+                return Res;
+            ExprFrame &F = Stack.back();
+            if (F.Kind == ExprFrame::Paren)
+            {
+                Stack.pop_back();
+                closeParen(Res);
+                continue;
+            }
 
-        advance();
-        Expr *Right = parseTerm();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
-}
+            bool IsOp = getBinaryOperator(Tok, Level, Op);
+            if (F.Kind == ExprFrame::Operand)
+            {
+                F.Left = createBinaryOp(F.OpLoc, F.Op, F.Left, Res);
+                if (IsOp && Level == F.Lo)
+                {
+                    F.Op = Op;
+                    F.OpLoc = Tok.getLocation();
+                    break;
+                }
+                Res = F.Left;
+                Stack.pop_back();
+                continue;
+            }
 
-Expr *Parser::parseTerm()
-{
-    Expr *Left = parseFactor();
-    while (Tok.is(Token::power))
-    {
-        BinaryOp::Operator Op = BinaryOp::Power;
+            if (!IsOp || Level < F.Lo || Level > F.Hi)
+            {
+                Stack.pop_back();
+                continue;
+            }
+            // The levels above Level are done; Level continues with Op.
+            ExprFrame Next = {ExprFrame::Operand, static_cast<uint8_t>(Level), static_cast<uint8_t>(Level),
+                              Op, Tok.getLocation(), Res};
+            if (Level == F.Lo)
+                F = Next;
+            else
+            {
+                F.Hi = Level - 1;
+                Stack.push_back(Next);
+            }
+            break;
+        }
+
+        // The right operand binds the levels above the operator.
         advance();
-        Expr *Right = parseFactor();
-        Left = new BinaryOp(Op, Left, Right);
+        if (Level < MaxLevel)
+            Stack.push_back({ExprFrame::Levels, static_cast<uint8_t>(Level + 1), MaxLevel});
     }
-    return Left;
 }
 
+// Parses a number, an identifier or a call; parentheses are opened by parseExpr.
 Expr *Parser::parseFactor()
 {
     Expr *Res = nullptr;
     switch (Tok.getKind())
     {
     case Token::number:
-        Res = new Factor(Factor::Number, Tok.getText());
+        if (Tok.hasOverflow())
+        {
+            if (!Quiet)
+                llvm::errs() << "Integer literal " << Tok.getText() << " does not fit in 32 bits\n";
+            HasError = true;
+        }
+        Res = createNumber(Tok.getLocation(), Tok.getValue());
         advance();
         break;
     case Token::ident:
-        Res = new Factor(Factor::Ident, Tok.getText());
+    {
+        Token NameTok = Tok;
         advance();
+        if (Tok.is(Token::l_paren))
+            Res = parseCall(NameTok);
+        else
+            Res = createIdent(NameTok.getLocation(), NameTok.getText());
         break;
-    case Token::l_paren:
-        advance();
-        Res = parseExpr();
-        if (!consume(Token::r_paren))
-            break;
+    }
     default: // error handling
-        if (!Res)
-            error();
-        while (!Tok.isOneOf(Token::r_paren, Token::star, Token::plus, Token::minus, Token::slash, Token::eoi))
-            advance();
+        error();
+        skipOperand();
         break;
     }
     return Res;
 }
 
-Expr *Parser::parseBE()
+// Parses the arguments of a call of NameTok, from the `(` on. Every argument
+// is parsed by a nested parseExpr, so their nesting depth is limited.
+Expr *Parser::parseCall(const Token &NameTok)
 {
+    llvm::SmallVector<Expr *, 4> Args;
+    if (CallDepth == Call::MaxDepth)
+    {
+        if (!Quiet)
+            llvm::errs() << "Calls nested more than " << Call::MaxDepth << " deep\n";
+        HasError = true;
+        while (Tok.getKind() != Token::eoi)
+            advance();
+        return nullptr;
+    }
+    advance();
 
-    Assignment *E;
-    llvm::SmallVector<Assignment *> assigns;
+    ++CallDepth;
+    if (!Tok.is(Token::r_paren))
+    {
+        for (;;)
+        {
+            Args.push_back(parseExpr());
+            if (!Tok.is(Token::comma))
+                break;
+            advance();
+        }
+    }
+    --CallDepth;
+    if (!Tok.is(Token::r_paren) || llvm::is_contained(Args, nullptr))
+    {
+        // The first error is reported where it was found.
+        if (!HasError)
+            error();
+        skipOperand();
+        return nullptr;
+    }
+    advance();
+    return create<Call>(NameTok.getLocation(), NameTok.getText(), copyToArena<Expr *>(Args));
+}
+
+// Expects the `)` of a parenthesized expression Res. Without it, the rest of
+// the operand is skipped.
+void Parser::closeParen(Expr *Res)
+{
+    if (!consume(Token::r_paren))
+        return;
+    if (!Res)
+        error();
+    skipOperand();
+}
+
+Expr *Parser::parseBE()
+{
+    llvm::SMLoc Loc = Tok.getLocation();
+    Expr *E;
+    llvm::SmallVector<Expr *> stmts;
     if (expect(Token::begin))
     {
         goto _error6;
     }
+    if (BlockDepth == BE::MaxDepth)
+    {
+        if (!Quiet)
+            llvm::errs() << "Blocks nested more than " << BE::MaxDepth << " deep\n";
+        HasError = true;
+        goto _error6;
+    }
 
     advance();
 
-    while (Tok.is(Token::ident))
+    ++BlockDepth;
+    while (!Tok.isOneOf(Token::end, Token::eoi))
     {
-        E = parseAssign();
-        Factor *f = E->getLeft();
-        Factor *t = (Factor *)E->getRight();
-        //llvm::errs() << f->getVal() << " " << t->getVal();
-        if (E)
+        E = parseStatement();
+        if (E && !HasError)
         {
-            assigns.push_back(E);
+            stmts.push_back(E);
         }
         else
         {
-            error();
+            // The first error is reported where it was found.
+            --BlockDepth;
+            if (!HasError)
+                error();
             return nullptr;
         }
     }
+    --BlockDepth;
+    // The names declared in the block refer to the outer variables again.
+    for (Expr *Stmt : stmts)
+        if (auto *Dec = llvm::dyn_cast<Declaration>(Stmt))
+            for (llvm::StringRef Var : *Dec)
+                invalidate(Var);
 
     if (expect(Token::end))
     {
@@ -456,7 +646,7 @@ Expr *Parser::parseBE()
     }
 
     advance();
-    return new BE(assigns);
+    return create<BE>(Loc, copyToArena<Expr *>(stmts));
 _error6: // TODO: Check this later in case of error :)
     while (Tok.getKind() != Token::eoi)
         advance();
@@ -3,17 +3,93 @@
 
 #include "AST.h"
 #include "Lexer.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/raw_ostream.h"
+#include <memory>
 
 class Parser
 {
     Lexer &Lex;    // retrieve the next token from the input
     Token Tok;     // stores the next token
     bool HasError; // indicates if an error was detected
+    Token ErrorTok; // the token of the first error
+    bool Quiet;    // errors are only recorded, not printed
+    unsigned BlockDepth = 0; // begin/end blocks around the current token
+    unsigned CallDepth = 0;  // calls whose arguments the current token is in
+    llvm::BumpPtrAllocator &Arena; // owns every node and child list of the AST
+
+    // Hash-consing: with HashCons, every occurrence of an identifier or a
+    // literal, and every operation on the same operand nodes, gets the same
+    // node, so the expressions form a DAG. The node of an identifier is
+    // dropped wherever its variable may change (assignment, read,
+    // declaration, end of a declaring block); later occurrences get a new
+    // node, and so do the operations on it. Equal nodes therefore have equal
+    // values whenever one straight-line piece of code evaluates both.
+    bool HashCons;
+    llvm::StringMap<Factor *> IdentNodes;
+    llvm::DenseMap<int64_t, Factor *> NumberNodes;
+    llvm::DenseMap<std::pair<std::pair<Expr *, Expr *>, unsigned>, BinaryOp *> OpNodes;
+
+    // allocates a node in the arena; nodes are never destroyed individually
+    template <typename T, typename... Args> T *create(Args &&...args)
+    {
+        return new (Arena.Allocate<T>()) T(std::forward<Args>(args)...);
+    }
+
+    Factor *createIdent(llvm::SMLoc Loc, llvm::StringRef Name)
+    {
+        if (!HashCons)
+            return create<Factor>(Loc, Name);
+        Factor *&Node = IdentNodes[Name];
+        if (!Node)
+            Node = create<Factor>(Loc, Name);
+        return Node;
+    }
+
+    Factor *createNumber(llvm::SMLoc Loc, int32_t Num)
+    {
+        if (!HashCons)
+            return create<Factor>(Loc, Num);
+        Factor *&Node = NumberNodes[Num];
+        if (!Node)
+            Node = create<Factor>(Loc, Num);
+        return Node;
+    }
+
+    BinaryOp *createBinaryOp(llvm::SMLoc Loc, BinaryOp::Operator Op, Expr *Left, Expr *Right)
+    {
+        if (!HashCons)
+            return create<BinaryOp>(Loc, Op, Left, Right);
+        BinaryOp *&Node = OpNodes[{{Left, Right}, Op}];
+        if (!Node)
+            Node = create<BinaryOp>(Loc, Op, Left, Right);
+        return Node;
+    }
+
+    // The value of Var may change here.
+    void invalidate(llvm::StringRef Var)
+    {
+        if (HashCons)
+            IdentNodes.erase(Var);
+    }
+
+    // copies a child list collected while parsing into the arena
+    template <typename T> llvm::ArrayRef<T> copyToArena(llvm::ArrayRef<T> Elts)
+    {
+        T *Mem = Arena.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
 
     void error()
     {
-        llvm::errs() << "Unexpected: " << Tok.getText() << "\n";
+        if (!Quiet)
+            llvm::errs() << "Unexpected: " << Tok.getText() << "\n";
+        if (!HasError)
+            ErrorTok = Tok;
         HasError = true;
     }
 
@@ -31,6 +107,13 @@ class Parser
         return false;
     }
 
+    // skips the rest of a malformed operand, up to the next operator or `)`
+    void skipOperand()
+    {
+        while (!Tok.isOneOf(Token::r_paren, Token::star, Token::plus, Token::minus, Token::slash, Token::eoi))
+            advance();
+    }
+
     // retrieves the next token if the look-ahead is of the expected kind
     bool consume(Token::TokenKind Kind)
     {
@@ -40,25 +123,42 @@ class Parser
         return false;
     }
 
+    // A pending step of parseExpr, which keeps its own stack instead of
+    // recursing through the precedence levels and parentheses.
+    struct ExprFrame
+    {
+        enum FrameKind : uint8_t
+        {
+            Levels,  // precedence levels Lo..Hi wait for their first operand
+            Operand, // level Lo has parsed Left Op and waits for the right operand
+            Paren    // an opening parenthesis waits for its closing one
+        } Kind;
+        uint8_t Lo = 0, Hi = 0;
+        BinaryOp::Operator Op = BinaryOp::Plus;
+        llvm::SMLoc OpLoc = {};
+        Expr *Left = nullptr;
+    };
+
     AST *parseGoal();
+    Expr *parseStatement();
     Expr *parseDec();
     Assignment *parseAssign();
     Expr *parseExpr();
-    Expr *parseExpr1();
-    Expr *parseExpr2();
-    Expr *parseExpr3();
-    Expr *parseExpr4();
-    Expr *parseExpr5();
-    Expr *parseExpr6();
-    Expr *parseTerm();
     Expr *parseFactor();
+    void closeParen(Expr *Res);
     Expr *parseLoop();
     Expr *parseBE();
     Expr *parseCondition();
+    Expr *parseRead();
+    Expr *parseFunction();
+    Expr *parseReturn();
+    Expr *parseCall(const Token &NameTok);
 
 public:
-    // initializes all members and retrieves the first token
-    Parser(Lexer &Lex) : Lex(Lex), HasError(false)
+    // initializes all members and retrieves the first token; a quiet parser
+    // does not print syntax errors, hasError() still reports them
+    Parser(Lexer &Lex, llvm::BumpPtrAllocator &Arena, bool Quiet = false, bool HashCons = false)
+        : Lex(Lex), HasError(false), Quiet(Quiet), Arena(Arena), HashCons(HashCons)
     {
         advance();
     }
@@ -66,7 +166,14 @@ public:
     // get the value of error flag
     bool hasError() { return HasError; }
 
+    // the token where the first error was found, if there was one
+    const Token &getErrorToken() { return ErrorTok; }
+
     AST *parse();
+
+    // parses the next top-level statement only, for statement-at-a-time
+    // compilation; returns nullptr at the end of the input or on a syntax error
+    Expr *parseNext();
 };
 
 #endif
\ No newline at end of file
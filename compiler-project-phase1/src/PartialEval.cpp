@@ -0,0 +1,396 @@
+#include "PartialEval.h"
+#include "RangeAnalysis.h"
+#include <climits>
+
+using namespace llvm;
+
+static int32_t wrap(uint32_t Val) { return static_cast<int32_t>(Val); }
+
+bool PartialEvaluator::combine(BinaryOp &Op, int32_t Left, int32_t Right, int32_t &Val)
+{
+    uint32_t L = Left, R = Right;
+    switch (Op.getOperator())
+    {
+    case BinaryOp::Plus:
+        Val = wrap(L + R);
+        return !Checked || int64_t(Left) + Right == Val;
+    case BinaryOp::Minus:
+        Val = wrap(L - R);
+        return !Checked || int64_t(Left) - Right == Val;
+    case BinaryOp::Mul:
+        Val = wrap(L * R);
+        return !Checked || int64_t(Left) * Right == Val;
+    case BinaryOp::Div:
+    case BinaryOp::Remain:
+        // Both trap at run time.
+        if (Right == 0 || (Left == INT_MIN && Right == -1))
+            return false;
+        Val = Op.getOperator() == BinaryOp::Div ? Left / Right : Left % Right;
+        return true;
+    case BinaryOp::Power:
+    {
+        // CodeGen multiplies out an exponent that folds to a constant and
+        // yields the base for any other one.
+        Val = Left;
+        if (!RangeAnalysis::foldsToConstant(Op.getRight()) || Right < 0)
+            return true;
+        if (Checked && Right > 1 && (Left < -1 || Left > 1))
+        {
+            // The partial products of CodeGen are powers of the base no
+            // higher than the exponent, and their magnitude only grows.
+            int64_t Exact = Left;
+            for (int32_t I = 1; I < Right; ++I)
+                if ((Exact *= Left) < INT32_MIN || Exact > INT32_MAX)
+                    return false;
+        }
+        uint32_t Res = 1;
+        for (uint32_t Exp = Right; Exp; Exp >>= 1, L *= L)
+            if (Exp & 1)
+                Res *= L;
+        Val = wrap(Res);
+        return true;
+    }
+    case BinaryOp::Equal_equal:
+        Val = Left == Right;
+        return true;
+    case BinaryOp::Not_equal:
+        Val = Left != Right;
+        return true;
+    case BinaryOp::More_equal:
+        Val = Left >= Right;
+        return true;
+    case BinaryOp::Less_equal:
+        Val = Left <= Right;
+        return true;
+    case BinaryOp::Less:
+        Val = Left < Right;
+        return true;
+    case BinaryOp::More:
+        Val = Left > Right;
+        return true;
+    case BinaryOp::And:
+    case BinaryOp::Or:
+        break;
+    }
+    llvm_unreachable("and/or are evaluated by eval");
+}
+
+// Expressions are evaluated from an explicit stack, like CodeGen lowers them,
+// so that deeply nested ones do not exhaust the native stack.
+bool PartialEvaluator::eval(Expr &E, int32_t &Val)
+{
+    enum StepKind : uint8_t
+    {
+        Eval,         // evaluate Node and push its value
+        Combine,      // pop the operands of the BinaryOp Node and push the result
+        ShortCircuit, // pop the left operand of the and/or Node, evaluate the right one if needed
+        ToBool,       // turn the value on top of the stack into 0 or 1
+        Apply         // pop the arguments of the Call Node and push its result
+    };
+    SmallVector<std::pair<Expr *, StepKind>, 32> Work{{&E, Eval}};
+    SmallVector<int32_t, 32> Values;
+    while (!Work.empty())
+    {
+        Expr *Node = Work.back().first;
+        StepKind Kind = Work.back().second;
+        Work.pop_back();
+        switch (Kind)
+        {
+        case Eval:
+        {
+            if (!step())
+                return false;
+            if (auto *F = dyn_cast<Factor>(Node))
+            {
+                int32_t V = F->getNumber();
+                if (F->getKind() == Factor::Ident && !load(F->getVal(), V))
+                    return false;
+                Values.push_back(V);
+                break;
+            }
+            if (auto *C = dyn_cast<Call>(Node))
+            {
+                Work.push_back({C, Apply});
+                for (Expr *Arg : reverse(C->getArgs()))
+                    Work.push_back({Arg, Eval});
+                break;
+            }
+            auto *Op = cast<BinaryOp>(Node);
+            if (Op->getOperator() == BinaryOp::And || Op->getOperator() == BinaryOp::Or)
+            {
+                Work.push_back({Op, ShortCircuit});
+                Work.push_back({Op->getLeft(), Eval});
+                break;
+            }
+            Work.push_back({Op, Combine});
+            Work.push_back({Op->getRight(), Eval});
+            Work.push_back({Op->getLeft(), Eval});
+            break;
+        }
+        case Combine:
+        {
+            int32_t Right = Values.pop_back_val();
+            int32_t Left = Values.pop_back_val();
+            int32_t V;
+            if (!combine(*cast<BinaryOp>(Node), Left, Right, V))
+                return false;
+            Values.push_back(V);
+            break;
+        }
+        case ShortCircuit:
+        {
+            bool IsAnd = cast<BinaryOp>(Node)->getOperator() == BinaryOp::And;
+            bool Left = Values.pop_back_val() != 0;
+            if (Left != IsAnd)
+            {
+                Values.push_back(Left);
+                break;
+            }
+            Work.push_back({Node, ToBool});
+            Work.push_back({cast<BinaryOp>(Node)->getRight(), Eval});
+            break;
+        }
+        case ToBool:
+            Values.back() = Values.back() != 0;
+            break;
+        case Apply:
+        {
+            auto *C = cast<Call>(Node);
+            FunctionDef *Fn = Functions.lookup(C->getName());
+            size_t NumArgs = C->getArgs().size();
+            int32_t V;
+            if (!Fn || !call(*Fn, makeArrayRef(Values).take_back(NumArgs), V))
+                return false;
+            Values.resize(Values.size() - NumArgs);
+            Values.push_back(V);
+            break;
+        }
+        }
+    }
+    Val = Values.back();
+    return true;
+}
+
+// Runs the body of Fn with its parameters bound to Args, hiding the variables
+// of the caller.
+bool PartialEvaluator::call(FunctionDef &Fn, ArrayRef<int32_t> Args, int32_t &Val)
+{
+    if (CallDepth == MaxCalls)
+        return false;
+    std::pair<FunctionDef *, std::vector<int32_t>> Key;
+    if (Fn.isMemo())
+    {
+        Key = {&Fn, std::vector<int32_t>(Args.begin(), Args.end())};
+        auto Hit = Memo.find(Key);
+        if (Hit != Memo.end())
+        {
+            Val = Hit->second;
+            return true;
+        }
+    }
+
+    StringMap<unsigned> CallerNames = std::move(Names);
+    auto CallerScopes = std::move(BlockScopes);
+    Names.clear();
+    BlockScopes.clear();
+    size_t NumSlots = Slots.size();
+    for (size_t I = 0; I < Args.size(); ++I)
+    {
+        declare(Fn.getParams()[I]);
+        Slots.back() = {Args[I], true};
+    }
+    ++CallDepth;
+    if (!exec(*Fn.getBody()))
+        return false;
+    --CallDepth;
+    // Falling off the end returns 0.
+    Val = Returning ? ReturnValue : 0;
+    Returning = false;
+    Slots.resize(NumSlots);
+    Names = std::move(CallerNames);
+    BlockScopes = std::move(CallerScopes);
+    if (Fn.isMemo())
+        Memo.emplace(std::move(Key), Val);
+    return true;
+}
+
+void PartialEvaluator::declare(StringRef Var)
+{
+    auto Bound = Names.try_emplace(Var, Slots.size());
+    if (!BlockScopes.empty())
+        BlockScopes.back().push_back({Var, Bound.second ? -1 : int(Bound.first->second)});
+    Bound.first->second = Slots.size();
+    Slots.push_back({0, false});
+}
+
+bool PartialEvaluator::load(StringRef Var, int32_t &Val)
+{
+    auto I = Names.find(Var);
+    if (I == Names.end() || !Slots[I->second].Defined)
+        return false;
+    Val = Slots[I->second].Val;
+    return true;
+}
+
+bool PartialEvaluator::store(StringRef Var, int32_t Val)
+{
+    auto I = Names.find(Var);
+    if (I == Names.end())
+        return false;
+    Slot &S = Slots[I->second];
+    if (I->second < TopSlots)
+        Undo.push_back({I->second, S.Val});
+    S = {Val, true};
+    return true;
+}
+
+bool PartialEvaluator::exec(Expr &Stmt)
+{
+    if (!step())
+        return false;
+    switch (Stmt.getExprKind())
+    {
+    case Expr::EK_Assignment:
+    {
+        auto &Assign = cast<Assignment>(Stmt);
+        int32_t Val;
+        if (!eval(*Assign.getRight(), Val) || !store(Assign.getLeft()->getVal(), Val))
+            return false;
+        // Only the top-level program writes its assignments.
+        if (!CallDepth)
+            Writes.push_back(Val);
+        return true;
+    }
+    case Expr::EK_Declaration:
+    {
+        // Like CodeGen, each variable is declared after its initializer runs.
+        auto &Dec = cast<Declaration>(Stmt);
+        auto Init = Dec.begin_values(), InitEnd = Dec.end_values();
+        for (StringRef Var : Dec)
+        {
+            int32_t Val = 0;
+            if (Init != InitEnd && !eval(**Init++, Val))
+                return false;
+            declare(Var);
+            store(Var, Val);
+        }
+        return true;
+    }
+    case Expr::EK_BE:
+    {
+        size_t NumSlots = Slots.size();
+        BlockScopes.emplace_back();
+        for (Expr *S : cast<BE>(Stmt))
+        {
+            if (!exec(*S))
+                return false;
+            if (Returning)
+                break;
+        }
+        for (auto &Hidden : reverse(BlockScopes.back()))
+        {
+            if (Hidden.second < 0)
+                Names.erase(Hidden.first);
+            else
+                Names[Hidden.first] = Hidden.second;
+        }
+        BlockScopes.pop_back();
+        Slots.resize(NumSlots);
+        return true;
+    }
+    case Expr::EK_Loop:
+    {
+        auto &L = cast<Loop>(Stmt);
+        for (;;)
+        {
+            int32_t Guard;
+            if (!eval(*L.getExpr(), Guard))
+                return false;
+            if (!Guard)
+                return true;
+            if (!exec(*L.getBE()))
+                return false;
+            if (Returning)
+                return true;
+        }
+    }
+    case Expr::EK_Condition:
+    {
+        auto &Cond = cast<Condition>(Stmt);
+        ArrayRef<Expr *> Guards = Cond.getAllExpresions();
+        ArrayRef<BE *> Bodies = Cond.getAllBes();
+        for (size_t I = 0; I < Bodies.size(); ++I)
+        {
+            int32_t Guard = 1; // the else arm has no guard
+            if (I < Guards.size() && !eval(*Guards[I], Guard))
+                return false;
+            if (Guard)
+                return exec(*Bodies[I]);
+        }
+        return true;
+    }
+    case Expr::EK_FunctionDef:
+    {
+        auto &Fn = cast<FunctionDef>(Stmt);
+        Functions[Fn.getName()] = &Fn;
+        return true;
+    }
+    case Expr::EK_Return:
+        if (!eval(*cast<Return>(Stmt).getValue(), ReturnValue))
+            return false;
+        Returning = true;
+        return true;
+    default:
+        // Read needs the input of the program.
+        return false;
+    }
+}
+
+AST *PartialEvaluator::evaluate(Goal &Tree, uint64_t Budget, BumpPtrAllocator &Arena,
+                                std::vector<int32_t> &Writes, bool Checked)
+{
+    PartialEvaluator PE(Writes, Budget, Checked);
+    std::vector<StringRef> Vars; // top-level variables, in slot order
+    SmallVector<Expr *, 4> Defs; // evaluated function definitions
+    auto I = Tree.begin(), E = Tree.end();
+    for (; I != E; ++I)
+    {
+        size_t NumWrites = Writes.size();
+        PE.TopSlots = PE.Slots.size();
+        PE.Undo.clear();
+        if (!PE.exec(**I))
+        {
+            for (auto &Old : reverse(PE.Undo))
+                PE.Slots[Old.first].Val = Old.second;
+            PE.Slots.resize(PE.TopSlots);
+            Writes.resize(NumWrites);
+            break;
+        }
+        if (auto *Dec = dyn_cast<Declaration>(*I))
+            Vars.insert(Vars.end(), Dec->begin(), Dec->end());
+        else if (isa<FunctionDef>(*I))
+            Defs.push_back(*I);
+    }
+
+    // The functions only see each other, so they can come before the state.
+    SmallVector<Expr *, 16> Stmts;
+    if (I != E)
+        Stmts.append(Defs.begin(), Defs.end());
+    if (I != E && !Vars.empty())
+    {
+        // The residual program starts with the state the evaluated part left.
+        SMLoc Loc = (*I)->getLocation();
+        Expr **Values = Arena.Allocate<Expr *>(Vars.size());
+        for (size_t Slot = 0; Slot < Vars.size(); ++Slot)
+            Values[Slot] = new (Arena.Allocate<Factor>()) Factor(Loc, PE.Slots[Slot].Val);
+        StringRef *Names = Arena.Allocate<StringRef>(Vars.size());
+        std::copy(Vars.begin(), Vars.end(), Names);
+        Stmts.push_back(new (Arena.Allocate<Declaration>()) Declaration(
+            Loc, ArrayRef<StringRef>(Names, Vars.size()), ArrayRef<Expr *>(Values, Vars.size())));
+    }
+    Stmts.append(I, E);
+
+    Expr **List = Arena.Allocate<Expr *>(Stmts.size());
+    std::copy(Stmts.begin(), Stmts.end(), List);
+    return new (Arena.Allocate<Goal>()) Goal(Tree.getLocation(), ArrayRef<Expr *>(List, Stmts.size()));
+}
@@ -0,0 +1,78 @@
+#ifndef PARTIALEVAL_H
+#define PARTIALEVAL_H
+
+#include "AST.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Runs a checked program at compile time, one top-level statement after the
+// other, with the semantics of the generated code: 32-bit wrapping arithmetic,
+// assignments write their value, variables start at 0. Evaluation stops
+// before the first top-level statement that reads input, divides by zero (or
+// INT_MIN by -1), overflows with Checked (-checked-arith), reads a variable
+// before its initializer has stored it, or runs out of the step budget; every
+// evaluated node and loop iteration is a step. A statement that stops is
+// undone as a whole. Calls are evaluated too, unless they nest deeper than
+// MaxCalls; a memo function computes its result once per argument list here
+// as well.
+//
+// What is left is returned as a residual program: the evaluated function
+// definitions, a declaration of the variables of the evaluated statements
+// with their final values, followed by the statements that were not
+// evaluated. CodeGen writes the values the
+// evaluated statements wrote before it runs the residual program.
+class PartialEvaluator
+{
+    struct Slot
+    {
+        int32_t Val;
+        bool Defined; // false until the declaration has stored a value
+    };
+
+    std::vector<Slot> Slots;         // variables in declaration order, innermost last
+    llvm::StringMap<unsigned> Names; // slot of each visible variable
+    // Variables declared by the enclosing blocks, with the slot each one
+    // hides, or -1; the names are restored when the block ends.
+    llvm::SmallVector<llvm::SmallVector<std::pair<llvm::StringRef, int>, 4>, 4> BlockScopes;
+    // Old values of the top-level variables the running top-level statement
+    // stored to, so that it can be undone.
+    std::vector<std::pair<unsigned, int32_t>> Undo;
+    unsigned TopSlots = 0; // slots of the variables declared before the running top-level statement
+
+    // Calls recurse on the native stack.
+    static const unsigned MaxCalls = 256;
+    llvm::StringMap<FunctionDef *> Functions; // defined so far
+    std::map<std::pair<FunctionDef *, std::vector<int32_t>>, int32_t> Memo;
+    unsigned CallDepth = 0; // calls the running statement is in
+    bool Returning = false; // a return statement ran, skip to the end of the call
+    int32_t ReturnValue = 0;
+
+    std::vector<int32_t> &Writes;
+    uint64_t Steps = 0, Budget;
+    bool Checked; // overflow traps, so it stops the evaluation
+
+    PartialEvaluator(std::vector<int32_t> &Writes, uint64_t Budget, bool Checked)
+        : Writes(Writes), Budget(Budget), Checked(Checked) {}
+
+    bool step() { return ++Steps <= Budget; }
+    void declare(llvm::StringRef Var);
+    bool load(llvm::StringRef Var, int32_t &Val);
+    bool store(llvm::StringRef Var, int32_t Val);
+    bool exec(Expr &Stmt);
+    bool eval(Expr &E, int32_t &Val);
+    bool combine(BinaryOp &Op, int32_t Left, int32_t Right, int32_t &Val);
+    bool call(FunctionDef &Fn, llvm::ArrayRef<int32_t> Args, int32_t &Val);
+
+public:
+    // Evaluates Tree for at most Budget steps and appends the values it writes
+    // to Writes. Returns the residual program, which is allocated in Arena and
+    // has no statements if the whole program was evaluated.
+    static AST *evaluate(Goal &Tree, uint64_t Budget, llvm::BumpPtrAllocator &Arena,
+                         std::vector<int32_t> &Writes, bool Checked = false);
+};
+
+#endif
@@ -0,0 +1,596 @@
+#include "RangeAnalysis.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+
+using namespace llvm;
+
+// Work limit of the analysis, in evaluated nodes and statements.
+static const uint64_t MaxSteps = 1 << 25;
+
+// Iterations of a loop after which growing bounds are widened to the limits
+// of int32, so that the iteration ends.
+static const unsigned WidenAfter = 2;
+
+static uint32_t magnitude(int64_t V) { return V < 0 ? uint32_t(-V) : uint32_t(V); }
+
+ValueRange ValueRange::constant(int32_t C)
+{
+    return {C, C, magnitude(C)};
+}
+
+ValueRange ValueRange::get(int64_t Lo, int64_t Hi, uint32_t Stride)
+{
+    // Wrapping around subtracts a multiple of 2^32, so only the power of two
+    // in the stride is kept.
+    if (Lo < INT32_MIN || Hi > INT32_MAX)
+        return {INT32_MIN, INT32_MAX, Stride & -Stride};
+    return {int32_t(Lo), int32_t(Hi), Lo == Hi ? magnitude(Lo) : Stride};
+}
+
+ValueRange ValueRange::join(const ValueRange &O) const
+{
+    return {std::min(Lo, O.Lo), std::max(Hi, O.Hi), uint32_t(GreatestCommonDivisor64(Stride, O.Stride))};
+}
+
+// Range of the quotients of L by the divisors [A, B], which have one sign.
+// Truncating division is monotonic in either operand while the other one
+// keeps its sign, so the bounds are quotients of the corners.
+static void quotients(const ValueRange &L, int64_t A, int64_t B, int64_t &Lo, int64_t &Hi)
+{
+    for (int64_t X : {int64_t(L.Lo), int64_t(L.Hi)})
+        for (int64_t D : {A, B})
+        {
+            Lo = std::min(Lo, X / D);
+            Hi = std::max(Hi, X / D);
+        }
+}
+
+ValueRange ValueRange::apply(BinaryOp::Operator Op, const ValueRange &L, const ValueRange &R,
+                             bool *Overflow)
+{
+    bool Ov = false;
+    ValueRange Res;
+    switch (Op)
+    {
+    case BinaryOp::Plus:
+    case BinaryOp::Minus:
+    {
+        bool IsPlus = Op == BinaryOp::Plus;
+        int64_t Lo = IsPlus ? int64_t(L.Lo) + R.Lo : int64_t(L.Lo) - R.Hi;
+        int64_t Hi = IsPlus ? int64_t(L.Hi) + R.Hi : int64_t(L.Hi) - R.Lo;
+        Ov = Lo < INT32_MIN || Hi > INT32_MAX;
+        Res = get(Lo, Hi, GreatestCommonDivisor64(L.Stride, R.Stride));
+        break;
+    }
+    case BinaryOp::Mul:
+    {
+        int64_t Lo = INT64_MAX, Hi = INT64_MIN;
+        for (int64_t X : {int64_t(L.Lo), int64_t(L.Hi)})
+            for (int64_t Y : {int64_t(R.Lo), int64_t(R.Hi)})
+            {
+                Lo = std::min(Lo, X * Y);
+                Hi = std::max(Hi, X * Y);
+            }
+        // A multiple of both strides is a multiple of their product.
+        uint64_t Stride = uint64_t(L.Stride) * R.Stride;
+        if (Stride > (uint64_t(1) << 31))
+            Stride = std::max(L.Stride, R.Stride);
+        Ov = Lo < INT32_MIN || Hi > INT32_MAX;
+        Res = get(Lo, Hi, Stride);
+        break;
+    }
+    case BinaryOp::Div:
+    {
+        // Division by zero traps, and so does INT_MIN / -1 on most targets.
+        Ov = R.contains(0) || (L.contains(INT32_MIN) && R.contains(-1));
+        int64_t Lo = INT64_MAX, Hi = INT64_MIN;
+        if (R.Lo < 0)
+            quotients(L, R.Lo, std::min<int64_t>(R.Hi, -1), Lo, Hi);
+        if (R.Hi > 0)
+            quotients(L, std::max<int64_t>(R.Lo, 1), R.Hi, Lo, Hi);
+        if (Lo <= Hi)
+            Res = get(Lo, Hi);
+        break;
+    }
+    case BinaryOp::Remain:
+    {
+        Ov = R.contains(0) || (L.contains(INT32_MIN) && R.contains(-1));
+        // The remainder has the sign of the dividend and is smaller than the
+        // divisor in magnitude; it is 0 if the divisor divides every dividend.
+        if (L.isMultipleOf(R))
+            Res = constant(0);
+        else if (R.Lo != 0 || R.Hi != 0)
+        {
+            int64_t Max = std::max(magnitude(R.Lo), magnitude(R.Hi)) - int64_t(1);
+            Res = get(std::max<int64_t>(std::min<int64_t>(L.Lo, 0), -Max),
+                      std::min<int64_t>(std::max<int64_t>(L.Hi, 0), Max));
+        }
+        break;
+    }
+    case BinaryOp::Power:
+        llvm_unreachable("powers are computed by power");
+    case BinaryOp::Equal_equal:
+    case BinaryOp::Not_equal:
+    {
+        bool Equal = L.isConstant() && R.isConstant() && L.Lo == R.Lo;
+        bool Disjoint = L.Hi < R.Lo || R.Hi < L.Lo;
+        Res = Equal || Disjoint ? constant((Op == BinaryOp::Equal_equal) == Equal) : get(0, 1);
+        break;
+    }
+    case BinaryOp::Less:
+        Res = L.Hi < R.Lo ? constant(1) : L.Lo >= R.Hi ? constant(0) : get(0, 1);
+        break;
+    case BinaryOp::Less_equal:
+        Res = L.Hi <= R.Lo ? constant(1) : L.Lo > R.Hi ? constant(0) : get(0, 1);
+        break;
+    case BinaryOp::More:
+        Res = L.Lo > R.Hi ? constant(1) : L.Hi <= R.Lo ? constant(0) : get(0, 1);
+        break;
+    case BinaryOp::More_equal:
+        Res = L.Lo >= R.Hi ? constant(1) : L.Hi < R.Lo ? constant(0) : get(0, 1);
+        break;
+    case BinaryOp::And:
+    case BinaryOp::Or:
+    {
+        bool IsAnd = Op == BinaryOp::And;
+        auto IsTrue = [](const ValueRange &V) { return !V.contains(0); };
+        auto IsFalse = [](const ValueRange &V) { return V.Lo == 0 && V.Hi == 0; };
+        if (IsAnd ? IsFalse(L) || IsFalse(R) : IsTrue(L) || IsTrue(R))
+            Res = constant(!IsAnd);
+        else if (IsAnd ? IsTrue(L) && IsTrue(R) : IsFalse(L) && IsFalse(R))
+            Res = constant(IsAnd);
+        else
+            Res = get(0, 1);
+        break;
+    }
+    }
+    if (Overflow)
+        *Overflow = Ov;
+    return Res;
+}
+
+ValueRange ValueRange::power(const ValueRange &L, int64_t Exp, bool *Overflow)
+{
+    if (Overflow)
+        *Overflow = false;
+    // Powers of -1, 0 and 1 stay in [-1, 1].
+    if (L.Lo >= -1 && L.Hi <= 1)
+        return Exp == 1 || L.Lo >= 0 ? L : get(-1, 1);
+    // Otherwise the magnitude grows, so the range is full after 31 factors.
+    ValueRange Res = L;
+    for (int64_t I = 1; I < Exp && !Res.isFull(); ++I)
+    {
+        bool Ov;
+        Res = apply(BinaryOp::Mul, Res, L, &Ov);
+        if (Overflow)
+            *Overflow |= Ov;
+    }
+    if (Overflow && Res.isFull() && Exp > 1)
+        *Overflow = true;
+    return Res;
+}
+
+bool RangeAnalysis::foldsToConstant(Expr *E)
+{
+    SmallVector<Expr *, 16> Stack{E};
+    while (!Stack.empty())
+    {
+        Expr *Node = Stack.pop_back_val();
+        if (auto *F = dyn_cast<Factor>(Node))
+        {
+            if (F->getKind() == Factor::Ident)
+                return false;
+            continue;
+        }
+        auto *Op = dyn_cast<BinaryOp>(Node);
+        if (!Op || Op->getOperator() == BinaryOp::And || Op->getOperator() == BinaryOp::Or)
+            return false;
+        Stack.push_back(Op->getLeft());
+        Stack.push_back(Op->getRight());
+    }
+    return true;
+}
+
+RangeAnalysis::Env RangeAnalysis::join(const Env &A, const Env &B)
+{
+    if (!A.Reachable)
+        return B;
+    if (!B.Reachable)
+        return A;
+    Env Res = A;
+    for (size_t I = 0; I < Res.Slots.size() && I < B.Slots.size(); ++I)
+        Res.Slots[I] = Res.Slots[I].join(B.Slots[I]);
+    return Res;
+}
+
+void RangeAnalysis::widen(const Env &Old, Env &New)
+{
+    if (!Old.Reachable || !New.Reachable)
+        return;
+    for (size_t I = 0; I < New.Slots.size() && I < Old.Slots.size(); ++I)
+    {
+        ValueRange &V = New.Slots[I];
+        const ValueRange &O = Old.Slots[I];
+        if (V.Lo < O.Lo)
+            V.Lo = INT32_MIN;
+        if (V.Hi > O.Hi)
+            V.Hi = INT32_MAX;
+        if (V.Stride != O.Stride)
+            V.Stride = 1;
+    }
+}
+
+ValueRange *RangeAnalysis::lookup(StringRef Var)
+{
+    auto I = Names.find(Var);
+    return I == Names.end() ? nullptr : &Cur.Slots[I->second];
+}
+
+// Expressions are evaluated from an explicit stack, like CodeGen lowers them,
+// so that deeply nested ones do not exhaust the native stack. Both operands of
+// and/or are evaluated, since either may run.
+ValueRange RangeAnalysis::eval(Expr &E, bool Record)
+{
+    if (!Cur.Reachable)
+        return {};
+    SmallVector<std::pair<Expr *, bool>, 32> Work{{&E, false}}; // node, operands done
+    SmallVector<ValueRange, 32> Values;
+    while (!Work.empty())
+    {
+        Expr *Node = Work.back().first;
+        bool Done = Work.back().second;
+        Work.pop_back();
+        ValueRange Res;
+        if (auto *F = dyn_cast<Factor>(Node))
+        {
+            ++Steps;
+            if (F->getKind() == Factor::Number)
+            {
+                // getRange knows the range of a literal.
+                Values.push_back(ValueRange::constant(F->getNumber()));
+                continue;
+            }
+            if (ValueRange *Var = lookup(F->getVal()))
+                Res = *Var;
+        }
+        else if (!Done)
+        {
+            Work.push_back({Node, true});
+            if (auto *C = dyn_cast<Call>(Node))
+            {
+                for (Expr *Arg : reverse(C->getArgs()))
+                    Work.push_back({Arg, false});
+                continue;
+            }
+            Work.push_back({cast<BinaryOp>(Node)->getRight(), false});
+            Work.push_back({cast<BinaryOp>(Node)->getLeft(), false});
+            continue;
+        }
+        else if (auto *C = dyn_cast<Call>(Node))
+        {
+            // Calls are not followed, so their result may be anything.
+            Values.resize(Values.size() - C->getArgs().size());
+        }
+        else
+        {
+            auto *Op = cast<BinaryOp>(Node);
+            ValueRange Right = Values.pop_back_val();
+            ValueRange Left = Values.pop_back_val();
+            if (Op->getOperator() != BinaryOp::Power)
+                Res = ValueRange::apply(Op->getOperator(), Left, Right);
+            else if (!foldsToConstant(Op->getRight()))
+                Res = Left; // CodeGen yields the base for an exponent it cannot fold
+            else if (Right.isConstant())
+                Res = Right.Lo == 0 ? ValueRange::constant(1) : Right.Lo < 0 ? Left : ValueRange::power(Left, Right.Lo);
+        }
+        if (Record)
+        {
+            auto Known = Ranges.try_emplace(Node, Res);
+            if (!Known.second)
+                Known.first->second = Known.first->second.join(Res);
+        }
+        Values.push_back(Res);
+    }
+    return Values.back();
+}
+
+static BinaryOp::Operator negate(BinaryOp::Operator Op)
+{
+    switch (Op)
+    {
+    case BinaryOp::Equal_equal:
+        return BinaryOp::Not_equal;
+    case BinaryOp::Not_equal:
+        return BinaryOp::Equal_equal;
+    case BinaryOp::Less:
+        return BinaryOp::More_equal;
+    case BinaryOp::More_equal:
+        return BinaryOp::Less;
+    case BinaryOp::More:
+        return BinaryOp::Less_equal;
+    case BinaryOp::Less_equal:
+        return BinaryOp::More;
+    default:
+        return Op;
+    }
+}
+
+// The comparison with its operands swapped: `a < b` is `b > a`.
+static BinaryOp::Operator swapOperands(BinaryOp::Operator Op)
+{
+    switch (Op)
+    {
+    case BinaryOp::Less:
+        return BinaryOp::More;
+    case BinaryOp::More:
+        return BinaryOp::Less;
+    case BinaryOp::Less_equal:
+        return BinaryOp::More_equal;
+    case BinaryOp::More_equal:
+        return BinaryOp::Less_equal;
+    default:
+        return Op;
+    }
+}
+
+static bool isComparison(BinaryOp::Operator Op)
+{
+    return Op == BinaryOp::Equal_equal || Op == BinaryOp::Not_equal || Op == BinaryOp::Less ||
+           Op == BinaryOp::Less_equal || Op == BinaryOp::More || Op == BinaryOp::More_equal;
+}
+
+// Narrows the ranges of the variables Guard compares to the values for which
+// it is Taken (true) or not. A guard that cannot hold makes Cur unreachable.
+void RangeAnalysis::refine(Expr &Guard, bool Taken)
+{
+    SmallVector<std::pair<Expr *, bool>, 8> Work{{&Guard, Taken}};
+    while (!Work.empty() && Cur.Reachable)
+    {
+        Expr *E = Work.back().first;
+        bool T = Work.back().second;
+        Work.pop_back();
+
+        // Conditions on a variable: the guard `Var Op Bound` has to hold.
+        auto Narrow = [&](Expr *VarExpr, BinaryOp::Operator Op, const ValueRange &Bound) {
+            auto *F = dyn_cast<Factor>(VarExpr);
+            ValueRange *Var = F && F->getKind() == Factor::Ident ? lookup(F->getVal()) : nullptr;
+            if (!Var)
+                return;
+            int64_t Lo = Var->Lo, Hi = Var->Hi;
+            switch (Op)
+            {
+            case BinaryOp::Less:
+                Hi = std::min<int64_t>(Hi, int64_t(Bound.Hi) - 1);
+                break;
+            case BinaryOp::Less_equal:
+                Hi = std::min<int64_t>(Hi, Bound.Hi);
+                break;
+            case BinaryOp::More:
+                Lo = std::max<int64_t>(Lo, int64_t(Bound.Lo) + 1);
+                break;
+            case BinaryOp::More_equal:
+                Lo = std::max<int64_t>(Lo, Bound.Lo);
+                break;
+            case BinaryOp::Equal_equal:
+                Lo = std::max<int64_t>(Lo, Bound.Lo);
+                Hi = std::min<int64_t>(Hi, Bound.Hi);
+                break;
+            case BinaryOp::Not_equal:
+                if (Bound.isConstant() && Lo == Bound.Lo)
+                    ++Lo;
+                if (Bound.isConstant() && Hi == Bound.Lo)
+                    --Hi;
+                break;
+            default:
+                break;
+            }
+            if (Lo > Hi)
+                Cur.Reachable = false;
+            else
+                *Var = {int32_t(Lo), int32_t(Hi), Lo == Hi ? magnitude(Lo) : Var->Stride};
+        };
+
+        if (auto *F = dyn_cast<Factor>(E))
+        {
+            if (F->getKind() == Factor::Number)
+                Cur.Reachable = T == (F->getNumber() != 0);
+            else
+                Narrow(F, T ? BinaryOp::Not_equal : BinaryOp::Equal_equal, ValueRange::constant(0));
+            continue;
+        }
+        auto *Op = dyn_cast<BinaryOp>(E);
+        if (!Op)
+            continue;
+        BinaryOp::Operator O = Op->getOperator();
+        if (O == BinaryOp::And || O == BinaryOp::Or)
+        {
+            // Both operands hold when `and` is taken, neither does when `or`
+            // is not; otherwise either one may be the deciding one.
+            if (T == (O == BinaryOp::And))
+            {
+                Work.push_back({Op->getRight(), T});
+                Work.push_back({Op->getLeft(), T});
+            }
+            continue;
+        }
+        if (!isComparison(O))
+            continue;
+        if (!T)
+            O = negate(O);
+        Narrow(Op->getLeft(), O, eval(*Op->getRight(), false));
+        if (Cur.Reachable)
+            Narrow(Op->getRight(), swapOperands(O), eval(*Op->getLeft(), false));
+    }
+}
+
+void RangeAnalysis::exec(Expr &Stmt)
+{
+    if (!Cur.Reachable || GaveUp)
+        return;
+    if (++Steps > MaxSteps)
+    {
+        GaveUp = true;
+        return;
+    }
+    switch (Stmt.getExprKind())
+    {
+    case Expr::EK_Assignment:
+    {
+        auto &Assign = cast<Assignment>(Stmt);
+        ValueRange Val = eval(*Assign.getRight());
+        if (ValueRange *Var = lookup(Assign.getLeft()->getVal()))
+            *Var = Val;
+        break;
+    }
+    case Expr::EK_Declaration:
+    {
+        // Like CodeGen, each variable is declared after its initializer runs.
+        auto &Dec = cast<Declaration>(Stmt);
+        auto Init = Dec.begin_values(), InitEnd = Dec.end_values();
+        for (StringRef Var : Dec)
+        {
+            ValueRange Val = ValueRange::constant(0);
+            if (Init != InitEnd)
+                Val = eval(**Init++);
+            auto Bound = Names.try_emplace(Var, Cur.Slots.size());
+            if (!BlockScopes.empty())
+                BlockScopes.back().push_back({Var, Bound.second ? -1 : int(Bound.first->second)});
+            Bound.first->second = Cur.Slots.size();
+            Cur.Slots.push_back(Val);
+        }
+        break;
+    }
+    case Expr::EK_Read:
+        for (StringRef Var : cast<Read>(Stmt))
+            if (ValueRange *V = lookup(Var))
+                *V = {};
+        break;
+    case Expr::EK_BE:
+    {
+        size_t NumSlots = Cur.Slots.size();
+        BlockScopes.emplace_back();
+        for (Expr *S : cast<BE>(Stmt))
+            exec(*S);
+        for (auto &Hidden : reverse(BlockScopes.back()))
+        {
+            if (Hidden.second < 0)
+                Names.erase(Hidden.first);
+            else
+                Names[Hidden.first] = Hidden.second;
+        }
+        BlockScopes.pop_back();
+        Cur.Slots.resize(NumSlots);
+        break;
+    }
+    case Expr::EK_Loop:
+    {
+        // Iterate until the ranges at the guard are a fixed point; the guard
+        // and body are then analyzed with them, so their ranges hold in every
+        // iteration.
+        auto &L = cast<Loop>(Stmt);
+        Env Entry = Cur;
+        bool Widened = false;
+        for (unsigned Iter = 0;; ++Iter)
+        {
+            Env Head = Cur;
+            eval(*L.getExpr());
+            refine(*L.getExpr(), true);
+            exec(*L.getBE());
+            Env Next = join(Head, Cur);
+            if (Iter >= WidenAfter)
+            {
+                widen(Head, Next);
+                Widened = true;
+            }
+            if (Next == Head || GaveUp)
+            {
+                Cur = std::move(Head);
+                break;
+            }
+            Cur = std::move(Next);
+        }
+        if (Widened && !GaveUp)
+        {
+            // Widening overshoots bounds the guard keeps, such as that of a
+            // counter; one more iteration from the fixed point narrows them.
+            refine(*L.getExpr(), true);
+            exec(*L.getBE());
+            Cur = join(Entry, Cur);
+        }
+        refine(*L.getExpr(), false);
+        break;
+    }
+    case Expr::EK_Condition:
+    {
+        auto &Cond = cast<Condition>(Stmt);
+        ArrayRef<Expr *> Guards = Cond.getAllExpresions();
+        ArrayRef<BE *> Bodies = Cond.getAllBes();
+        Env Out;
+        Out.Reachable = false;
+        for (size_t I = 0; I < Bodies.size(); ++I)
+        {
+            if (I == Guards.size())
+            {
+                // The else arm takes what no guard did.
+                exec(*Bodies[I]);
+                Out = join(Out, Cur);
+                Cur.Reachable = false;
+                break;
+            }
+            eval(*Guards[I]);
+            Env NotTaken = Cur;
+            refine(*Guards[I], true);
+            exec(*Bodies[I]);
+            Out = join(Out, Cur);
+            Cur = std::move(NotTaken);
+            refine(*Guards[I], false);
+        }
+        Cur = join(Out, Cur);
+        break;
+    }
+    case Expr::EK_FunctionDef:
+    {
+        // The body is analyzed once, on its own: the parameters may hold any
+        // value, and the top-level variables are not visible.
+        auto &Fn = cast<FunctionDef>(Stmt);
+        Env Caller = std::move(Cur);
+        StringMap<unsigned> CallerNames = std::move(Names);
+        auto CallerScopes = std::move(BlockScopes);
+        Cur = Env();
+        Names.clear();
+        BlockScopes.clear();
+        for (StringRef Param : Fn.getParams())
+        {
+            Names[Param] = Cur.Slots.size();
+            Cur.Slots.emplace_back();
+        }
+        exec(*Fn.getBody());
+        Cur = std::move(Caller);
+        Names = std::move(CallerNames);
+        BlockScopes = std::move(CallerScopes);
+        break;
+    }
+    case Expr::EK_Return:
+        eval(*cast<Return>(Stmt).getValue());
+        Cur.Reachable = false;
+        break;
+    default:
+        break;
+    }
+}
+
+void RangeAnalysis::run(AST *Tree)
+{
+    for (Expr *Stmt : *static_cast<Goal *>(Tree))
+        exec(*Stmt);
+    if (GaveUp)
+        Ranges.clear();
+}
+
+ValueRange RangeAnalysis::getRange(Expr *E) const
+{
+    auto *F = dyn_cast<Factor>(E);
+    if (F && F->getKind() == Factor::Number)
+        return ValueRange::constant(F->getNumber());
+    return Ranges.lookup(E);
+}
@@ -0,0 +1,94 @@
+#ifndef RANGEANALYSIS_H
+#define RANGEANALYSIS_H
+
+#include "AST.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include <cstdint>
+#include <vector>
+
+// The values an expression can take: the 32-bit integers in [Lo, Hi] that
+// are multiples of Stride (0 if the value is always 0).
+struct ValueRange
+{
+    int32_t Lo = INT32_MIN, Hi = INT32_MAX;
+    uint32_t Stride = 1;
+
+    static ValueRange constant(int32_t C);
+    // The range [Lo, Hi] of the exact result of an operation; a result that
+    // may not fit in 32 bits wraps around, so nothing is known about it.
+    static ValueRange get(int64_t Lo, int64_t Hi, uint32_t Stride = 1);
+
+    bool isFull() const { return Lo == INT32_MIN && Hi == INT32_MAX; }
+    bool contains(int64_t V) const { return Lo <= V && V <= Hi; }
+    bool isConstant() const { return Lo == Hi; }
+    bool operator==(const ValueRange &O) const { return Lo == O.Lo && Hi == O.Hi && Stride == O.Stride; }
+
+    ValueRange join(const ValueRange &O) const;
+    // Whether every value is divisible by the constant D.
+    bool isMultipleOf(const ValueRange &D) const
+    {
+        return D.isConstant() && D.Lo != 0 && Stride % uint32_t(D.Lo < 0 ? -int64_t(D.Lo) : D.Lo) == 0;
+    }
+
+    // The range of Op applied to L and R. Overflow is set if the exact result
+    // may not fit in 32 bits, or if a division may trap.
+    static ValueRange apply(BinaryOp::Operator Op, const ValueRange &L, const ValueRange &R,
+                            bool *Overflow = nullptr);
+    // The range of L * L * ... * L (Exp factors, Exp >= 1).
+    static ValueRange power(const ValueRange &L, int64_t Exp, bool *Overflow = nullptr);
+};
+
+// Interval analysis of a checked program. Every statement is run on ranges
+// instead of values: guards narrow the ranges of the variables they compare
+// in the arms and loop bodies they lead to, arms are joined where they meet,
+// and a loop is iterated until the ranges at its guard no longer change,
+// widening the bounds that keep growing. The range of every expression node
+// is kept, joined over all the places the node is evaluated. A function body
+// is analyzed once, for parameters of any value, and a call may return any
+// value.
+//
+// CodeGen uses the ranges to mark operations nuw or exact, to divide
+// unsigned and, with -checked-arith, to leave out the checks that cannot
+// fail.
+class RangeAnalysis
+{
+    struct Env
+    {
+        std::vector<ValueRange> Slots; // variables in declaration order, innermost last
+        bool Reachable = true;
+        bool operator==(const Env &O) const { return Reachable == O.Reachable && Slots == O.Slots; }
+    };
+
+    Env Cur;                         // ranges before the statement being analyzed
+    llvm::StringMap<unsigned> Names; // slot of each visible variable
+    // Variables declared by the enclosing blocks, with the slot each one
+    // hides, or -1; the names are restored when the block ends.
+    llvm::SmallVector<llvm::SmallVector<std::pair<llvm::StringRef, int>, 4>, 4> BlockScopes;
+    llvm::DenseMap<Expr *, ValueRange> Ranges;
+
+    // Nested loops are iterated once per iteration of the loops around them,
+    // so the work is limited; past the limit nothing is known.
+    uint64_t Steps = 0;
+    bool GaveUp = false;
+
+    static Env join(const Env &A, const Env &B);
+    static void widen(const Env &Old, Env &New);
+    ValueRange *lookup(llvm::StringRef Var);
+    ValueRange eval(Expr &E, bool Record = true);
+    void refine(Expr &Guard, bool Taken);
+    void exec(Expr &Stmt);
+
+public:
+    void run(AST *Tree);
+
+    // Range of E wherever it is evaluated; full if it was not analyzed.
+    ValueRange getRange(Expr *E) const;
+
+    // Whether CodeGen folds E to a constant: literals combined by operators
+    // other than and/or, which are lowered to a phi.
+    static bool foldsToConstant(Expr *E);
+};
+
+#endif
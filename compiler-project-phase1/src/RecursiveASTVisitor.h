@@ -0,0 +1,124 @@
+#ifndef RECURSIVEASTVISITOR_H
+#define RECURSIVEASTVISITOR_H
+
+#include "AST.h"
+
+// Statically dispatched alternative to ASTVisitor, for passes that are run on
+// every node of large trees. traverse() switches on the kind tag of the node
+// and calls the visit() hook of the derived pass (CRTP), so a node costs no
+// virtual call and the hooks can be inlined into the traversal.
+//
+// The default hooks visit the children of a node in source order. A pass
+// overrides the hooks it needs; one that overrides only some of them brings
+// the others into scope with "using RecursiveASTVisitor::visit;". The default
+// hooks recurse, so passes that walk deeply nested expressions override
+// visit(BinaryOp &) with an iterative walk; calls in arguments are nested no
+// deeper than Call::MaxDepth.
+template <typename Derived>
+class RecursiveASTVisitor
+{
+    Derived &getDerived() { return *static_cast<Derived *>(this); }
+
+public:
+    // Calls the hook of the concrete kind of Node.
+    void traverse(Expr &Node)
+    {
+        switch (Node.getExprKind())
+        {
+        case Expr::EK_Goal:
+            return getDerived().visit(llvm::cast<Goal>(Node));
+        case Expr::EK_Factor:
+            return getDerived().visit(llvm::cast<Factor>(Node));
+        case Expr::EK_BinaryOp:
+            return getDerived().visit(llvm::cast<BinaryOp>(Node));
+        case Expr::EK_Assignment:
+            return getDerived().visit(llvm::cast<Assignment>(Node));
+        case Expr::EK_Declaration:
+            return getDerived().visit(llvm::cast<Declaration>(Node));
+        case Expr::EK_BE:
+            return getDerived().visit(llvm::cast<BE>(Node));
+        case Expr::EK_Loop:
+            return getDerived().visit(llvm::cast<Loop>(Node));
+        case Expr::EK_Condition:
+            return getDerived().visit(llvm::cast<Condition>(Node));
+        case Expr::EK_Read:
+            return getDerived().visit(llvm::cast<Read>(Node));
+        case Expr::EK_FunctionDef:
+            return getDerived().visit(llvm::cast<FunctionDef>(Node));
+        case Expr::EK_Call:
+            return getDerived().visit(llvm::cast<Call>(Node));
+        case Expr::EK_Return:
+            return getDerived().visit(llvm::cast<Return>(Node));
+        }
+    }
+
+    void visit(Goal &Node)
+    {
+        for (Expr *Stmt : Node)
+            getDerived().traverse(*Stmt);
+    }
+
+    void visit(Factor &) {}
+
+    void visit(BinaryOp &Node)
+    {
+        if (Node.getLeft())
+            getDerived().traverse(*Node.getLeft());
+        if (Node.getRight())
+            getDerived().traverse(*Node.getRight());
+    }
+
+    void visit(Assignment &Node)
+    {
+        getDerived().traverse(*Node.getLeft());
+        if (Node.getRight())
+            getDerived().traverse(*Node.getRight());
+    }
+
+    void visit(Declaration &Node)
+    {
+        for (auto I = Node.begin_values(), E = Node.end_values(); I != E; ++I)
+            if (*I)
+                getDerived().traverse(**I);
+    }
+
+    void visit(BE &Node)
+    {
+        for (Expr *Stmt : Node)
+            getDerived().traverse(*Stmt);
+    }
+
+    void visit(Loop &Node)
+    {
+        getDerived().traverse(*Node.getExpr());
+        getDerived().traverse(*Node.getBE());
+    }
+
+    void visit(Condition &Node)
+    {
+        for (Expr *Guard : Node.getAllExpresions())
+            getDerived().traverse(*Guard);
+        for (BE *Body : Node.getAllBes())
+            getDerived().traverse(*Body);
+    }
+
+    void visit(Read &) {}
+
+    void visit(FunctionDef &Node)
+    {
+        getDerived().traverse(*Node.getBody());
+    }
+
+    void visit(Call &Node)
+    {
+        for (Expr *Arg : Node.getArgs())
+            getDerived().traverse(*Arg);
+    }
+
+    void visit(Return &Node)
+    {
+        getDerived().traverse(*Node.getValue());
+    }
+};
+
+#endif
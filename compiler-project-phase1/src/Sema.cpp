@@ -1,13 +1,20 @@
 #include "Sema.h"
+#include "RecursiveASTVisitor.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/raw_ostream.h"
 
 namespace
 {
-  class InputCheck : public ASTVisitor
+  class InputCheck : public RecursiveASTVisitor<InputCheck>
   {
-    llvm::StringSet<> Scope; // StringSet to store declared variables
+    llvm::StringSet<> &Scope; // StringSet to store declared variables
+    llvm::SmallVector<llvm::StringSet<>, 4> Blocks; // variables of the enclosing begin/end blocks, innermost last
+    Sema::FunctionTable &Functions; // functions defined so far
+    bool InFunction = false;        // whether a function body is being checked
     bool HasError;           // Flag to indicate if an error occurred
+    const Sema::DiagnosticHandler *Report; // receives the diagnostics, or null for stderr
 
     enum ErrorType
     {
@@ -18,80 +25,114 @@ namespace
     void error(ErrorType ET, llvm::StringRef V)
     {
       // Function to report errors
-      llvm::errs() << "Variable " << V << " is "
-                   << (ET == Twice ? "already" : "not")
-                   << " declared\n";
+      if (ET == Twice)
+        Sema::reportRedeclared(V, Report);
+      else
+        Sema::reportUndeclared(V, Report);
       HasError = true; // Set error flag to true
     }
 
+    // A variable is visible in the block that declares it and in the blocks
+    // nested in it; a block may declare a variable of an enclosing one again.
+    // Functions do not see the top-level variables.
+    bool isDeclared(llvm::StringRef V)
+    {
+      for (const llvm::StringSet<> &Block : Blocks)
+        if (Block.count(V))
+          return true;
+      return !InFunction && Scope.count(V);
+    }
+
   public:
-    InputCheck() : HasError(false) {} // Constructor
+    InputCheck(llvm::StringSet<> &Scope, Sema::FunctionTable &Functions,
+               const Sema::DiagnosticHandler *Report = nullptr)
+        : Scope(Scope), Functions(Functions), HasError(false), Report(Report) {} // Constructor
 
     bool hasError() { return HasError; } // Function to check if an error occurred
 
+    // Loops and conditions only need their children checked.
+    using RecursiveASTVisitor::visit;
+
+    // Every begin/end block opens a scope.
+    void visit(BE &Node)
+    {
+      Blocks.emplace_back();
+      RecursiveASTVisitor::visit(Node);
+      Blocks.pop_back();
+    }
+
     // Visit function for Goal nodes
-    virtual void visit(Goal &Node) override
+    void visit(Goal &Node)
     {
       for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
       {
-        (*I)->accept(*this); // Visit each child node
+        traverse(**I); // Visit each child node
       }
     };
 
     // Visit function for Factor nodes
-    virtual void visit(Factor &Node) override
+    void visit(Factor &Node)
     {
       if (Node.getKind() == Factor::Ident)
       {
         // Check if identifier is in the scope
-        if (Scope.find(Node.getVal()) == Scope.end())
+        if (!isDeclared(Node.getVal()))
           error(Not, Node.getVal());
       }
     };
 
-    // Visit function for BinaryOp nodes
-    virtual void visit(BinaryOp &Node) override
+    // Reports a division by a literal zero.
+    void checkDivision(BinaryOp &Node)
     {
-      if (Node.getLeft())
-        Node.getLeft()->accept(*this);
-      else
-        HasError = true;
-
-      auto right = Node.getRight();
-      if (right)
-        right->accept(*this);
-      else
+      if (Node.getOperator() != BinaryOp::Operator::Div)
+        return;
+      // Only a literal divisor is known here; any other one is a BinaryOp or
+      // an identifier.
+      auto *f = llvm::dyn_cast_or_null<Factor>(Node.getRight());
+      if (f && f->getKind() == Factor::ValueKind::Number && f->getNumber() == 0)
+      {
+        Sema::reportDivisionByZero(f->getLocation(), Report);
         HasError = true;
+      }
+    }
 
-      if (Node.getOperator() == BinaryOp::Operator::Div && right)
+    // Visit function for BinaryOp nodes. The operands are walked with an
+    // explicit stack instead of recursion, so deep nesting cannot exhaust the
+    // stack; the order of a recursive walk is kept, left operand first and the
+    // division check after both operands.
+    void visit(BinaryOp &Node)
+    {
+      llvm::SmallVector<std::pair<Expr *, bool>, 32> Stack; // node, operands done
+      Stack.push_back({&Node, false});
+      while (!Stack.empty())
       {
-        Factor *f = (Factor *)right;
-
-        if (right && f->getKind() == Factor::ValueKind::Number)
+        std::pair<Expr *, bool> Item = Stack.pop_back_val();
+        auto *Op = llvm::dyn_cast<BinaryOp>(Item.first);
+        if (!Op)
+          traverse(*Item.first);
+        else if (Item.second)
+          checkDivision(*Op);
+        else
         {
-          int intval;
-          f->getVal().getAsInteger(10, intval);
-
-          if (intval == 0)
+          Stack.push_back({Op, true});
+          for (Expr *Operand : {Op->getRight(), Op->getLeft()})
           {
-            llvm::errs() << "Division by zero is not allowed."
-                         << "\n";
-            HasError = true;
+            if (Operand)
+              Stack.push_back({Operand, false});
+            else
+              HasError = true;
           }
         }
       }
     };
 
-    virtual void visit(Condition &node) override{}
-    virtual void visit(Loop &node) override{}
-    virtual void visit(BE &node) override{}
-
     // Visit function for Assignment nodes
-    virtual void visit(Assignment &Node) override
+    void visit(Assignment &Node)
     {
       Factor *dest = Node.getLeft();
 
-      dest->accept(*this);
+      // Visiting the destination checks that it is declared.
+      traverse(*dest);
 
       if (dest->getKind() == Factor::Number)
       {
@@ -99,31 +140,314 @@ namespace
         HasError = true;
       }
 
-    if (dest->getKind() == Factor::Ident)
+      if (Node.getRight())
+        traverse(*Node.getRight());
+    };
+
+    // Visit function for Read nodes
+    void visit(Read &Node)
     {
-      // Check if the identifier is in the scope
-      if (Scope.find(dest->getVal()) == Scope.end())
-        error(Not, dest->getVal());
+      // The result of a function only depends on its arguments.
+      if (InFunction)
+      {
+        Sema::reportReadInFunction(Node.getLocation(), Report);
+        HasError = true;
+      }
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      {
+        if (!isDeclared(*I))
+          error(Not, *I); // Only declared variables can be read into
+      }
+    };
+
+    // A function is visible from its own body on, so it may call itself. Its
+    // parameters belong to the block of the body, which cannot declare them
+    // again.
+    void visit(FunctionDef &Node)
+    {
+      if (!Functions.try_emplace(Node.getName(), Node.getParams().size()).second)
+      {
+        Sema::reportRedefinedFunction(Node.getName(), Report);
+        HasError = true;
+      }
+      InFunction = true;
+      Blocks.emplace_back();
+      for (llvm::StringRef Param : Node.getParams())
+        if (!Blocks.back().insert(Param).second)
+          error(Twice, Param);
+      for (Expr *Stmt : *Node.getBody())
+        traverse(*Stmt);
+      Blocks.pop_back();
+      InFunction = false;
     }
 
-      if (Node.getRight())
-        Node.getRight()->accept(*this);
-    };
+    void visit(Call &Node)
+    {
+      auto F = Functions.find(Node.getName());
+      if (F == Functions.end())
+      {
+        Sema::reportUndefinedFunction(Node.getName(), Report);
+        HasError = true;
+      }
+      else if (F->second != Node.getArgs().size())
+      {
+        Sema::reportArgumentCount(Node.getName(), F->second, Report);
+        HasError = true;
+      }
+      for (Expr *Arg : Node.getArgs())
+        traverse(*Arg);
+    }
 
-    virtual void visit(Declaration &Node) override
+    void visit(Return &Node)
     {
+      if (!InFunction)
+      {
+        Sema::reportReturnOutsideFunction(Node.getLocation(), Report);
+        HasError = true;
+      }
+      traverse(*Node.getValue());
+    }
+
+    void visit(Declaration &Node)
+    {
+      // Like CodeGen, each variable is declared right after its initializer
+      // is checked, so an initializer reads the variables before it, and a
+      // variable of an outer scope that the new one hides.
+      auto value_I = Node.begin_values(), value_E = Node.end_values();
       for (auto I = Node.begin(), E = Node.end(); I != E;
            ++I)
       {
-        if (!Scope.insert(*I).second)
+        if (value_I != value_E)
+          if (Expr *Value = *value_I++)
+            traverse(*Value); // If the variable has an initializer, recursively visit the expression node
+        if (!(Blocks.empty() ? Scope : Blocks.back()).insert(*I).second)
           error(Twice, *I); // If the insertion fails (element already exists in Scope), report a "Twice" error
       }
+    };
+  };
 
-      for(auto value_I = Node.begin_values(), value_E = Node.end_values(); value_I != value_E; ++value_I){
-        if (*value_I)
-          (*value_I)->accept(*this); // If the Declaration node has an expression, recursively visit the expression node
-      }
+  // InputCheck over a FlatAST. Variables are tracked by identifier id, and the
+  // expressions of a statement are checked by scanning their range in order.
+  class FlatInputCheck
+  {
+    const FlatAST &Flat;
+    llvm::BitVector Declared; // Identifier ids of the visible variables
+    bool HasError;            // Flag to indicate if an error occurred
+
+    // Variables declared in the enclosing blocks, innermost last, with
+    // whether they hide a variable of an outer scope.
+    llvm::SmallVector<std::pair<FlatAST::Index, bool>, 16> BlockVars;
+    unsigned BlockStart = 0; // first variable of the innermost block
+    unsigned Depth = 0;      // blocks around the current statement
+
+    std::vector<int> NumParams; // of each function by identifier id, -1 if it is not defined
+    bool InFunction = false;    // whether a function body is being checked
+
+    enum ErrorType
+    {
+      Twice,
+      Not
     };
+
+    void error(ErrorType ET, FlatAST::Index Id)
+    {
+      if (ET == Twice)
+        Sema::reportRedeclared(Flat.Idents[Id]);
+      else
+        Sema::reportUndeclared(Flat.Idents[Id]);
+      HasError = true;
+    }
+
+    void checkExprs(FlatAST::Index First, FlatAST::Index End)
+    {
+      for (FlatAST::Index I = First; I != End; ++I)
+      {
+        const FlatAST::ExprNode &N = Flat.Exprs[I];
+        if (N.K == FlatAST::ExprNode::Ident)
+        {
+          if (!Declared.test(N.LHS))
+            error(Not, N.LHS);
+        }
+        else if (N.K == FlatAST::ExprNode::Binary && N.Op == BinaryOp::Div)
+        {
+          const FlatAST::ExprNode &Divisor = Flat.Exprs[N.RHS];
+          if (Divisor.K == FlatAST::ExprNode::Number && Flat.Literals[Divisor.LHS] == 0)
+          {
+            Sema::reportDivisionByZero();
+            HasError = true;
+          }
+        }
+        else if (N.K == FlatAST::ExprNode::Call)
+        {
+          if (NumParams[N.LHS] < 0)
+          {
+            Sema::reportUndefinedFunction(Flat.Idents[N.LHS]);
+            HasError = true;
+          }
+          else if (unsigned(NumParams[N.LHS]) != Flat.Refs[N.RHS])
+          {
+            Sema::reportArgumentCount(Flat.Idents[N.LHS], NumParams[N.LHS]);
+            HasError = true;
+          }
+        }
+      }
+    }
+
+    void declare(FlatAST::Index Id)
+    {
+      if (!Depth)
+      {
+        if (Declared.test(Id))
+          error(Twice, Id);
+        Declared.set(Id);
+        return;
+      }
+      for (FlatAST::Index I = BlockStart, E = BlockVars.size(); I != E; ++I)
+        if (BlockVars[I].first == Id)
+        {
+          error(Twice, Id);
+          return;
+        }
+      BlockVars.push_back({Id, Declared.test(Id)});
+      Declared.set(Id);
+    }
+
+    // Checks the statements of a block, whose variables are only visible in
+    // it; a block may declare a variable of an enclosing scope again.
+    void checkBlock(const FlatAST::BENode &Body)
+    {
+      unsigned SavedStart = BlockStart;
+      BlockStart = BlockVars.size();
+      ++Depth;
+      for (FlatAST::Index I = Body.FirstStmt, E = Body.FirstStmt + Body.NumStmts; I != E; ++I)
+        checkStmt(Flat.BlockStmts[I]);
+      --Depth;
+      while (BlockVars.size() > BlockStart)
+      {
+        std::pair<FlatAST::Index, bool> Var = BlockVars.pop_back_val();
+        if (!Var.second)
+          Declared.reset(Var.first);
+      }
+      BlockStart = SavedStart;
+    }
+
+    void checkStmt(const FlatAST::StmtNode &S)
+    {
+      switch (S.Kind)
+      {
+      case Expr::EK_Declaration:
+      {
+        // The initializers follow each other in Exprs, each one ending with
+        // its root.
+        const FlatAST::DeclNode &D = Flat.Decls[S.Node];
+        FlatAST::Index Next = S.FirstExpr;
+        for (FlatAST::Index I = 0; I != D.NumVars; ++I)
+        {
+          if (I < D.NumInits)
+          {
+            FlatAST::Index End = Flat.Refs[D.FirstInit + I] + 1;
+            checkExprs(Next, End);
+            Next = End;
+          }
+          declare(Flat.Refs[D.FirstVar + I]);
+        }
+        break;
+      }
+      case Expr::EK_Assignment:
+        if (!Declared.test(Flat.Assigns[S.Node].Var))
+          error(Not, Flat.Assigns[S.Node].Var);
+        checkExprs(S.FirstExpr, S.EndExpr);
+        break;
+      case Expr::EK_Read:
+      {
+        if (InFunction)
+        {
+          Sema::reportReadInFunction(S.Loc);
+          HasError = true;
+        }
+        const FlatAST::ReadNode &R = Flat.Reads[S.Node];
+        for (FlatAST::Index I = R.FirstVar, E = R.FirstVar + R.NumVars; I != E; ++I)
+          if (!Declared.test(Flat.Refs[I]))
+            error(Not, Flat.Refs[I]);
+        break;
+      }
+      case Expr::EK_Loop:
+      {
+        // The guard comes first in Exprs, the statements of the body own
+        // the ranges after it.
+        const FlatAST::LoopNode &L = Flat.Loops[S.Node];
+        checkExprs(S.FirstExpr, L.Cond + 1);
+        checkBlock(Flat.BEs[L.Body]);
+        break;
+      }
+      case Expr::EK_Condition:
+      {
+        // All guards come first in Exprs, then the bodies.
+        const FlatAST::CondNode &C = Flat.Conds[S.Node];
+        if (C.NumGuards)
+          checkExprs(S.FirstExpr, Flat.Refs[C.FirstGuard + C.NumGuards - 1] + 1);
+        for (FlatAST::Index I = C.FirstBody, E = C.FirstBody + C.NumBodies; I != E; ++I)
+          checkBlock(Flat.BEs[Flat.Refs[I]]);
+        break;
+      }
+      case Expr::EK_FunctionDef:
+        checkFunction(Flat.Funcs[S.Node]);
+        break;
+      case Expr::EK_Return:
+        if (!InFunction)
+        {
+          Sema::reportReturnOutsideFunction(S.Loc);
+          HasError = true;
+        }
+        checkExprs(S.FirstExpr, S.EndExpr);
+        break;
+      default:
+        break;
+      }
+    }
+
+    // Checks a function against its parameters, which belong to the block of
+    // the body, and the functions defined before it; the top-level variables
+    // are hidden meanwhile.
+    void checkFunction(const FlatAST::FuncNode &F)
+    {
+      if (NumParams[F.Name] >= 0)
+      {
+        Sema::reportRedefinedFunction(Flat.Idents[F.Name]);
+        HasError = true;
+      }
+      else
+        NumParams[F.Name] = F.NumParams;
+
+      llvm::BitVector TopLevel(Flat.Idents.size());
+      std::swap(TopLevel, Declared);
+      InFunction = true;
+      unsigned SavedStart = BlockStart;
+      BlockStart = BlockVars.size();
+      ++Depth;
+      for (FlatAST::Index I = F.FirstParam, E = F.FirstParam + F.NumParams; I != E; ++I)
+        declare(Flat.Refs[I]);
+      const FlatAST::BENode &Body = Flat.BEs[F.Body];
+      for (FlatAST::Index I = Body.FirstStmt, E = Body.FirstStmt + Body.NumStmts; I != E; ++I)
+        checkStmt(Flat.BlockStmts[I]);
+      --Depth;
+      BlockVars.resize(BlockStart);
+      BlockStart = SavedStart;
+      InFunction = false;
+      std::swap(TopLevel, Declared);
+    }
+
+  public:
+    FlatInputCheck(const FlatAST &Flat)
+        : Flat(Flat), Declared(Flat.Idents.size()), HasError(false), NumParams(Flat.Idents.size(), -1) {}
+
+    bool hasError() { return HasError; }
+
+    void run()
+    {
+      for (const FlatAST::StmtNode &S : Flat.Stmts)
+        checkStmt(S);
+    }
   };
 }
 
@@ -132,8 +456,83 @@ bool Sema::semantic(AST *Tree)
   if (!Tree)
     return false; // If the input AST is not valid, return false indicating no errors
 
-  InputCheck Check;    // Create an instance of the InputCheck class for semantic analysis
-  Tree->accept(Check); // Initiate the semantic analysis by traversing the AST using the accept function
+  llvm::StringSet<> Scope;
+  FunctionTable Functions;
+  InputCheck Check(Scope, Functions); // Create an instance of the InputCheck class for semantic analysis
+  Check.traverse(*static_cast<Expr *>(Tree)); // Initiate the semantic analysis by traversing the AST
 
   return Check.hasError(); // Return the result of Check.hasError() indicating if any errors were detected during the analysis
 }
+
+
+bool Sema::semanticStatement(Expr *Stmt)
+{
+  InputCheck Check(StreamScope, StreamFunctions);
+  Check.traverse(*Stmt);
+  return Check.hasError();
+}
+
+bool Sema::semanticStatements(llvm::ArrayRef<Expr *> Stmts, llvm::StringSet<> &Scope,
+                              FunctionTable &Functions, const DiagnosticHandler &Report)
+{
+  InputCheck Check(Scope, Functions, &Report);
+  for (Expr *Stmt : Stmts)
+    Check.traverse(*Stmt);
+  return Check.hasError();
+}
+
+bool Sema::semantic(const FlatAST &Flat)
+{
+  FlatInputCheck Check(Flat);
+  Check.run();
+  return Check.hasError();
+}
+
+static void report(const Sema::DiagnosticHandler *Report, llvm::SMLoc Loc, const llvm::Twine &Message)
+{
+  if (Report)
+    (*Report)(Loc, Message.str());
+  else
+    llvm::errs() << Message << "\n";
+}
+
+void Sema::reportUndeclared(llvm::StringRef Var, const DiagnosticHandler *Report)
+{
+  report(Report, llvm::SMLoc::getFromPointer(Var.data()), "Variable " + Var + " is not declared");
+}
+
+void Sema::reportRedeclared(llvm::StringRef Var, const DiagnosticHandler *Report)
+{
+  report(Report, llvm::SMLoc::getFromPointer(Var.data()), "Variable " + Var + " is already declared");
+}
+
+void Sema::reportDivisionByZero(llvm::SMLoc Loc, const DiagnosticHandler *Report)
+{
+  report(Report, Loc, "Division by zero is not allowed.");
+}
+
+void Sema::reportUndefinedFunction(llvm::StringRef Name, const DiagnosticHandler *Report)
+{
+  report(Report, llvm::SMLoc::getFromPointer(Name.data()), "Function " + Name + " is not defined");
+}
+
+void Sema::reportRedefinedFunction(llvm::StringRef Name, const DiagnosticHandler *Report)
+{
+  report(Report, llvm::SMLoc::getFromPointer(Name.data()), "Function " + Name + " is already defined");
+}
+
+void Sema::reportArgumentCount(llvm::StringRef Name, unsigned NumParams, const DiagnosticHandler *Report)
+{
+  report(Report, llvm::SMLoc::getFromPointer(Name.data()),
+         "Function " + Name + " takes " + llvm::Twine(NumParams) + (NumParams == 1 ? " argument" : " arguments"));
+}
+
+void Sema::reportReturnOutsideFunction(llvm::SMLoc Loc, const DiagnosticHandler *Report)
+{
+  report(Report, Loc, "return is only allowed in a function");
+}
+
+void Sema::reportReadInFunction(llvm::SMLoc Loc, const DiagnosticHandler *Report)
+{
+  report(Report, Loc, "Functions cannot read input");
+}
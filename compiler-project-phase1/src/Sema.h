@@ -2,11 +2,55 @@
 #define SEMA_H
 
 #include "AST.h"
+#include "FlatAST.h"
 #include "Lexer.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include <functional>
+#include <string>
 
 class Sema {
 public:
+  // Functions defined so far, with the number of parameters of each.
+  using FunctionTable = llvm::StringMap<unsigned>;
+
+private:
+  llvm::StringSet<> StreamScope; // variables declared by earlier statements
+  FunctionTable StreamFunctions; // functions defined by earlier statements
+
+public:
+  // Receives a diagnostic instead of stderr, with the location in the
+  // source of the name or operand it is about.
+  using DiagnosticHandler = std::function<void(llvm::SMLoc Loc, const std::string &Message)>;
+
   bool semantic(AST *Tree);
+
+  // Checks one top-level statement against the declarations and functions of
+  // the statements checked before it.
+  bool semanticStatement(Expr *Stmt);
+
+  // Same checks as above, as a linear walk over the flat representation.
+  bool semantic(const FlatAST &Flat);
+
+  // Checks top-level statements against the variables in Scope and the
+  // functions in Functions, which gain the ones they declare, and passes
+  // every diagnostic to Report.
+  static bool semanticStatements(llvm::ArrayRef<Expr *> Stmts, llvm::StringSet<> &Scope,
+                                 FunctionTable &Functions, const DiagnosticHandler &Report);
+
+  // Diagnostics of the checks, shared with the fused checks of CodeGen. Var
+  // points into the source, so that Report gets its location.
+  static void reportUndeclared(llvm::StringRef Var, const DiagnosticHandler *Report = nullptr);
+  static void reportRedeclared(llvm::StringRef Var, const DiagnosticHandler *Report = nullptr);
+  static void reportDivisionByZero(llvm::SMLoc Loc = llvm::SMLoc(),
+                                   const DiagnosticHandler *Report = nullptr);
+  static void reportUndefinedFunction(llvm::StringRef Name, const DiagnosticHandler *Report = nullptr);
+  static void reportRedefinedFunction(llvm::StringRef Name, const DiagnosticHandler *Report = nullptr);
+  static void reportArgumentCount(llvm::StringRef Name, unsigned NumParams,
+                                  const DiagnosticHandler *Report = nullptr);
+  static void reportReturnOutsideFunction(llvm::SMLoc Loc = llvm::SMLoc(),
+                                          const DiagnosticHandler *Report = nullptr);
+  static void reportReadInFunction(llvm::SMLoc Loc = llvm::SMLoc(), const DiagnosticHandler *Report = nullptr);
 };
 
 #endif
\ No newline at end of file
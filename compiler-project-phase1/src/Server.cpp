@@ -0,0 +1,226 @@
+#include "Server.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace gsmserver;
+
+namespace
+{
+  volatile sig_atomic_t StopRequested = 0;
+
+  void onStopSignal(int) { StopRequested = 1; }
+
+  // The connection of the request a worker is handling, and the response it
+  // gets when the request times out.
+  volatile sig_atomic_t TimedConn = -1;
+  std::string TimeoutResponse;
+
+  // Answers the request, then kills the worker and the program it may be
+  // running, which share a process group; the server starts a new worker.
+  // Only async-signal-safe calls are made.
+  void onRequestTimeout(int)
+  {
+    if (TimedConn >= 0)
+      writeAll(TimedConn, TimeoutResponse.data(), TimeoutResponse.size());
+    kill(0, SIGKILL);
+  }
+
+  void sendError(int Conn, const std::string &Message)
+  {
+    int32_t Code = 1;
+    writeAll(Conn, &Code, sizeof(Code)) && writeString(Conn, "") && writeString(Conn, Message);
+  }
+
+  // Reads what was written to FD since the last call and empties the file.
+  std::string takeCaptured(int FD)
+  {
+    std::string Data;
+    struct stat St;
+    if (fstat(FD, &St) == 0 && St.st_size > 0)
+    {
+      Data.resize(St.st_size);
+      ssize_t N = pread(FD, &Data[0], Data.size(), 0);
+      Data.resize(N > 0 ? N : 0);
+    }
+    if (ftruncate(FD, 0) != 0 || lseek(FD, 0, SEEK_SET) != 0)
+      Data += "\ngsm: cannot reset the output capture\n";
+    return Data;
+  }
+
+  // Runs one request with stdout and stderr redirected into the capture
+  // files, then sends the exit code and the captured output back.
+  void serveConnection(int Conn, int OutFD, int ErrFD, RequestHandler Handle)
+  {
+    std::vector<std::string> Request;
+    if (!readStrings(Conn, Request, MaxRequestStrings, MaxRequestBytes) || Request.empty())
+    {
+      sendError(Conn, "gsm: the request is malformed or exceeds the limits of the server\n");
+      return;
+    }
+
+    llvm::outs().flush();
+    fflush(stdout);
+    int SavedOut = dup(STDOUT_FILENO), SavedErr = dup(STDERR_FILENO);
+    dup2(OutFD, STDOUT_FILENO);
+    dup2(ErrFD, STDERR_FILENO);
+
+    int ExitCode = 1;
+    if (chdir(Request[0].c_str()) != 0)
+      llvm::errs() << "Cannot change to " << Request[0] << ": " << strerror(errno) << "\n";
+    else
+    {
+      std::vector<const char *> Argv = {"gsm"};
+      for (size_t I = 1, E = Request.size(); I != E; ++I)
+        Argv.push_back(Request[I].c_str());
+      ExitCode = Handle(Argv.size(), Argv.data());
+    }
+
+    llvm::outs().flush();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(SavedOut, STDOUT_FILENO);
+    dup2(SavedErr, STDERR_FILENO);
+    close(SavedOut);
+    close(SavedErr);
+
+    int32_t Code = ExitCode;
+    writeAll(Conn, &Code, sizeof(Code)) && writeString(Conn, takeCaptured(OutFD)) &&
+        writeString(Conn, takeCaptured(ErrFD));
+  }
+
+  [[noreturn]] void workerLoop(int Listen, unsigned TimeoutSeconds, RequestHandler Handle)
+  {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    // The worker leads a process group, so that a timeout also kills the
+    // program it runs for -run.
+    setpgid(0, 0);
+    if (TimeoutSeconds)
+    {
+      std::string Message =
+          "gsm: the request took longer than " + std::to_string(TimeoutSeconds) + " seconds\n";
+      int32_t Code = 124;
+      uint32_t Empty = 0, Len = Message.size();
+      TimeoutResponse.append(reinterpret_cast<char *>(&Code), sizeof(Code));
+      TimeoutResponse.append(reinterpret_cast<char *>(&Empty), sizeof(Empty));
+      TimeoutResponse.append(reinterpret_cast<char *>(&Len), sizeof(Len));
+      TimeoutResponse += Message;
+      signal(SIGALRM, onRequestTimeout);
+    }
+
+    // Programs run for a request take their input from arguments or files.
+    int Null = open("/dev/null", O_RDONLY);
+    if (Null >= 0)
+    {
+      dup2(Null, STDIN_FILENO);
+      close(Null);
+    }
+
+    FILE *Out = tmpfile(), *Err = tmpfile();
+    if (!Out || !Err)
+    {
+      llvm::errs() << "gsm: cannot create the output capture files\n";
+      _exit(1);
+    }
+
+    for (;;)
+    {
+      int Conn = accept(Listen, nullptr, nullptr);
+      if (Conn < 0)
+      {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        llvm::errs() << "gsm: accept failed: " << strerror(errno) << "\n";
+        _exit(1);
+      }
+      if (!isPeerSameUser(Conn))
+      {
+        llvm::errs() << "gsm: refused a connection of another user\n";
+        close(Conn);
+        continue;
+      }
+      TimedConn = Conn;
+      alarm(TimeoutSeconds);
+      serveConnection(Conn, fileno(Out), fileno(Err), Handle);
+      alarm(0);
+      TimedConn = -1;
+      close(Conn);
+    }
+  }
+
+  pid_t spawnWorker(int Listen, unsigned TimeoutSeconds, RequestHandler Handle)
+  {
+    llvm::outs().flush();
+    pid_t Pid = fork();
+    if (Pid == 0)
+      workerLoop(Listen, TimeoutSeconds, Handle);
+    if (Pid > 0)
+      setpgid(Pid, Pid); // as the worker does, whichever runs first
+    return Pid;
+  }
+}
+
+int gsmserver::runServer(const std::string &SocketPath, unsigned Workers, unsigned TimeoutSeconds,
+                         RequestHandler Handle)
+{
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Addr.sun_path))
+  {
+    llvm::errs() << "Socket path " << SocketPath << " is too long\n";
+    return 1;
+  }
+  memcpy(Addr.sun_path, SocketPath.c_str(), SocketPath.size() + 1);
+
+  int Listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(SocketPath.c_str());
+  if (Listen < 0 || bind(Listen, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0 ||
+      chmod(SocketPath.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(Listen, SOMAXCONN) != 0)
+  {
+    llvm::errs() << "Cannot listen on " << SocketPath << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  // No SA_RESTART, so that wait() returns once a stop signal arrived.
+  struct sigaction SA = {};
+  SA.sa_handler = onStopSignal;
+  sigaction(SIGINT, &SA, nullptr);
+  sigaction(SIGTERM, &SA, nullptr);
+
+  std::vector<pid_t> Pids;
+  for (unsigned I = 0; I != Workers; ++I)
+    Pids.push_back(spawnWorker(Listen, TimeoutSeconds, Handle));
+  llvm::errs() << "gsm: serving on " << SocketPath << " with " << Workers << " workers\n";
+
+  // A worker that died, e.g. on a crash while compiling, is replaced.
+  while (!StopRequested)
+  {
+    int Status;
+    pid_t Pid = wait(&Status);
+    if (Pid < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (pid_t &P : Pids)
+      if (P == Pid && !StopRequested)
+        P = spawnWorker(Listen, TimeoutSeconds, Handle);
+  }
+
+  for (pid_t P : Pids)
+    kill(-P, SIGTERM);
+  while (wait(nullptr) > 0 || errno == EINTR)
+    ;
+  close(Listen);
+  unlink(SocketPath.c_str());
+  return 0;
+}
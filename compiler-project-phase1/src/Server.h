@@ -0,0 +1,147 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Compile server. `gsm --serve` listens on a Unix domain socket and a pool of
+// pre-forked workers accepts connections. Each worker keeps the LLVM state of
+// the server warm (options, targets, target machines) and handles one request
+// at a time, so requests run concurrently across workers.
+//
+// Protocol, one request per connection, all integers in host byte order:
+//   request:  u32 N, then N strings (u32 length, bytes):
+//             the working directory of the client, then the gsm arguments
+//   response: i32 exit code, then the captured stdout and stderr as strings
+//
+// Server and client only talk to processes of their own user, a request may
+// not exceed the limits below, and a request that takes longer than the
+// timeout of the server is killed along with the program it runs.
+//
+// This header only depends on POSIX, so that the client does not have to link
+// LLVM and keeps a short startup time.
+namespace gsmserver
+{
+    // Handles one request; argv[0] is the program name.
+    using RequestHandler = int (*)(int Argc, const char **Argv);
+
+    // Limits of a request: the arguments of a command line, and their size.
+    // A program given on the command line is one of the strings, so this is
+    // also the largest program the client can pass without -input-file.
+    const uint32_t MaxRequestStrings = 1u << 16;
+    const uint32_t MaxRequestBytes = 64u << 20;
+
+    // Socket used when neither side names one: $GSM_SOCKET, or a path in the
+    // private $XDG_RUNTIME_DIR, or else in /tmp.
+    inline std::string getDefaultSocketPath()
+    {
+        if (const char *Env = getenv("GSM_SOCKET"))
+            return Env;
+        if (const char *Dir = getenv("XDG_RUNTIME_DIR"))
+            if (*Dir)
+                return std::string(Dir) + "/gsm.sock";
+        return "/tmp/gsm-" + std::to_string(getuid()) + ".sock";
+    }
+
+    // Whether the process at the other end of Conn runs as the same user as
+    // this one. Both sides check it: a path in /tmp can be taken by anyone.
+    inline bool isPeerSameUser(int Conn)
+    {
+#ifdef SO_PEERCRED
+        struct ucred Cred;
+        socklen_t Len = sizeof(Cred);
+        if (getsockopt(Conn, SOL_SOCKET, SO_PEERCRED, &Cred, &Len) != 0)
+            return false;
+        uid_t UID = Cred.uid;
+#else
+        uid_t UID;
+        gid_t GID;
+        if (getpeereid(Conn, &UID, &GID) != 0)
+            return false;
+#endif
+        return UID == getuid();
+    }
+
+    inline bool writeAll(int FD, const void *Data, size_t Size)
+    {
+        const char *P = static_cast<const char *>(Data);
+        while (Size)
+        {
+            ssize_t N = send(FD, P, Size, MSG_NOSIGNAL);
+            if (N <= 0)
+                return false;
+            P += N;
+            Size -= N;
+        }
+        return true;
+    }
+
+    inline bool readAll(int FD, void *Data, size_t Size)
+    {
+        char *P = static_cast<char *>(Data);
+        while (Size)
+        {
+            ssize_t N = read(FD, P, Size);
+            if (N <= 0)
+                return false;
+            P += N;
+            Size -= N;
+        }
+        return true;
+    }
+
+    inline bool writeString(int FD, const std::string &S)
+    {
+        uint32_t Len = S.size();
+        return writeAll(FD, &Len, sizeof(Len)) && writeAll(FD, S.data(), Len);
+    }
+
+    // Fails without allocating if the string is longer than MaxSize.
+    inline bool readString(int FD, std::string &S, uint32_t MaxSize = UINT32_MAX)
+    {
+        uint32_t Len;
+        if (!readAll(FD, &Len, sizeof(Len)) || Len > MaxSize)
+            return false;
+        S.resize(Len);
+        return readAll(FD, &S[0], Len);
+    }
+
+    inline bool writeStrings(int FD, const std::vector<std::string> &Strs)
+    {
+        uint32_t N = Strs.size();
+        if (!writeAll(FD, &N, sizeof(N)))
+            return false;
+        for (const std::string &S : Strs)
+            if (!writeString(FD, S))
+                return false;
+        return true;
+    }
+
+    // Reads at most MaxCount strings of MaxBytes bytes in total.
+    inline bool readStrings(int FD, std::vector<std::string> &Strs, uint32_t MaxCount, uint32_t MaxBytes)
+    {
+        uint32_t N;
+        if (!readAll(FD, &N, sizeof(N)) || N > MaxCount)
+            return false;
+        Strs.resize(N);
+        for (std::string &S : Strs)
+        {
+            if (!readString(FD, S, MaxBytes))
+                return false;
+            MaxBytes -= S.size();
+        }
+        return true;
+    }
+
+    // Serves requests on SocketPath with Workers processes until SIGINT or
+    // SIGTERM; a request is killed after TimeoutSeconds, unless that is 0.
+    // Returns the exit code of the server.
+    int runServer(const std::string &SocketPath, unsigned Workers, unsigned TimeoutSeconds,
+                  RequestHandler Handle);
+}
+
+#endif
@@ -0,0 +1,247 @@
+#include "Stats.h"
+#include "Lexer.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include <malloc.h>
+#include <sys/resource.h>
+
+namespace
+{
+  // Counts every node of a statement, visiting all children.
+  class NodeCounter : public ASTVisitor
+  {
+    CompileStats &Stats;
+    bool Shared;
+    llvm::DenseSet<Expr *> Seen; // expression nodes counted so far, if Shared
+
+    void count(Expr &Node) { ++Stats.NodesByKind[Node.getExprKind()]; }
+
+    // Returns false if Node is shared and has been counted before.
+    bool countOnce(Expr &Node)
+    {
+      if (Shared && !Seen.insert(&Node).second)
+        return false;
+      count(Node);
+      return true;
+    }
+
+    // Operands are counted from an explicit stack, so that deeply nested
+    // expressions do not exhaust the native one.
+    void countOperands(Expr &Root)
+    {
+      llvm::SmallVector<Expr *, 32> Stack;
+      Stack.push_back(&Root);
+      while (!Stack.empty())
+      {
+        Expr *E = Stack.pop_back_val();
+        if (!countOnce(*E))
+          continue;
+        if (auto *Op = llvm::dyn_cast<BinaryOp>(E))
+        {
+          Stack.push_back(Op->getLeft());
+          Stack.push_back(Op->getRight());
+        }
+        else if (auto *C = llvm::dyn_cast<Call>(E))
+          Stack.append(C->getArgs().begin(), C->getArgs().end());
+      }
+    }
+
+  public:
+    NodeCounter(CompileStats &Stats, bool Shared) : Stats(Stats), Shared(Shared) {}
+
+    virtual void visit(Goal &Node) override
+    {
+      count(Node);
+      for (Expr *Stmt : Node.getExprs())
+        Stmt->accept(*this);
+    };
+
+    virtual void visit(Factor &Node) override { countOnce(Node); };
+
+    virtual void visit(BinaryOp &Node) override { countOperands(Node); };
+
+    virtual void visit(Call &Node) override { countOperands(Node); };
+
+    virtual void visit(Assignment &Node) override
+    {
+      count(Node);
+      Node.getLeft()->accept(*this);
+      Node.getRight()->accept(*this);
+    };
+
+    virtual void visit(Declaration &Node) override
+    {
+      count(Node);
+      Stats.NumSymbols += Node.end() - Node.begin();
+      for (auto I = Node.begin_values(), E = Node.end_values(); I != E; ++I)
+        (*I)->accept(*this);
+    };
+
+    virtual void visit(BE &Node) override
+    {
+      count(Node);
+      for (Expr *Stmt : Node.getStmts())
+        Stmt->accept(*this);
+    };
+
+    virtual void visit(Loop &Node) override
+    {
+      count(Node);
+      Node.getExpr()->accept(*this);
+      Node.getBE()->accept(*this);
+    };
+
+    virtual void visit(Condition &Node) override
+    {
+      count(Node);
+      for (Expr *Guard : Node.getAllExpresions())
+        Guard->accept(*this);
+      for (BE *Body : Node.getAllBes())
+        Body->accept(*this);
+    };
+
+    virtual void visit(Read &Node) override { count(Node); };
+
+    virtual void visit(FunctionDef &Node) override
+    {
+      count(Node);
+      Stats.NumSymbols += Node.getParams().size();
+      Node.getBody()->accept(*this);
+    };
+
+    virtual void visit(Return &Node) override
+    {
+      count(Node);
+      Node.getValue()->accept(*this);
+    };
+  };
+
+  const char *getKindName(unsigned Kind)
+  {
+    switch (Kind)
+    {
+    case Expr::EK_Goal:
+      return "Goal";
+    case Expr::EK_Factor:
+      return "Factor";
+    case Expr::EK_BinaryOp:
+      return "BinaryOp";
+    case Expr::EK_Assignment:
+      return "Assignment";
+    case Expr::EK_Declaration:
+      return "Declaration";
+    case Expr::EK_BE:
+      return "BE";
+    case Expr::EK_Loop:
+      return "Loop";
+    case Expr::EK_Condition:
+      return "Condition";
+    case Expr::EK_Read:
+      return "Read";
+    case Expr::EK_FunctionDef:
+      return "FunctionDef";
+    case Expr::EK_Call:
+      return "Call";
+    case Expr::EK_Return:
+      return "Return";
+    }
+    return "driver";
+  }
+
+  const char *const PhaseNames[CompileStats::NumPhases] = {"parse", "sema", "irgen", "backend"};
+
+  int64_t getHeapInUse()
+  {
+    struct mallinfo2 Info = mallinfo2();
+    return Info.uordblks + Info.hblkhd;
+  }
+
+  uint64_t getPeakRSS()
+  {
+    struct rusage Usage;
+    if (getrusage(RUSAGE_SELF, &Usage) != 0)
+      return 0;
+    return uint64_t(Usage.ru_maxrss) * 1024;
+  }
+}
+
+void CompileStats::countTokens(llvm::StringRef Buffer)
+{
+  Lexer Lex(Buffer);
+  Token Tok;
+  for (Lex.next(Tok); !Tok.is(Token::eoi); Lex.next(Tok))
+    ++NumTokens;
+}
+
+void CompileStats::countNodes(Expr &Node, bool Shared)
+{
+  NodeCounter Counter(*this, Shared);
+  Node.accept(Counter);
+}
+
+CompileStats::Phase::Phase(CompileStats *Stats, PhaseKind Kind)
+    : Stats(Stats), Kind(Kind), Start(Stats ? getHeapInUse() : 0) {}
+
+void CompileStats::Phase::stop()
+{
+  if (Stats)
+    Stats->BytesByPhase[Kind] += getHeapInUse() - Start;
+  Stats = nullptr;
+}
+
+void CompileStats::print(llvm::raw_ostream &OS, bool JSON) const
+{
+  uint64_t NumNodes = 0;
+  for (uint64_t N : NodesByKind)
+    NumNodes += N;
+
+  if (JSON)
+  {
+    llvm::json::OStream J(OS, 2);
+    J.object([&]
+             {
+               J.attribute("tokens", int64_t(NumTokens));
+               J.attribute("symbols", int64_t(NumSymbols));
+               J.attribute("ast_nodes", int64_t(NumNodes));
+               J.attributeObject("ast_nodes_by_kind", [&]
+                                 {
+                                   for (unsigned K = 0; K != NumKinds; ++K)
+                                     J.attribute(getKindName(K), int64_t(NodesByKind[K]));
+                                 });
+               J.attributeObject("ir_by_visit", [&]
+                                 {
+                                   for (unsigned K = 0; K != NumKinds + 1; ++K)
+                                     J.attributeObject(getKindName(K), [&]
+                                                       {
+                                                         J.attribute("blocks", int64_t(BlocksByVisit[K]));
+                                                         J.attribute("instructions", int64_t(InstsByVisit[K]));
+                                                       });
+                                 });
+               J.attributeObject("bytes_allocated", [&]
+                                 {
+                                   for (unsigned P = 0; P != NumPhases; ++P)
+                                     J.attribute(PhaseNames[P], BytesByPhase[P]);
+                                 });
+               J.attribute("peak_rss_bytes", int64_t(getPeakRSS()));
+             });
+    OS << "\n";
+    return;
+  }
+
+  OS << "===-- gsm compile statistics --===\n";
+  OS << "tokens:    " << NumTokens << "\n";
+  OS << "symbols:   " << NumSymbols << "\n";
+  OS << "AST nodes: " << NumNodes << "\n";
+  for (unsigned K = 0; K != NumKinds; ++K)
+    OS << llvm::format("  %-12s %10llu\n", getKindName(K), (unsigned long long)NodesByKind[K]);
+  OS << "IR by visit method     blocks instructions\n";
+  for (unsigned K = 0; K != NumKinds + 1; ++K)
+    OS << llvm::format("  %-16s %10llu %12llu\n", getKindName(K), (unsigned long long)BlocksByVisit[K],
+                       (unsigned long long)InstsByVisit[K]);
+  OS << "bytes allocated (heap growth):\n";
+  for (unsigned P = 0; P != NumPhases; ++P)
+    OS << llvm::format("  %-12s %10lld\n", PhaseNames[P], (long long)BytesByPhase[P]);
+  OS << "peak RSS:  " << getPeakRSS() << " bytes\n";
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "AST.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+
+// Counters collected with -compile-stats. Every counting site only runs when a
+// CompileStats object was handed to it, so the counters cost nothing when the
+// option is off: the token and node counts are taken by separate walks, the IR
+// counters are behind a null check in the IR builder's inserter.
+class CompileStats
+{
+public:
+    // Slots for per-node-kind counters; the last slot holds IR that is not
+    // emitted by a visit method (main, the chunk functions and their calls).
+    static constexpr unsigned NumKinds = Expr::EK_Return + 1;
+    static constexpr unsigned Driver = NumKinds;
+
+    enum PhaseKind
+    {
+        Parse,
+        Sema,
+        IRGen,
+        Backend,
+        NumPhases
+    };
+
+    uint64_t NumTokens = 0;
+    uint64_t NumSymbols = 0; // declared variables
+    uint64_t NodesByKind[NumKinds] = {};
+    uint64_t BlocksByVisit[NumKinds + 1] = {};
+    uint64_t InstsByVisit[NumKinds + 1] = {};
+    int64_t BytesByPhase[NumPhases] = {}; // growth of the heap in use
+
+    // Lexes Buffer once more and counts its tokens.
+    void countTokens(llvm::StringRef Buffer);
+
+    // Counts the nodes below (and including) Node, and the symbols declared
+    // there. With Shared, expression nodes may have several parents (see
+    // -hash-cons) and each is counted once.
+    void countNodes(Expr &Node, bool Shared = false);
+
+    // Writes the counters and the peak RSS of the process as text or JSON.
+    void print(llvm::raw_ostream &OS, bool JSON) const;
+
+    // Adds the heap growth between construction and stop() or destruction to
+    // a phase. Does nothing when Stats is null.
+    class Phase
+    {
+        CompileStats *Stats;
+        PhaseKind Kind;
+        int64_t Start;
+
+    public:
+        Phase(CompileStats *Stats, PhaseKind Kind);
+        ~Phase() { stop(); }
+        void stop();
+    };
+};
+
+#endif
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Runs test program <name>.gsm with `gsm -run` in each compilation mode and
+# compares what it prints with <name>.out. The words of <name>.in, if there
+# is one, are the arguments of the program, and the words of <name>.flags
+# are added to the options of every mode. A test that must fail, to compile
+# or to run, has <name>.err instead, a line that gsm has to print to stderr.
+# Either way gsm itself must not crash. A program too large to check in is
+# written by a generator instead, which is run with its arguments first.
+#
+# Usage: check.sh <gsm> <name>.gsm [<generator> <arguments>...]
+
+GSM=$1
+TEST=${2%.gsm}
+shift 2
+LOG=${TMPDIR:-/tmp}/gsm-check.$$
+PROGRAM=$TEST.gsm
+STATUS=0
+
+if [ $# -gt 0 ]; then
+    PROGRAM=$LOG.gsm
+    "$@" >"$PROGRAM" || exit 1
+fi
+
+MODES="-O0 -O2 -flat-ast -fused-sema -stream -hash-cons -partial-eval
+       -checked-arith -chunk-size=1 -parse-threads=2 -g -multiversion"
+
+ARGS=
+if [ -f "$TEST.in" ]; then
+    ARGS=$(cat "$TEST.in")
+fi
+
+FLAGS=
+if [ -f "$TEST.flags" ]; then
+    FLAGS=$(cat "$TEST.flags")
+fi
+
+for MODE in $MODES; do
+    # A mode that the test always uses is only run once.
+    case " $FLAGS " in *" $MODE "*) continue ;; esac
+    if [ -f "$TEST.err" ]; then
+        if "$GSM" -run $MODE $FLAGS -input-file="$PROGRAM" -- $ARGS >/dev/null 2>"$LOG"; then
+            echo "$MODE: compiled, expected: $(cat "$TEST.err")"
+            STATUS=1
+        elif ! grep -qF -f "$TEST.err" "$LOG"; then
+            echo "$MODE: expected $(cat "$TEST.err"), got:"
+            cat "$LOG"
+            STATUS=1
+        elif grep -q "PLEASE submit a bug report" "$LOG"; then
+            echo "$MODE: gsm crashed:"
+            cat "$LOG"
+            STATUS=1
+        fi
+    elif ! "$GSM" -run $MODE $FLAGS -input-file="$PROGRAM" -- $ARGS >"$LOG" 2>&1; then
+        echo "$MODE: failed"
+        cat "$LOG"
+        STATUS=1
+    elif ! diff -u "$TEST.out" "$LOG"; then
+        echo "$MODE: wrong output"
+        STATUS=1
+    fi
+done
+rm -f "$LOG" "$LOG.gsm"
+exit $STATUS
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Writes the AST of every test program with a <name>.out to a file with
+# -emit-ast, runs that file with -load-ast and compares what it prints with
+# <name>.out, so that literals and every other node survive the round trip.
+#
+# Usage: emit-ast.sh <gsm>
+
+GSM=$1
+DIR=${TMPDIR:-/tmp}/gsm-emit-ast.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+for OUT in "$(dirname "$0")"/*.out; do
+    TEST=${OUT%.out}
+    [ -f "$TEST.gsm" ] || continue
+    ARGS=
+    if [ -f "$TEST.in" ]; then
+        ARGS=$(cat "$TEST.in")
+    fi
+    if ! "$GSM" -emit-ast="$DIR/ast" -input-file="$TEST.gsm" >"$DIR/log" 2>&1 ||
+       ! "$GSM" -run -load-ast="$DIR/ast" -- $ARGS >"$DIR/log" 2>&1; then
+        echo "$TEST: failed"
+        cat "$DIR/log"
+        STATUS=1
+    elif ! diff -u "$OUT" "$DIR/log"; then
+        echo "$TEST: wrong output after the round trip"
+        STATUS=1
+    fi
+done
+exit $STATUS
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Checks the variants that -multiversion emits: main picks one with
+# gsm_cpu_level, each variant of the body calls the chunks of its own
+# variant, and the variants have the target CPUs of their names. The program
+# is then compiled with -c, linked with the runtime and run natively, which
+# -run does not do, and has to print what the plain program prints.
+#
+# Usage: multiversion.sh <gsm> <cc>
+
+GSM=$1
+CC=$2
+DIR=${TMPDIR:-/tmp}/gsm-multiversion.$$
+RUNTIME=$(dirname "$0")/../rtGSM.c
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+PROGRAM='int a, b; read a; loopc b < a: begin b = b + 1; end if b == 5: begin a = a * b; end a = a;'
+
+"$GSM" -multiversion -chunk-size=1 -o "$DIR/mv.ll" "$PROGRAM" || exit 1
+if ! grep -q "call i32 @gsm_cpu_level()" "$DIR/mv.ll"; then
+    echo "main does not call gsm_cpu_level"
+    STATUS=1
+fi
+for VARIANT in "" .avx2 .avx512; do
+    # The chunks called from the body of one variant, and the defined ones.
+    CALLED=$(awk -v body="@gsm.body$VARIANT(" '
+        /^define/ { inbody = index($0, body) > 0 }
+        inbody && /call void @gsm.chunk/ { sub(/.*call void /, ""); sub(/\(.*/, ""); print }' "$DIR/mv.ll")
+    if [ -z "$CALLED" ]; then
+        echo "gsm.body$VARIANT calls no chunks"
+        STATUS=1
+    fi
+    for CHUNK in $CALLED; do
+        case $CHUNK in
+            *.avx2 | *.avx512) CHUNK_VARIANT=.${CHUNK##*.} ;;
+            *) CHUNK_VARIANT= ;;
+        esac
+        if [ "$CHUNK_VARIANT" != "$VARIANT" ]; then
+            echo "gsm.body$VARIANT calls $CHUNK"
+            STATUS=1
+        fi
+    done
+done
+for CPU in x86-64-v3 x86-64-v4; do
+    if ! grep -q "\"target-cpu\"=\"$CPU\"" "$DIR/mv.ll"; then
+        echo "no variant targets $CPU"
+        STATUS=1
+    fi
+done
+
+"$GSM" -run "$PROGRAM" -- 5 >"$DIR/plain.out" || exit 1
+"$GSM" -O2 -c -multiversion -o "$DIR/mv.o" "$PROGRAM" || exit 1
+"$CC" -o "$DIR/mv" "$DIR/mv.o" "$RUNTIME" || exit 1
+"$DIR/mv" 5 >"$DIR/mv.out"
+if ! diff -u "$DIR/plain.out" "$DIR/mv.out"; then
+    echo "the native -multiversion program prints something else"
+    STATUS=1
+fi
+exit $STATUS
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Feeds the same values to a program that reads them from its arguments,
+# from a file given with -f, from stdin redirected from that file and from a
+# pipe, and checks that the program writes them back every time.
+#
+# Usage: read-input.sh <gsm>
+
+GSM=$1
+DIR=${TMPDIR:-/tmp}/gsm-read.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+PROGRAM='int a, b, c, d; read a, b, c, d; a = a; b = b; c = c; d = d;'
+printf ' -2147483648,2147483647\n\t+0 ,, -17\r\n' >"$DIR/input"
+printf 'The result is: %s\n' -2147483648 2147483647 0 -17 >"$DIR/expected"
+
+"$GSM" -run "$PROGRAM" -- -2147483648 2147483647,+0 -17 >"$DIR/args"
+"$GSM" -run "$PROGRAM" -- -f "$DIR/input" >"$DIR/file"
+"$GSM" -run "$PROGRAM" <"$DIR/input" >"$DIR/stdin"
+cat "$DIR/input" | "$GSM" -run "$PROGRAM" >"$DIR/pipe"
+for WAY in args file stdin pipe; do
+    if ! diff -u "$DIR/expected" "$DIR/$WAY"; then
+        echo "reading from $WAY failed"
+        STATUS=1
+    fi
+done
+
+# Running out of input is an error that names the variable.
+if echo 1 2 3 | "$GSM" -run "$PROGRAM" >/dev/null 2>"$DIR/log" ||
+   ! grep -q "No input left for d" "$DIR/log"; then
+    echo "missing input was not reported:"
+    cat "$DIR/log"
+    STATUS=1
+fi
+exit $STATUS
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Checks the optimization remark options. An invalid pattern for -Rpass,
+# -Rpass-missed or -Rpass-analysis is an error. The YAML file written with
+# -remarks-file holds the remark that -Rpass prints, at the same GSM line
+# and column.
+#
+# Usage: remarks.sh <gsm>
+
+GSM=$1
+DIR=${TMPDIR:-/tmp}/gsm-remarks.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+for FLAG in Rpass Rpass-missed Rpass-analysis; do
+    if "$GSM" -O2 -$FLAG='(' "int a;" >/dev/null 2>"$DIR/log" ||
+       ! grep -q "invalid regex for -$FLAG: parentheses not balanced" "$DIR/log"; then
+        echo "-$FLAG accepted an invalid pattern:"
+        cat "$DIR/log"
+        STATUS=1
+    fi
+done
+
+# sq is inlined at line 4, column 5.
+printf 'def sq(a): begin return a * a; end\nint x;\nread x;\nx = sq(x);\n' >"$DIR/inline.gsm"
+if ! "$GSM" -O2 -Rpass=inline -remarks-file="$DIR/remarks.yaml" -input-file="$DIR/inline.gsm" \
+     -o /dev/null 2>"$DIR/log"; then
+    echo "-remarks-file failed:"
+    cat "$DIR/log"
+    exit 1
+fi
+if ! grep -q "inline.gsm:4:5: remark: 'gsm.fn.sq' inlined into 'main'.*\[-Rpass=inline\]" "$DIR/log"; then
+    echo "-Rpass=inline did not report the inlined call:"
+    cat "$DIR/log"
+    STATUS=1
+fi
+# The same remark as a YAML document: a Passed remark of the inliner.
+if ! awk '
+    /^--- / { passed = $2 == "!Passed"; pass = name = loc = 0 }
+    passed && /^Pass: +inline$/ { pass = 1 }
+    passed && /^Name: +Inlined$/ { name = 1 }
+    passed && /^DebugLoc: +\{ File: inline.gsm, Line: 4, Column: 5 \}$/ { loc = 1 }
+    /^\.\.\.$/ && pass && name && loc { found = 1 }
+    END { exit !found }' "$DIR/remarks.yaml"; then
+    echo "$DIR/remarks.yaml does not hold the inlining remark:"
+    cat "$DIR/remarks.yaml"
+    STATUS=1
+fi
+exit $STATUS
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Starts `gsm -serve` on its default socket in $XDG_RUNTIME_DIR, sends it a
+# request through gsm-client and checks that the client prints and exits
+# like gsm would, then stops the server and checks that it removed the
+# socket.
+#
+# Usage: server.sh <gsm> <gsm-client>
+
+GSM=$1
+CLIENT=$2
+DIR=${TMPDIR:-/tmp}/gsm-server.$$
+SERVER=
+trap '[ -n "$SERVER" ] && kill $SERVER; rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+unset GSM_SOCKET
+XDG_RUNTIME_DIR=$DIR
+export XDG_RUNTIME_DIR
+"$GSM" -serve -workers=1 2>"$DIR/server.log" &
+SERVER=$!
+for TRY in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    [ -S "$DIR/gsm.sock" ] && break
+    sleep 0.5
+done
+if [ ! -S "$DIR/gsm.sock" ]; then
+    echo "the server did not create $DIR/gsm.sock:"
+    cat "$DIR/server.log"
+    exit 1
+fi
+
+# The client resolves the relative -input-file in its own directory.
+printf 'int a;\nread a;\na = a * 2;\n' >"$DIR/double.gsm"
+(cd "$DIR" && "$CLIENT" -run -input-file=double.gsm -- 21) >"$DIR/out" 2>&1
+if ! echo "The result is: 42" | diff -u - "$DIR/out"; then
+    echo "the request through gsm-client failed"
+    STATUS=1
+fi
+
+# So do errors and the exit code.
+if "$CLIENT" -run "int a; a = b;" >/dev/null 2>"$DIR/err" ||
+   ! grep -q "Variable b is not declared" "$DIR/err"; then
+    echo "the failing request was not reported:"
+    cat "$DIR/err"
+    STATUS=1
+fi
+
+kill -TERM $SERVER
+wait $SERVER
+CODE=$?
+SERVER=
+if [ $CODE -ne 0 ] || [ -e "$DIR/gsm.sock" ]; then
+    echo "the server exited with $CODE and left the socket behind:"
+    cat "$DIR/server.log"
+    STATUS=1
+fi
+exit $STATUS
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Compiles a small program with -compile-stats-json and checks the keys of
+# the JSON and the counts that do not depend on the host: tokens, symbols
+# and AST nodes by kind. Also checks that -compile-stats prints them as text.
+#
+# Usage: stats.sh <gsm>
+
+GSM=$1
+DIR=${TMPDIR:-/tmp}/gsm-stats.$$
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR" || exit 1
+STATUS=0
+
+PROGRAM='int a, b;
+read a;
+loopc a < 10: begin a = a + 1; end
+b = a * 2;'
+
+if ! "$GSM" -compile-stats-json -o /dev/null "$PROGRAM" 2>"$DIR/json"; then
+    echo "-compile-stats-json failed:"
+    cat "$DIR/json"
+    exit 1
+fi
+
+# Tokens include the end of input; the loop condition is a binary operator.
+cat >"$DIR/expected" <<'END'
+{
+  "tokens": 27,
+  "symbols": 2,
+  "ast_nodes": 18,
+  "ast_nodes_by_kind": {
+    "Goal": 1,
+    "Factor": 8,
+    "BinaryOp": 3,
+    "Assignment": 2,
+    "Declaration": 1,
+    "BE": 1,
+    "Loop": 1,
+    "Condition": 0,
+    "Read": 1,
+    "FunctionDef": 0,
+    "Call": 0,
+    "Return": 0
+  },
+END
+if ! head -n 18 "$DIR/json" | diff -u "$DIR/expected" -; then
+    echo "wrong counts"
+    STATUS=1
+fi
+for KEY in ir_by_visit driver bytes_allocated parse sema irgen backend peak_rss_bytes; do
+    if ! grep -q "^ *\"$KEY\": " "$DIR/json"; then
+        echo "no key $KEY in:"
+        cat "$DIR/json"
+        STATUS=1
+    fi
+done
+
+if ! "$GSM" -compile-stats -o /dev/null "$PROGRAM" 2>&1 | grep -q "^AST nodes: 18$"; then
+    echo "-compile-stats did not print the AST nodes"
+    STATUS=1
+fi
+exit $STATUS